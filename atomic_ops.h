@@ -0,0 +1,27 @@
+/* Audiotap shared library: a higher-level interface to TAP shared library
+ *
+ * Loads, stores and increments of variables shared between threads
+ *
+ * The program is distributed under the GNU Lesser General Public License.
+ * See file LESSER-LICENSE.TXT for details.
+ */
+
+#ifndef ATOMIC_OPS_H
+#define ATOMIC_OPS_H
+
+/* ATOMIC_FETCH_ADD needs x to be a long, and returns its previous value */
+
+#if defined __GNUC__
+#define ATOMIC_LOAD(x)     __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define ATOMIC_STORE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+#define ATOMIC_FETCH_ADD(x, v) __atomic_fetch_add(&(x), (v), __ATOMIC_ACQ_REL)
+#else
+#include <intrin.h>
+/* Microsoft's compilers give accesses to volatile variables acquire and
+   release semantics */
+#define ATOMIC_LOAD(x)     (x)
+#define ATOMIC_STORE(x, v) ((x) = (v))
+#define ATOMIC_FETCH_ADD(x, v) _InterlockedExchangeAdd(&(x), (v))
+#endif
+
+#endif /* ATOMIC_OPS_H */
@@ -0,0 +1,300 @@
+/* Audiotap shared library: a higher-level interface to TAP shared library
+ *
+ * audiotap-bench: measures how fast each kind of file is written and read.
+ * Files are generated from the same synthetic pulses, and the built-in pulse
+ * detector and synthesizer are used, so results do not depend on the other
+ * libraries installed
+ *
+ * The program is distributed under the GNU Lesser General Public License.
+ * See file LESSER-LICENSE.TXT for details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+#include "audiotap_testfiles.h"
+
+/* Played in real time, so fewer: about one second */
+#define PLAY_PULSES 2000
+
+static void usage(const char *name){
+  fprintf(stderr,
+    "Usage: %s [options]\n"
+    "Writes, converts and reads generated TAP, DMP, CSW and WAV files, and\n"
+    "reports pulses per second, MB per second and nanoseconds per pulse for\n"
+    "each\n"
+    "  -n pulses   number of pulses in each file (default: 1000000)\n"
+    "  -r rounds   run each case this many times, keep the fastest (default: 3)\n"
+    "  -d dir      directory for the generated files (default: current)\n"
+    "  -k          keep the generated files\n"
+    "  -x          use the TAP encoder and decoder libraries, if available\n"
+    "  -p          also play some pulses to the sound card through a ring\n"
+    "              buffer\n"
+    "  -c          print comma-separated values\n", name);
+}
+
+static double now(void){
+#ifdef _WIN32
+  LARGE_INTEGER count, freq;
+
+  QueryPerformanceCounter(&count);
+  QueryPerformanceFrequency(&freq);
+  return (double)count.QuadPart / freq.QuadPart;
+#else
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+}
+
+static uint64_t file_size(const char *name){
+  struct stat st;
+
+  return stat(name, &st) == 0 ? (uint64_t)st.st_size : 0;
+}
+
+/* ----------------------------------- cases ----------------------------------- */
+
+enum bench_kind {
+  WRITE_TAP,
+  WRITE_WAV,
+  GENERATE_DMP,
+  GENERATE_CSW,
+  GENERATE_CSW_ZRLE,
+  GENERATE_WAV,
+  CONVERT_TAP,
+  READ,
+  READ_IN_PARALLEL
+};
+
+static const struct bench_case {
+  const char *format;
+  const char *file;
+  enum bench_kind kind;
+  uint8_t arg;      /* version, bits or threads */
+  const char *from; /* file converted */
+} cases[] = {
+  {"tap-v0"       , "v0.tap"   , WRITE_TAP        ,  0, NULL    },
+  {"tap-v1"       , "v1.tap"   , WRITE_TAP        ,  1, NULL    },
+  {"tap-v2"       , "v2.tap"   , WRITE_TAP        ,  2, NULL    },
+  {"wav-8"        , "8.wav"    , WRITE_WAV        ,  8, NULL    },
+  {"wav-16"       , "16.wav"   , WRITE_WAV        , 16, NULL    },
+  {"wav-24"       , "24.wav"   , WRITE_WAV        , 24, NULL    },
+  {"wav-32"       , "32.wav"   , WRITE_WAV        , 32, NULL    },
+  {"dmp-8"        , "8.dmp"    , GENERATE_DMP     ,  8, NULL    },
+  {"dmp-16"       , "16.dmp"   , GENERATE_DMP     , 16, NULL    },
+  {"dmp-24"       , "24.dmp"   , GENERATE_DMP     , 24, NULL    },
+  {"dmp-32"       , "32.dmp"   , GENERATE_DMP     , 32, NULL    },
+  {"csw-v1"       , "v1.csw"   , GENERATE_CSW     ,  1, NULL    },
+  {"csw-v2"       , "v2.csw"   , GENERATE_CSW     ,  2, NULL    },
+  {"csw-v2-zrle"  , "v2z.csw"  , GENERATE_CSW_ZRLE,  2, NULL    },
+  {"wav-16-gaps"  , "16g.wav"  , GENERATE_WAV     ,  0, NULL    },
+  {"tap-v0-v1"    , "v0v1.tap" , CONVERT_TAP      ,  1, "v0.tap"},
+  {"tap-v0-v2"    , "v0v2.tap" , CONVERT_TAP      ,  2, "v0.tap"},
+  {"tap-v1-v0"    , "v1v0.tap" , CONVERT_TAP      ,  0, "v1.tap"},
+  {"tap-v1-v2"    , "v1v2.tap" , CONVERT_TAP      ,  2, "v1.tap"},
+  {"tap-v2-v0"    , "v2v0.tap" , CONVERT_TAP      ,  0, "v2.tap"},
+  {"tap-v2-v1"    , "v2v1.tap" , CONVERT_TAP      ,  1, "v2.tap"},
+  {"tap-v0"       , "v0.tap"   , READ             ,  0, NULL    },
+  {"tap-v1"       , "v1.tap"   , READ             ,  0, NULL    },
+  {"tap-v2"       , "v2.tap"   , READ             ,  0, NULL    },
+  {"dmp-8"        , "8.dmp"    , READ             ,  0, NULL    },
+  {"dmp-16"       , "16.dmp"   , READ             ,  0, NULL    },
+  {"dmp-24"       , "24.dmp"   , READ             ,  0, NULL    },
+  {"dmp-32"       , "32.dmp"   , READ             ,  0, NULL    },
+  {"csw-v1"       , "v1.csw"   , READ             ,  0, NULL    },
+  {"csw-v2"       , "v2.csw"   , READ             ,  0, NULL    },
+  {"csw-v2-zrle"  , "v2z.csw"  , READ             ,  0, NULL    },
+  {"wav-8"        , "8.wav"    , READ             ,  0, NULL    },
+  {"wav-16"       , "16.wav"   , READ             ,  0, NULL    },
+  {"wav-24"       , "24.wav"   , READ             ,  0, NULL    },
+  {"wav-32"       , "32.wav"   , READ             ,  0, NULL    },
+  {"wav-16-gaps"  , "16g.wav"  , READ             ,  0, NULL    },
+  {"wav-16-thread", "16.wav"   , READ_IN_PARALLEL ,  4, NULL    },
+  {"wav-gaps-thr" , "16g.wav"  , READ_IN_PARALLEL ,  4, NULL    }
+};
+
+int main(int argc, char **argv){
+  size_t num_pulses = 1000000, i;
+  unsigned int rounds = 3;
+  const char *dir = ".";
+  int keep = 0, external = 0, csv = 0, playback = 0, failed = 0, opt;
+  uint32_t *pulses;
+
+  while ((opt = getopt(argc, argv, "n:r:d:kxpc")) != -1){
+    switch(opt){
+    case 'n':
+      num_pulses = (size_t)atol(optarg);
+      break;
+    case 'r':
+      rounds = (unsigned int)atoi(optarg);
+      break;
+    case 'd':
+      dir = optarg;
+      break;
+    case 'k':
+      keep = 1;
+      break;
+    case 'x':
+      external = 1;
+      break;
+    case 'p':
+      playback = 1;
+      break;
+    case 'c':
+      csv = 1;
+      break;
+    default:
+      usage(argv[0]);
+      return 2;
+    }
+  }
+  if (optind != argc || num_pulses == 0 || rounds == 0){
+    usage(argv[0]);
+    return 2;
+  }
+  pulses = make_pulses(num_pulses);
+  if (pulses == NULL){
+    fprintf(stderr, "Out of memory\n");
+    return 1;
+  }
+
+  audiotap_initialize2();
+  if (!external){
+    audiotap_set_pulse_detector(AUDIOTAP_ENGINE_BUILTIN);
+    audiotap_set_synthesizer(AUDIOTAP_ENGINE_BUILTIN);
+  }
+
+  if (csv)
+    printf("operation,format,pulses,bytes,seconds,pulses_per_sec,mb_per_sec,ns_per_pulse\n");
+  else
+    printf("%-9s %-14s %10s %12s %9s %12s %9s %9s\n",
+           "operation", "format", "pulses", "bytes", "seconds", "pulses/s", "MB/s", "ns/pulse");
+  for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++){
+    const struct bench_case *c = cases + i;
+    const char *operation = c->kind == READ || c->kind == READ_IN_PARALLEL ? "read"
+      : c->kind == CONVERT_TAP ? "convert" : "write";
+    char *name = (char *)malloc(strlen(dir) + strlen(c->file) + 17);
+    char *from = NULL;
+    enum audiotap_status ret = AUDIOTAP_OK;
+    double best = 0;
+    size_t done = 0;
+    uint64_t bytes;
+    unsigned int round;
+
+    if (name == NULL
+     || (c->from != NULL && (from = (char *)malloc(strlen(dir) + strlen(c->from) + 17)) == NULL)){
+      fprintf(stderr, "Out of memory\n");
+      return 1;
+    }
+    sprintf(name, "%s/audiotap-bench-%s", dir, c->file);
+    if (from != NULL)
+      sprintf(from, "%s/audiotap-bench-%s", dir, c->from);
+    /* DMP, CSW and WAV files with gaps are generated once, and not timed */
+    if (c->kind == GENERATE_DMP || c->kind == GENERATE_CSW || c->kind == GENERATE_CSW_ZRLE
+     || c->kind == GENERATE_WAV){
+      ret = c->kind == GENERATE_DMP ? write_dmp(name, pulses, num_pulses, c->arg)
+        : c->kind == GENERATE_WAV ? write_wav_with_gaps(name, pulses, num_pulses)
+        : write_csw(name, pulses, num_pulses, c->arg, c->kind == GENERATE_CSW_ZRLE);
+      if (ret != AUDIOTAP_OK){
+        fprintf(stderr, "Cannot generate %s: %s\n", name, status_text(ret));
+        failed = 1;
+      }
+      free(name);
+      free(from);
+      continue;
+    }
+    for (round = 0; round < rounds && ret == AUDIOTAP_OK; round++){
+      double start = now(), elapsed;
+
+      switch(c->kind){
+      case WRITE_TAP:
+        ret = write_tap(name, pulses, num_pulses, c->arg);
+        done = num_pulses;
+        break;
+      case WRITE_WAV:
+        ret = write_wav(name, pulses, num_pulses, c->arg);
+        done = num_pulses;
+        break;
+      case CONVERT_TAP:
+        ret = convert_tap(from, name, c->arg);
+        done = num_pulses;
+        break;
+      case READ_IN_PARALLEL:
+        ret = read_file(name, c->arg, NULL, 0, &done);
+        break;
+      default:
+        ret = read_file(name, -1, NULL, 0, &done);
+        break;
+      }
+      elapsed = now() - start;
+      if (round == 0 || elapsed < best)
+        best = elapsed;
+    }
+    if (ret != AUDIOTAP_OK){
+      /* Z-RLE needs zlib, which is not always there */
+      fprintf(stderr, "%s %s: %s\n", operation, c->format, status_text(ret));
+      if (ret != AUDIOTAP_LIBRARY_UNAVAILABLE)
+        failed = 1;
+      free(name);
+      free(from);
+      continue;
+    }
+    if (best <= 0)
+      best = 1e-9;
+    bytes = file_size(name);
+    if (csv)
+      printf("%s,%s,%lu,%llu,%.6f,%.0f,%.2f,%.2f\n",
+             operation, c->format, (unsigned long)done, (unsigned long long)bytes, best,
+             done / best, bytes / best / 1e6, done ? best * 1e9 / done : 0);
+    else
+      printf("%-9s %-14s %10lu %12llu %9.4f %12.0f %9.2f %9.2f\n",
+             operation, c->format, (unsigned long)done, (unsigned long long)bytes, best,
+             done / best, bytes / best / 1e6, done ? best * 1e9 / done : 0);
+    fflush(stdout);
+    free(name);
+    free(from);
+  }
+
+  if (playback){
+    size_t n = num_pulses < PLAY_PULSES ? num_pulses : PLAY_PULSES;
+    double start = now(), elapsed;
+    enum audiotap_status ret = play(pulses, n);
+
+    elapsed = now() - start;
+    if (ret != AUDIOTAP_OK){
+      fprintf(stderr, "play ring: %s\n", status_text(ret));
+      if (ret != AUDIOTAP_LIBRARY_UNAVAILABLE)
+        failed = 1;
+    }
+    else if (csv)
+      printf("play,ring,%lu,,%.6f,,,\n", (unsigned long)n, elapsed);
+    else
+      printf("%-9s %-14s %10lu %12s %9.4f\n", "play", "ring", (unsigned long)n, "", elapsed);
+    fflush(stdout);
+  }
+
+  if (!keep){
+    for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++){
+      char *name = (char *)malloc(strlen(dir) + strlen(cases[i].file) + 17);
+
+      if (name == NULL)
+        continue;
+      sprintf(name, "%s/audiotap-bench-%s", dir, cases[i].file);
+      remove(name);
+      free(name);
+    }
+  }
+  free(pulses);
+  audiotap_terminate_lib();
+  return failed;
+}
@@ -0,0 +1,462 @@
+/* Audiotap shared library: a higher-level interface to TAP shared library
+ *
+ * audiotap-conformance: writes the same generated pulses to every kind of
+ * file, and to WAV files converted from TAP files and back, reads them
+ * through the public API and checks that they are those written: exactly
+ * in TAP files, within one sample where they were stored as samples. Also
+ * checks that detecting pulses on several threads gives exactly the pulses
+ * of one thread and, when the TAP decoder library is installed, that it
+ * and the built-in synthesizer give the same pulses. Reports how long
+ * writing and reading took, and exits with an error if any check fails.
+ * The built-in pulse detector and synthesizer are used otherwise
+ *
+ * The program is distributed under the GNU Lesser General Public License.
+ * See file LESSER-LICENSE.TXT for details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+#include "audiotap_testfiles.h"
+
+/* The first edge of an audio file has no sample before it, so no detector
+   sees it, and the first two pulses written are read as one. These two are
+   written before the generated pulses, so that each of those is read, and
+   checked, on its own */
+#define LEAD_IN_PULSE 688
+#define LEAD_IN 2
+/* Played in real time, so fewer: about one second */
+#define PLAY_PULSES 2000
+
+static void usage(const char *name){
+  fprintf(stderr,
+    "Usage: %s [options]\n"
+    "Writes generated pulses to TAP, DMP, CSW and WAV files, converts TAP\n"
+    "files, reads all of them back and checks that the pulses are those\n"
+    "written. Exits with 1 if any are not\n"
+    "  -n pulses   number of pulses in each file (default: 100000)\n"
+    "  -d dir      directory for the generated files (default: current)\n"
+    "  -k          keep the generated files\n"
+    "  -p          also play some pulses to the sound card through a ring\n"
+    "              buffer, and check them if it is the null device\n", name);
+}
+
+static double now(void){
+#ifdef _WIN32
+  LARGE_INTEGER count, freq;
+
+  QueryPerformanceCounter(&count);
+  QueryPerformanceFrequency(&freq);
+  return (double)count.QuadPart / freq.QuadPart;
+#else
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+}
+
+static uint64_t file_size(const char *name){
+  struct stat st;
+
+  return stat(name, &st) == 0 ? (uint64_t)st.st_size : 0;
+}
+
+/* ----------------------------------- cases ----------------------------------- */
+
+enum conformance_kind {
+  TAP_FILE,
+  TAP_CONVERSION,
+  DMP_FILE,
+  CSW_FILE,
+  CSW_ZRLE_FILE,
+  WAV_FILE,
+  WAV_WITH_GAPS,
+  WAV_CONVERSION,    /* from a TAP file */
+  TAP_FROM_WAV,      /* converted from a WAV file */
+  PARALLEL_READ,     /* of a file already written */
+  EXTERNAL_SYNTHESIZER,
+  EXTERNAL_DETECTOR  /* reads a file already written */
+};
+
+/* How the pulses read back are compared with the ones written */
+enum conformance_check {
+  CHECK_EXACT,
+  CHECK_EXACT_SHORT, /* TAP v0: pulses of 0x800 cycles or more become 0 */
+  CHECK_ONE_SAMPLE,  /* of the file the pulses were stored in */
+  CHECK_AUDIO,       /* the same, and the lead-in pulses are one */
+  CHECK_SEQUENTIAL,  /* exactly the pulses of a read on one thread */
+  CHECK_DETECTORS    /* within one sample of the built-in detector's pulses */
+};
+
+static const struct conformance_case {
+  const char *format;
+  const char *file;
+  enum conformance_kind kind;
+  uint8_t arg;      /* version, bits or threads */
+  enum conformance_check check;
+  const char *from; /* file converted, or compared with */
+} cases[] = {
+  {"tap-v0"       , "v0.tap"   , TAP_FILE            ,  0, CHECK_EXACT_SHORT, NULL    },
+  {"tap-v1"       , "v1.tap"   , TAP_FILE            ,  1, CHECK_EXACT      , NULL    },
+  {"tap-v2"       , "v2.tap"   , TAP_FILE            ,  2, CHECK_EXACT      , NULL    },
+  {"tap-v0-v1"    , "v0v1.tap" , TAP_CONVERSION      ,  1, CHECK_EXACT_SHORT, "v0.tap"},
+  {"tap-v0-v2"    , "v0v2.tap" , TAP_CONVERSION      ,  2, CHECK_EXACT_SHORT, "v0.tap"},
+  {"tap-v1-v0"    , "v1v0.tap" , TAP_CONVERSION      ,  0, CHECK_EXACT_SHORT, "v1.tap"},
+  {"tap-v1-v2"    , "v1v2.tap" , TAP_CONVERSION      ,  2, CHECK_EXACT      , "v1.tap"},
+  {"tap-v2-v0"    , "v2v0.tap" , TAP_CONVERSION      ,  0, CHECK_EXACT_SHORT, "v2.tap"},
+  {"tap-v2-v1"    , "v2v1.tap" , TAP_CONVERSION      ,  1, CHECK_EXACT      , "v2.tap"},
+  {"dmp-8"        , "8.dmp"    , DMP_FILE            ,  8, CHECK_ONE_SAMPLE , NULL    },
+  {"dmp-16"       , "16.dmp"   , DMP_FILE            , 16, CHECK_ONE_SAMPLE , NULL    },
+  {"dmp-24"       , "24.dmp"   , DMP_FILE            , 24, CHECK_ONE_SAMPLE , NULL    },
+  {"dmp-32"       , "32.dmp"   , DMP_FILE            , 32, CHECK_ONE_SAMPLE , NULL    },
+  {"csw-v1"       , "v1.csw"   , CSW_FILE            ,  1, CHECK_ONE_SAMPLE , NULL    },
+  {"csw-v2"       , "v2.csw"   , CSW_FILE            ,  2, CHECK_ONE_SAMPLE , NULL    },
+  {"csw-v2-zrle"  , "v2z.csw"  , CSW_ZRLE_FILE       ,  2, CHECK_ONE_SAMPLE , NULL    },
+  {"wav-8"        , "8.wav"    , WAV_FILE            ,  8, CHECK_AUDIO      , NULL    },
+  {"wav-16"       , "16.wav"   , WAV_FILE            , 16, CHECK_AUDIO      , NULL    },
+  {"wav-24"       , "24.wav"   , WAV_FILE            , 24, CHECK_AUDIO      , NULL    },
+  {"wav-32"       , "32.wav"   , WAV_FILE            , 32, CHECK_AUDIO      , NULL    },
+  {"wav-16-gaps"  , "16g.wav"  , WAV_WITH_GAPS       , 16, CHECK_AUDIO      , NULL    },
+  {"tap-wav"      , "tw.wav"   , WAV_CONVERSION      , 16, CHECK_AUDIO      , "v1.tap"},
+  {"tap-wav-tap"  , "twt.tap"  , TAP_FROM_WAV        ,  1, CHECK_AUDIO      , "tw.wav"},
+  {"wav-16-thread", "16.wav"   , PARALLEL_READ       ,  4, CHECK_SEQUENTIAL , NULL    },
+  {"wav-gaps-thr" , "16g.wav"  , PARALLEL_READ       ,  4, CHECK_SEQUENTIAL , NULL    },
+  {"synth-engines", "16x.wav"  , EXTERNAL_SYNTHESIZER, 16, CHECK_SEQUENTIAL , "16.wav"},
+  {"detect-engine", "16.wav"   , EXTERNAL_DETECTOR   , 16, CHECK_DETECTORS  , NULL    }
+};
+
+/* ---------------------------------- checks ---------------------------------- */
+
+/* One sample period, in clock cycles, rounded up: the most a pulse can be
+   off by where it was stored as samples */
+static uint32_t one_sample(uint32_t freq){
+  return (C64_PAL_CLOCK + freq - 1) / freq;
+}
+
+static uint32_t tolerance(const struct conformance_case *c){
+  switch(c->check){
+  case CHECK_ONE_SAMPLE:
+    return one_sample(c->kind == DMP_FILE ? dmp_freq(c->arg) : AUDIO_FREQ);
+  case CHECK_DETECTORS:
+    return one_sample(AUDIO_FREQ);
+  case CHECK_AUDIO:
+    /* TAP files store short pulses in units of 8 cycles */
+    return one_sample(AUDIO_FREQ) + (c->kind == TAP_FROM_WAV ? 7 : 0);
+  default:
+    return 0;
+  }
+}
+
+static int same_pulse(const struct conformance_case *c, uint32_t expected, uint32_t got){
+  uint32_t max_difference = tolerance(c);
+
+  if (c->check == CHECK_EXACT_SHORT && expected >= 0x800)
+    return got >= 0x800;
+  return got + max_difference >= expected && got <= expected + max_difference;
+}
+
+/* Counts the pulses which differ, or are missing or in excess, and reports
+   the first one */
+static size_t count_differences(const struct conformance_case *c,
+                                const uint32_t *expected, size_t num_expected,
+                                const uint32_t *got, size_t num_got){
+  size_t differences = 0, i;
+  uint32_t lead_in = 0;
+
+  /* the lead-in pulses are read as one */
+  if (c->check == CHECK_AUDIO){
+    for (i = 0; i < LEAD_IN; i++)
+      lead_in += expected[i];
+    expected += LEAD_IN - 1;
+    num_expected -= LEAD_IN - 1;
+  }
+  for (i = 0; i < num_got && i < num_expected; i++){
+    uint32_t wanted = i == 0 && c->check == CHECK_AUDIO ? lead_in : expected[i];
+
+    if (!same_pulse(c, wanted, got[i])){
+      if (differences == 0)
+        fprintf(stderr, "%s: pulse %lu is %lu instead of %lu\n", c->format,
+                (unsigned long)i, (unsigned long)got[i], (unsigned long)wanted);
+      differences++;
+    }
+  }
+  if (num_got != num_expected){
+    fprintf(stderr, "%s: %lu pulses instead of %lu\n", c->format,
+            (unsigned long)num_got, (unsigned long)num_expected);
+    differences += num_got > num_expected ? num_got - num_expected : num_expected - num_got;
+  }
+  return differences;
+}
+
+/* The null device plays silence when the ring is empty, so silent samples
+   are not compared. Samples which differ, or are missing or in excess, are
+   counted */
+static size_t compare_played(const char *played_name, const char *wav_name){
+  size_t num_played, num_expected, i = 0, j = 0, differences = 0;
+  int32_t *played = read_samples(played_name, 0, &num_played);
+  int32_t *expected = read_samples(wav_name, 44, &num_expected);
+
+  if (played == NULL || expected == NULL)
+    differences = 1;
+  else
+    while (1){
+      while (i < num_played && played[i] == 0)
+        i++;
+      while (j < num_expected && expected[j] == 0)
+        j++;
+      if (i == num_played || j == num_expected){
+        differences += num_played - i + num_expected - j;
+        break;
+      }
+      if (played[i++] != expected[j++])
+        differences++;
+    }
+  free(played);
+  free(expected);
+  return differences;
+}
+
+static char *file_name(const char *dir, const char *file){
+  char *name = (char *)malloc(strlen(dir) + strlen(file) + 24);
+
+  if (name != NULL)
+    sprintf(name, "%s/audiotap-conformance-%s", dir, file);
+  return name;
+}
+
+static void print_result(const char *format, size_t pulses, double write_time, double read_time, const char *result){
+  char write_text[16] = "", read_text[16] = "";
+
+  if (write_time >= 0)
+    sprintf(write_text, "%.4f", write_time);
+  if (read_time >= 0)
+    sprintf(read_text, "%.4f", read_time);
+  printf("%-14s %10lu %9s %9s %s\n", format, (unsigned long)pulses, write_text, read_text, result);
+  fflush(stdout);
+}
+
+/* Writes (or converts) the file of a case. The synthesizer is the built-in
+   one, unless the case is about the other one */
+static enum audiotap_status write_case(const struct conformance_case *c, const char *name, const char *from,
+                                       const uint32_t *pulses, size_t n){
+  enum audiotap_status ret;
+
+  switch(c->kind){
+  case TAP_FILE:
+    return write_tap(name, pulses, n, c->arg);
+  case TAP_CONVERSION:
+  case TAP_FROM_WAV:
+    return convert_tap(from, name, c->arg);
+  case DMP_FILE:
+    return write_dmp(name, pulses, n, c->arg);
+  case CSW_FILE:
+  case CSW_ZRLE_FILE:
+    return write_csw(name, pulses, n, c->arg, c->kind == CSW_ZRLE_FILE);
+  case WAV_FILE:
+    return write_wav(name, pulses, n, c->arg);
+  case WAV_WITH_GAPS:
+    return write_wav_with_gaps(name, pulses, n);
+  case WAV_CONVERSION:
+    return convert_to_wav(from, name, c->arg);
+  case EXTERNAL_SYNTHESIZER:
+    audiotap_set_synthesizer(AUDIOTAP_ENGINE_EXTERNAL);
+    ret = write_wav(name, pulses, n, c->arg);
+    audiotap_set_synthesizer(AUDIOTAP_ENGINE_BUILTIN);
+    return ret;
+  default:
+    return AUDIOTAP_OK;
+  }
+}
+
+int main(int argc, char **argv){
+  size_t num_pulses = 100000, num_written, i;
+  const char *dir = ".";
+  int keep = 0, playback = 0, failed = 0, opt;
+  uint32_t *written, *read_back, *reference;
+  char *played_env, *played_name, *play_wav_name;
+
+  while ((opt = getopt(argc, argv, "n:d:kp")) != -1){
+    switch(opt){
+    case 'n':
+      num_pulses = (size_t)atol(optarg);
+      break;
+    case 'd':
+      dir = optarg;
+      break;
+    case 'k':
+      keep = 1;
+      break;
+    case 'p':
+      playback = 1;
+      break;
+    default:
+      usage(argv[0]);
+      return 2;
+    }
+  }
+  if (optind != argc || num_pulses == 0){
+    usage(argv[0]);
+    return 2;
+  }
+  /* the lead-in, then the generated pulses */
+  num_written = LEAD_IN + num_pulses;
+  written = (uint32_t *)malloc(num_written * sizeof(uint32_t));
+  read_back = (uint32_t *)malloc(num_written * sizeof(uint32_t));
+  reference = (uint32_t *)malloc(num_written * sizeof(uint32_t));
+  played_env = (char *)malloc(strlen(dir) + 64);
+  play_wav_name = file_name(dir, "play.wav");
+  if (written == NULL || read_back == NULL || reference == NULL
+   || played_env == NULL || play_wav_name == NULL){
+    fprintf(stderr, "Out of memory\n");
+    return 1;
+  }
+  {
+    uint32_t *generated = make_pulses(num_pulses);
+
+    if (generated == NULL){
+      fprintf(stderr, "Out of memory\n");
+      return 1;
+    }
+    for (i = 0; i < LEAD_IN; i++)
+      written[i] = LEAD_IN_PULSE;
+    memcpy(written + LEAD_IN, generated, num_pulses * sizeof(uint32_t));
+    free(generated);
+  }
+  /* The null device writes what it plays there (the real one ignores it).
+     The string becomes part of the environment, so it is never freed */
+  sprintf(played_env, "AUDIOTAP_NULL_OUTPUT=%s/audiotap-conformance-played.raw", dir);
+  putenv(played_env);
+  played_name = played_env + strlen("AUDIOTAP_NULL_OUTPUT=");
+  remove(played_name);
+
+  audiotap_initialize2();
+  audiotap_set_pulse_detector(AUDIOTAP_ENGINE_BUILTIN);
+  audiotap_set_synthesizer(AUDIOTAP_ENGINE_BUILTIN);
+
+  printf("%-14s %10s %9s %9s %s\n", "format", "pulses", "write s", "read s", "check");
+  for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++){
+    const struct conformance_case *c = cases + i;
+    char *name = file_name(dir, c->file);
+    char *from = c->from != NULL ? file_name(dir, c->from) : NULL;
+    enum audiotap_status ret;
+    const uint32_t *expected = written;
+    size_t num_expected = num_written, num_read = 0, differences = 0;
+    double start, write_time = -1, read_time;
+
+    if (name == NULL || (c->from != NULL && from == NULL)){
+      fprintf(stderr, "Out of memory\n");
+      return 1;
+    }
+    start = now();
+    ret = write_case(c, name, from, written, num_written);
+    if (c->kind != PARALLEL_READ && c->kind != EXTERNAL_DETECTOR)
+      write_time = now() - start;
+    if (ret == AUDIOTAP_OK
+     && (c->check == CHECK_SEQUENTIAL || c->check == CHECK_DETECTORS)){
+      /* read from the other file, or from this one on one thread with the
+         built-in detector */
+      ret = read_file(from != NULL ? from : name, -1, reference, num_written, &num_expected);
+      expected = reference;
+      if (num_expected > num_written)
+        ret = AUDIOTAP_ERR;
+    }
+    start = now();
+    if (ret == AUDIOTAP_OK){
+      if (c->kind == EXTERNAL_DETECTOR)
+        audiotap_set_pulse_detector(AUDIOTAP_ENGINE_EXTERNAL);
+      ret = read_file(name, c->kind == PARALLEL_READ ? c->arg : -1, read_back, num_written, &num_read);
+      audiotap_set_pulse_detector(AUDIOTAP_ENGINE_BUILTIN);
+    }
+    read_time = now() - start;
+    /* Z-RLE needs zlib, and the other synthesizer and detector their
+       libraries: they are not always there */
+    if (ret == AUDIOTAP_LIBRARY_UNAVAILABLE){
+      print_result(c->format, 0, -1, -1, "skipped, library not available");
+      free(name);
+      free(from);
+      continue;
+    }
+    if (ret == AUDIOTAP_OK)
+      differences = count_differences(c, expected, num_expected, read_back, num_read);
+    else
+      fprintf(stderr, "%s: %s\n", c->format, status_text(ret));
+    if (ret != AUDIOTAP_OK || differences != 0){
+      if (differences != 0)
+        fprintf(stderr, "%s: %lu pulses differ\n", c->format, (unsigned long)differences);
+      failed = 1;
+    }
+    print_result(c->format, num_read, write_time, read_time,
+                 ret == AUDIOTAP_OK && differences == 0 ? "ok" : "FAIL");
+    free(name);
+    free(from);
+  }
+
+  if (playback){
+    size_t n = num_written < PLAY_PULSES ? num_written : PLAY_PULSES;
+    double start = now(), elapsed;
+    enum audiotap_status ret = play(written, n);
+
+    elapsed = now() - start;
+    if (ret == AUDIOTAP_LIBRARY_UNAVAILABLE)
+      print_result("play-ring", n, -1, -1, "skipped, library not available");
+    /* with the null device, what was played is there */
+    else if (ret == AUDIOTAP_OK && file_size(played_name) == 0)
+      print_result("play-ring", n, elapsed, -1, "skipped, not the null device");
+    else{
+      size_t differences = 0;
+
+      if (ret == AUDIOTAP_OK){
+        ret = write_wav(play_wav_name, written, n, 32);
+        differences = compare_played(played_name, play_wav_name);
+      }
+      if (ret != AUDIOTAP_OK || differences != 0){
+        fprintf(stderr, "play-ring: %s, %lu samples differ\n", status_text(ret), (unsigned long)differences);
+        failed = 1;
+      }
+      print_result("play-ring", n, elapsed, -1, ret == AUDIOTAP_OK && differences == 0 ? "ok" : "FAIL");
+
+      /* A device which goes away must not leave writing or closing stuck */
+      if (ret == AUDIOTAP_OK){
+        static char stop_after[] = "AUDIOTAP_NULL_STOP_AFTER=4410";
+
+        putenv(stop_after);
+        start = now();
+        ret = play(written, n);
+        elapsed = now() - start;
+        if (ret != AUDIOTAP_LIBRARY_ERROR || elapsed >= 5){
+          fprintf(stderr, "play-stopped: returned %d after %.1f s\n", (int)ret, elapsed);
+          failed = 1;
+        }
+        print_result("play-stopped", n, elapsed, -1,
+                     ret == AUDIOTAP_LIBRARY_ERROR && elapsed < 5 ? "ok" : "FAIL");
+      }
+    }
+  }
+
+  if (!keep){
+    remove(played_name);
+    remove(play_wav_name);
+    for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++){
+      char *name = file_name(dir, cases[i].file);
+
+      if (name == NULL)
+        continue;
+      remove(name);
+      free(name);
+    }
+  }
+  free(written);
+  free(read_back);
+  free(reference);
+  audiotap_terminate_lib();
+  return failed;
+}
@@ -0,0 +1,215 @@
+/* Audiotap shared library: a higher-level interface to TAP shared library
+ *
+ * audiotap-convert: converts many files at once to TAP or WAV, using all
+ * processor cores
+ *
+ * The program is distributed under the GNU Lesser General Public License.
+ * See file LESSER-LICENSE.TXT for details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "audiotap.h"
+
+static const char *status_text(enum audiotap_status status){
+  switch(status){
+  case AUDIOTAP_OK: return "OK";
+  case AUDIOTAP_NO_MEMORY: return "out of memory";
+  case AUDIOTAP_LIBRARY_UNAVAILABLE: return "a needed library is not available";
+  case AUDIOTAP_NO_FILE: return "cannot open file";
+  case AUDIOTAP_LIBRARY_ERROR: return "library error";
+  case AUDIOTAP_INTERRUPTED: return "interrupted";
+  case AUDIOTAP_WRONG_ARGUMENTS: return "wrong arguments";
+  case AUDIOTAP_WRONG_FILETYPE: return "unknown file type";
+  default: return "error";
+  }
+}
+
+static void usage(const char *name){
+  fprintf(stderr,
+    "Usage: %s [options] file-or-directory...\n"
+    "Converts files (TAP, DMP, CSW or audio) to TAP or WAV files\n"
+    "  -o dir      write output files to dir (default: next to input files)\n"
+    "  -t version  write TAP files of this version, 0, 1 or 2 (default: 1)\n"
+    "  -w freq     write WAV files at this sample rate instead of TAP files\n"
+    "  -b bits     bits per sample in WAV files, 8, 16, 24 or 32 (default: 8)\n"
+    "  -j threads  number of threads (default: one per processor core)\n"
+    "  -m machine  c64, vic or c16, when reading audio files (default: c64)\n"
+    "  -n          NTSC, when reading audio files\n", name);
+}
+
+static struct audiotap_conversion *conversions = NULL;
+static size_t num_conversions = 0, max_conversions = 0;
+
+static int add_conversion(const char *input, const char *outdir, const char *extension){
+  const char *name = strrchr(input, '/'), *dot;
+  size_t dirlen, namelen;
+  char *output;
+
+#ifdef _WIN32
+  if (strrchr(input, '\\') > name)
+    name = strrchr(input, '\\');
+#endif
+  name = name ? name + 1 : input;
+  dot = strrchr(name, '.');
+  namelen = dot && dot != name ? (size_t)(dot - name) : strlen(name);
+  dirlen = outdir ? strlen(outdir) + 1 : (size_t)(name - input);
+  output = (char *)malloc(dirlen + namelen + strlen(extension) + 1);
+  if (output == NULL)
+    return 0;
+  if (outdir){
+    strcpy(output, outdir);
+    strcat(output, "/");
+  }
+  else
+    memcpy(output, input, dirlen);
+  memcpy(output + dirlen, name, namelen);
+  strcpy(output + dirlen + namelen, extension);
+
+  if (num_conversions == max_conversions){
+    size_t new_max = max_conversions ? 2 * max_conversions : 256;
+    struct audiotap_conversion *new_conversions =
+      (struct audiotap_conversion *)realloc(conversions, new_max * sizeof(struct audiotap_conversion));
+    if (new_conversions == NULL){
+      free(output);
+      return 0;
+    }
+    conversions = new_conversions;
+    max_conversions = new_max;
+  }
+  conversions[num_conversions].input = strdup(input);
+  conversions[num_conversions].output = output;
+  conversions[num_conversions].status = AUDIOTAP_ERR;
+  if (conversions[num_conversions].input == NULL){
+    free(output);
+    return 0;
+  }
+  num_conversions++;
+  return 1;
+}
+
+/* Adds the files in a directory (not in its subdirectories) */
+static int add_directory(const char *dirname, const char *outdir, const char *extension){
+  DIR *dir = opendir(dirname);
+  struct dirent *entry;
+  int ok = 1;
+
+  if (dir == NULL){
+    fprintf(stderr, "Cannot read directory %s\n", dirname);
+    return 0;
+  }
+  while (ok && (entry = readdir(dir)) != NULL){
+    struct stat st;
+    char *path;
+
+    if (entry->d_name[0] == '.')
+      continue;
+    path = (char *)malloc(strlen(dirname) + strlen(entry->d_name) + 2);
+    if (path == NULL){
+      ok = 0;
+      break;
+    }
+    sprintf(path, "%s/%s", dirname, entry->d_name);
+    if (stat(path, &st) == 0 && S_ISREG(st.st_mode))
+      ok = add_conversion(path, outdir, extension);
+    free(path);
+  }
+  closedir(dir);
+  return ok;
+}
+
+int main(int argc, char **argv){
+  struct audiotap_conversion_params params;
+  const char *outdir = NULL, *extension = ".tap";
+  size_t i, failed;
+  int opt;
+
+  memset(&params, 0, sizeof(params));
+  params.output_format = AUDIOTAP_OUTPUT_TAP;
+  params.tapenc_params.sensitivity = 12;
+  params.tapenc_params.initial_threshold = 20;
+  params.machine = TAP_MACHINE_C64;
+  params.videotype = TAP_VIDEOTYPE_PAL;
+  params.tap_version = 1;
+  params.tapdec_params.volume = 254;
+  params.tapdec_params.waveform = AUDIOTAP_WAVE_SQUARE;
+
+  while ((opt = getopt(argc, argv, "o:t:w:b:j:m:n")) != -1){
+    switch(opt){
+    case 'o':
+      outdir = optarg;
+      break;
+    case 't':
+      params.tap_version = (uint8_t)atoi(optarg);
+      break;
+    case 'w':
+      params.output_format = AUDIOTAP_OUTPUT_WAV;
+      params.freq = (uint32_t)atoi(optarg);
+      extension = ".wav";
+      break;
+    case 'b':
+      params.bits = (uint8_t)atoi(optarg);
+      break;
+    case 'j':
+      params.threads = (unsigned int)atoi(optarg);
+      break;
+    case 'm':
+      if (!strcmp(optarg, "c64"))
+        params.machine = TAP_MACHINE_C64;
+      else if (!strcmp(optarg, "vic"))
+        params.machine = TAP_MACHINE_VIC;
+      else if (!strcmp(optarg, "c16"))
+        params.machine = TAP_MACHINE_C16;
+      else{
+        usage(argv[0]);
+        return 2;
+      }
+      break;
+    case 'n':
+      params.videotype = TAP_VIDEOTYPE_NTSC;
+      break;
+    default:
+      usage(argv[0]);
+      return 2;
+    }
+  }
+  if (optind == argc
+   || params.tap_version > 2
+   || (params.bits != 0 && params.bits != 8 && params.bits != 16 && params.bits != 24 && params.bits != 32)
+   || (params.output_format == AUDIOTAP_OUTPUT_WAV && params.freq == 0)){
+    usage(argv[0]);
+    return 2;
+  }
+
+  for (; optind < argc; optind++){
+    struct stat st;
+    int ok;
+
+    if (stat(argv[optind], &st) != 0){
+      fprintf(stderr, "Cannot find %s\n", argv[optind]);
+      return 1;
+    }
+    ok = S_ISDIR(st.st_mode)
+      ? add_directory(argv[optind], outdir, extension)
+      : add_conversion(argv[optind], outdir, extension);
+    if (!ok){
+      fprintf(stderr, "Out of memory\n");
+      return 1;
+    }
+  }
+
+  audiotap_initialize2();
+  failed = audiotap_convert_files(conversions, num_conversions, &params);
+  for (i = 0; i < num_conversions; i++)
+    if (conversions[i].status != AUDIOTAP_OK)
+      fprintf(stderr, "%s: %s\n", conversions[i].input, status_text(conversions[i].status));
+  printf("%lu files converted, %lu failed\n",
+         (unsigned long)(num_conversions - failed), (unsigned long)failed);
+  audiotap_terminate_lib();
+  return failed ? 1 : 0;
+}
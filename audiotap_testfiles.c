@@ -0,0 +1,347 @@
+/* Audiotap shared library: a higher-level interface to TAP shared library
+ *
+ * Generated files, and reading them back, for audiotap-bench and
+ * audiotap-conformance
+ *
+ * The program is distributed under the GNU Lesser General Public License.
+ * See file LESSER-LICENSE.TXT for details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "audiotap_testfiles.h"
+
+uint32_t *make_pulses(size_t n){
+  static const uint32_t lengths[] = {384, 528, 688};
+  uint32_t *pulses = (uint32_t *)malloc(n * sizeof(uint32_t));
+  uint32_t seed = 1;
+  size_t i;
+
+  if (pulses == NULL)
+    return NULL;
+  for (i = 0; i < n; i++){
+    seed = seed * 1103515245 + 12345;
+    pulses[i] = i % PAUSE_EVERY == PAUSE_EVERY - 1
+      ? PAUSE_PULSE
+      : lengths[(seed >> 16) % 3];
+  }
+  return pulses;
+}
+
+/* -------------------------------- writers -------------------------------- */
+
+static enum audiotap_status write_pulses(struct audiotap *audiotap, const uint32_t *pulses, size_t n){
+  enum audiotap_status ret = AUDIOTAP_OK, close_ret;
+  size_t i;
+
+  for (i = 0; i < n && ret == AUDIOTAP_OK; i += BATCH_PULSES)
+    ret = tap2audio_set_pulses(audiotap, pulses + i, n - i < BATCH_PULSES ? n - i : BATCH_PULSES);
+  close_ret = tap2audio_close(audiotap);
+  return ret != AUDIOTAP_OK ? ret : close_ret;
+}
+
+enum audiotap_status write_tap(const char *name, const uint32_t *pulses, size_t n, uint8_t version){
+  struct audiotap *audiotap;
+  enum audiotap_status ret = tap2audio_open_to_tapfile3(&audiotap, name, version, TAP_MACHINE_C64, TAP_VIDEOTYPE_PAL);
+
+  if (ret != AUDIOTAP_OK)
+    return ret;
+  return write_pulses(audiotap, pulses, n);
+}
+
+enum audiotap_status write_wav(const char *name, const uint32_t *pulses, size_t n, uint8_t bits){
+  struct tapdec_params params = {254, 0, AUDIOTAP_WAVE_SQUARE};
+  struct audiotap *audiotap;
+  enum audiotap_status ret = tap2audio_open_to_wavfile5(&audiotap, name, &params, AUDIO_FREQ, TAP_MACHINE_C64, TAP_VIDEOTYPE_PAL, bits);
+
+  if (ret != AUDIOTAP_OK)
+    return ret;
+  return write_pulses(audiotap, pulses, n);
+}
+
+enum audiotap_status convert_tap(const char *from, const char *name, uint8_t version){
+  struct audiotap_conversion_params params;
+
+  memset(&params, 0, sizeof(params));
+  params.output_format = AUDIOTAP_OUTPUT_TAP;
+  params.tap_version = version;
+  params.threads = 1;
+  return audiotap_convert_file(from, name, &params);
+}
+
+enum audiotap_status convert_to_wav(const char *from, const char *name, uint8_t bits){
+  struct audiotap_conversion_params params;
+
+  memset(&params, 0, sizeof(params));
+  params.output_format = AUDIOTAP_OUTPUT_WAV;
+  params.tapdec_params.volume = 254;
+  params.tapdec_params.waveform = AUDIOTAP_WAVE_SQUARE;
+  params.freq = AUDIO_FREQ;
+  params.bits = bits;
+  params.threads = 1;
+  return audiotap_convert_file(from, name, &params);
+}
+
+enum audiotap_status play(const uint32_t *pulses, size_t n){
+  struct tapdec_params params = {254, 0, AUDIOTAP_WAVE_SQUARE};
+  struct audiotap *audiotap;
+  enum audiotap_status ret = tap2audio_open_to_soundcard5(&audiotap, &params, AUDIO_FREQ, TAP_MACHINE_C64, TAP_VIDEOTYPE_PAL, 256, 50);
+
+  if (ret != AUDIOTAP_OK)
+    return ret;
+  return write_pulses(audiotap, pulses, n);
+}
+
+static void put_le(uint8_t *out, uint32_t value, int bytes){
+  int i;
+
+  for (i = 0; i < bytes; i++)
+    out[i] = (uint8_t)(value >> (8 * i));
+}
+
+static uint32_t to_samples(uint32_t cycles, uint32_t freq){
+  return (uint32_t)((uint64_t)cycles * freq / C64_PAL_CLOCK);
+}
+
+uint32_t dmp_freq(uint8_t bits){
+  return bits == 8 ? 250000 : 1000000;
+}
+
+/* Long pulses are split with the overflow value */
+enum audiotap_status write_dmp(const char *name, const uint32_t *pulses, size_t n, uint8_t bits){
+  const uint32_t freq = dmp_freq(bits);
+  const uint32_t overflow_value = bits == 32 ? 0xFFFFFFFF : (1u << bits) - 1;
+  const int bytes = bits / 8;
+  uint8_t header[20], sample[4];
+  FILE *file = fopen(name, "wb");
+  size_t i;
+
+  if (file == NULL)
+    return AUDIOTAP_NO_FILE;
+  memcpy(header, "DC2N-TAP-RAW", 12);
+  header[12] = 1;
+  header[13] = TAP_MACHINE_C64;
+  header[14] = TAP_VIDEOTYPE_PAL;
+  header[15] = bits;
+  put_le(header + 16, freq, 4);
+  fwrite(header, sizeof(header), 1, file);
+  for (i = 0; i < n; i++){
+    uint32_t samples = to_samples(pulses[i], freq);
+
+    put_le(sample, overflow_value, bytes);
+    for (; samples >= overflow_value; samples -= overflow_value)
+      fwrite(sample, bytes, 1, file);
+    put_le(sample, samples, bytes);
+    fwrite(sample, bytes, 1, file);
+  }
+  return fclose(file) == 0 ? AUDIOTAP_OK : AUDIOTAP_ERR;
+}
+
+static uint32_t adler32(const uint8_t *data, size_t len){
+  uint32_t a = 1, b = 0;
+  size_t i;
+
+  for (i = 0; i < len; i++){
+    a = (a + data[i]) % 65521;
+    b = (b + a) % 65521;
+  }
+  return (b << 16) | a;
+}
+
+static size_t put_csw_run(uint8_t *data, uint32_t samples){
+  if (samples == 0)
+    samples = 1;
+  if (samples < 256){
+    data[0] = (uint8_t)samples;
+    return 1;
+  }
+  data[0] = 0;
+  put_le(data + 1, samples, 4);
+  return 5;
+}
+
+/* Each pulse is two runs, and the signal starts high, so that they are
+   read together. Z-RLE data is written as stored (uncompressed) deflate
+   blocks, which needs no zlib here */
+enum audiotap_status write_csw(const char *name, const uint32_t *pulses, size_t n, uint8_t version, int compressed){
+  static const char signature[] = "Compressed Square Wave\x1a";
+  const uint32_t freq = AUDIO_FREQ;
+  uint8_t header[52], *data = (uint8_t *)malloc(10 * n);
+  size_t i, len = 0, header_len;
+  FILE *file;
+  enum audiotap_status ret = AUDIOTAP_OK;
+
+  if (data == NULL)
+    return AUDIOTAP_NO_MEMORY;
+  for (i = 0; i < n; i++){
+    uint32_t samples = to_samples(pulses[i], freq);
+
+    len += put_csw_run(data + len, samples / 2);
+    len += put_csw_run(data + len, samples - samples / 2);
+  }
+  memset(header, 0, sizeof(header));
+  memcpy(header, signature, 23);
+  header[23] = version;
+  if (version == 1){
+    header[24] = 1;
+    put_le(header + 25, freq, 2);
+    header[27] = 1;
+    header[28] = 1;
+    header_len = 32;
+  }
+  else{
+    put_le(header + 25, freq, 4);
+    put_le(header + 29, (uint32_t)(2 * n), 4);
+    header[33] = compressed ? 2 : 1;
+    header[34] = 1;
+    memcpy(header + 36, "audiotap-bench", 14);
+    header_len = 52;
+  }
+  file = fopen(name, "wb");
+  if (file == NULL){
+    free(data);
+    return AUDIOTAP_NO_FILE;
+  }
+  fwrite(header, header_len, 1, file);
+  if (!compressed)
+    fwrite(data, len, 1, file);
+  else{
+    static const uint8_t zlib_header[2] = {0x78, 0x01};
+    uint8_t block_header[5], trailer[4];
+    uint32_t adler = adler32(data, len);
+
+    fwrite(zlib_header, 2, 1, file);
+    for (i = 0; i < len || i == 0; i += 65535){
+      size_t block_len = len - i < 65535 ? len - i : 65535;
+
+      block_header[0] = i + block_len == len;
+      put_le(block_header + 1, (uint32_t)block_len, 2);
+      put_le(block_header + 3, (uint32_t)~block_len, 2);
+      fwrite(block_header, 5, 1, file);
+      fwrite(data + i, block_len, 1, file);
+    }
+    trailer[0] = adler >> 24;
+    trailer[1] = adler >> 16;
+    trailer[2] = adler >> 8;
+    trailer[3] = adler;
+    fwrite(trailer, 4, 1, file);
+  }
+  free(data);
+  if (fclose(file) != 0)
+    ret = AUDIOTAP_ERR;
+  return ret;
+}
+
+static void put_square(FILE *file, int16_t level, uint32_t samples){
+  uint8_t data[512];
+  uint32_t i;
+
+  for (i = 0; i < sizeof(data) / 2; i++)
+    put_le(data + 2 * i, (uint16_t)level, 2);
+  for (; samples > 0; samples -= i){
+    i = samples < sizeof(data) / 2 ? samples : sizeof(data) / 2;
+    fwrite(data, 2, i, file);
+  }
+}
+
+/* The library writes no silence, so 16-bit WAV files with real pauses,
+   where detecting pulses in parallel splits the file, are generated here.
+   Each pulse is one period of a square wave; a pause is silent up to its
+   last 8 samples. Pulses start at the sample their start in cycles falls
+   in, like those the library writes, so that rounding does not add up */
+enum audiotap_status write_wav_with_gaps(const char *name, const uint32_t *pulses, size_t n){
+  const uint32_t freq = AUDIO_FREQ;
+  uint8_t header[44];
+  uint64_t len, cycles = 0;
+  FILE *file;
+  size_t i;
+
+  for (i = 0; i < n; i++)
+    cycles += pulses[i];
+  len = cycles * freq / C64_PAL_CLOCK;
+  if (2 * len > 0xFFFFFFFF - 36)
+    return AUDIOTAP_ERR;
+  memcpy(header, "RIFF", 4);
+  put_le(header + 4, (uint32_t)(36 + 2 * len), 4);
+  memcpy(header + 8, "WAVEfmt ", 8);
+  put_le(header + 16, 16, 4);
+  put_le(header + 20, 1, 2);
+  put_le(header + 22, 1, 2);
+  put_le(header + 24, freq, 4);
+  put_le(header + 28, 2 * freq, 4);
+  put_le(header + 32, 2, 2);
+  put_le(header + 34, 16, 2);
+  memcpy(header + 36, "data", 4);
+  put_le(header + 40, (uint32_t)(2 * len), 4);
+  file = fopen(name, "wb");
+  if (file == NULL)
+    return AUDIOTAP_NO_FILE;
+  fwrite(header, sizeof(header), 1, file);
+  for (i = 0, cycles = 0; i < n; i++){
+    uint32_t samples = (uint32_t)((cycles + pulses[i]) * freq / C64_PAL_CLOCK - cycles * freq / C64_PAL_CLOCK);
+
+    if (pulses[i] == PAUSE_PULSE){
+      put_square(file, 0, samples - 8);
+      samples = 8;
+    }
+    put_square(file, -SQUARE_LEVEL, samples / 2);
+    put_square(file, SQUARE_LEVEL, samples - samples / 2);
+    cycles += pulses[i];
+  }
+  return fclose(file) == 0 ? AUDIOTAP_OK : AUDIOTAP_ERR;
+}
+
+/* -------------------------------- readers -------------------------------- */
+
+static uint32_t read_buffer[BATCH_PULSES], read_raw_buffer[BATCH_PULSES];
+
+enum audiotap_status read_file(const char *name, int threads, uint32_t *pulses, size_t max, size_t *n){
+  struct tapenc_params params = {0, 12, 20, 0};
+  uint8_t machine = TAP_MACHINE_C64, videotype = TAP_VIDEOTYPE_PAL, halfwaves = 0;
+  struct audiotap *audiotap;
+  enum audiotap_status ret = audio2tap_open_from_file3(&audiotap, name, &params, &machine, &videotype, &halfwaves);
+
+  *n = 0;
+  if (ret != AUDIOTAP_OK)
+    return ret;
+  if (threads >= 0)
+    ret = audio2tap_detect_pulses_in_parallel(audiotap, (unsigned int)threads);
+  while (ret == AUDIOTAP_OK){
+    size_t got;
+
+    ret = audio2tap_get_pulses_batch(audiotap, read_buffer, read_raw_buffer, BATCH_PULSES, &got);
+    if (pulses != NULL && *n < max)
+      memcpy(pulses + *n, read_buffer, (max - *n < got ? max - *n : got) * sizeof(uint32_t));
+    *n += got;
+  }
+  audio2tap_close(audiotap);
+  return ret == AUDIOTAP_EOF ? AUDIOTAP_OK : ret;
+}
+
+int32_t *read_samples(const char *name, long skip, size_t *n){
+  FILE *file = fopen(name, "rb");
+  int32_t *samples = NULL;
+  long size;
+
+  *n = 0;
+  if (file == NULL)
+    return NULL;
+  if (fseek(file, 0, SEEK_END) == 0
+   && (size = ftell(file)) >= skip
+   && fseek(file, skip, SEEK_SET) == 0
+   && (samples = (int32_t *)malloc(size - skip + sizeof(int32_t))) != NULL)
+    *n = fread(samples, sizeof(int32_t), (size - skip) / sizeof(int32_t), file);
+  fclose(file);
+  return samples;
+}
+
+const char *status_text(enum audiotap_status status){
+  switch(status){
+  case AUDIOTAP_NO_MEMORY: return "out of memory";
+  case AUDIOTAP_LIBRARY_UNAVAILABLE: return "library not available";
+  case AUDIOTAP_NO_FILE: return "cannot open file";
+  case AUDIOTAP_WRONG_FILETYPE: return "unknown file type";
+  default: return "error";
+  }
+}
@@ -0,0 +1,56 @@
+/* Audiotap shared library: a higher-level interface to TAP shared library
+ *
+ * Generated files, and reading them back, for audiotap-bench and
+ * audiotap-conformance
+ *
+ * The program is distributed under the GNU Lesser General Public License.
+ * See file LESSER-LICENSE.TXT for details.
+ */
+
+#ifndef AUDIOTAP_TESTFILES_H
+#define AUDIOTAP_TESTFILES_H
+
+#include <stddef.h>
+#include "audiotap.h"
+
+#define C64_PAL_CLOCK 985248
+/* Pulses are written and read this many at a time */
+#define BATCH_PULSES 4096
+/* A pause of 1/5 s every 10000 pulses */
+#define PAUSE_PULSE (C64_PAL_CLOCK / 5)
+#define PAUSE_EVERY 10000
+/* Level of square waves written here, like those of the library at volume 254 */
+#define SQUARE_LEVEL (254 << 7)
+/* Sample rate of the CSW and WAV files, and of the sound card */
+#define AUDIO_FREQ 44100
+
+/* Pulses (in clock cycles) like those of the Commodore ROM loader, with
+   pauses. Always the same ones */
+uint32_t *make_pulses(size_t n);
+
+/* Written by the library, with square waves for audio */
+enum audiotap_status write_tap(const char *name, const uint32_t *pulses, size_t n, uint8_t version);
+enum audiotap_status write_wav(const char *name, const uint32_t *pulses, size_t n, uint8_t bits);
+enum audiotap_status convert_tap(const char *from, const char *name, uint8_t version);
+enum audiotap_status convert_to_wav(const char *from, const char *name, uint8_t bits);
+enum audiotap_status play(const uint32_t *pulses, size_t n);
+
+/* The library has no writer for DMP and CSW files, so they are generated
+   here, as well as 16-bit WAV files with real silences in the pauses, which
+   the library does not write either */
+uint32_t dmp_freq(uint8_t bits);
+enum audiotap_status write_dmp(const char *name, const uint32_t *pulses, size_t n, uint8_t bits);
+enum audiotap_status write_csw(const char *name, const uint32_t *pulses, size_t n, uint8_t version, int compressed);
+enum audiotap_status write_wav_with_gaps(const char *name, const uint32_t *pulses, size_t n);
+
+/* Reads all the pulses of a file, and counts them in *n. The first max go
+   to pulses, unless it is NULL. threads < 0 reads normally, otherwise
+   pulses are detected on that many threads first */
+enum audiotap_status read_file(const char *name, int threads, uint32_t *pulses, size_t max, size_t *n);
+
+/* The 32-bit samples of a file, skipping skip bytes at the start */
+int32_t *read_samples(const char *name, long skip, size_t *n);
+
+const char *status_text(enum audiotap_status status);
+
+#endif /*AUDIOTAP_TESTFILES_H*/
@@ -16,48 +16,114 @@
  * See file LESSER-LICENSE.TXT for details.
  */
 
+/* Files bigger than 2 GB must work on 32-bit systems too */
+#define _FILE_OFFSET_BITS 64
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
 #ifdef _MSC_VER
 #define STDOUT_FILENO   1
 #else
 #include <unistd.h>
 #endif
+#ifndef _WIN32
+#include <sys/mman.h>
+#else
+#define fseeko _fseeki64
+#define ftello _ftelli64
+#define fstat _fstati64
+#define stat _stati64
+#endif
 #include "audiofile.h"
 #include "portaudio.h"
 #include "tapencoder.h"
 #include "tapdecoder.h"
+#include "tapencoder_builtin.h"
+#include "tapdecoder_builtin.h"
+#include "pcm_convert.h"
+#include "zlib.h"
 #include "audiotap.h"
 #include "wait_event.h"
+#include "atomic_ops.h"
+#include "ring_buffer.h"
+#include "threads.h"
+
+/* What a saved index must match to be usable with an input */
+struct index_key {
+  uint64_t size;
+  int64_t mtime;
+  uint32_t mode;
+};
 
 struct audio2tap_functions {
-  enum audiotap_status(*get_pulse)(struct audiotap *audiotap, uint32_t *pulse, uint32_t *raw_pulse);
-  enum audiotap_status(*set_buffer)(void *priv, int32_t *buffer, uint32_t bufsize, uint32_t *numframes);
-  int (*get_total_len)(struct audiotap *audiotap);
-  int (*get_current_pos)(struct audiotap *audiotap);
+  enum audiotap_status(*get_pulses)(struct audiotap *audiotap, uint32_t *pulse, uint32_t *raw_pulse, size_t max, size_t *got);
+  enum audiotap_status(*set_buffer)(struct audiotap *audiotap, int32_t *buffer, uint32_t bufsize, uint32_t *numframes);
+  int64_t (*get_total_len)(struct audiotap *audiotap);
+  int64_t (*get_current_pos)(struct audiotap *audiotap);
   int (*is_eof)(struct audiotap *audiotap);
   void (*invert)(struct audiotap *audiotap);
   int (*seek_to_beginning)(struct audiotap *audiotap);
   void (*enable_disable_halfwaves)(struct audiotap *audiotap, int halfwaves);
   void (*close)(void *priv);
+  /* Position where reading can restart after the last pulse read, -1 if
+     reading cannot restart from there */
+  int64_t (*tell)(struct audiotap *audiotap);
+  /* Restarts reading from a position returned by tell() */
+  int (*seek)(struct audiotap *audiotap, int64_t offset);
+  /* If not NULL, jumps close to the given time without decoding anything */
+  int (*seek_to_cycles)(struct audiotap *audiotap, uint64_t cycles);
+  /* Identifies the file and how it is being read. NULL if the index
+     cannot be saved */
+  int (*get_index_key)(struct audiotap *audiotap, struct index_key *key);
+  /* If not NULL, opens another reader of the same input, independent of
+     this one, at the given frame. Audio is then read from it by read_frames
+     (like set_buffer) on any thread. Returns NULL on failure */
+  void *(*open_reader)(struct audiotap *audiotap, int64_t frame);
+  enum audiotap_status(*read_frames)(void *reader, int32_t *buffer, uint32_t bufsize, uint32_t *numframes);
+  void (*close_reader)(void *reader);
 };
 
 struct tap2audio_functions {
   void                (*set_pulse)(struct audiotap *audiotap, uint32_t pulse);
+  /* Puts data in audiotap->buffer, returns its size */
   uint32_t            (*get_buffer)(struct audiotap *audiotap);
-  enum audiotap_status(*dump_buffer)(uint8_t *buffer, uint32_t bufroom, void *priv);
+  enum audiotap_status(*dump_buffer)(struct audiotap *audiotap, uint8_t *buffer, uint32_t bufroom);
+  /* Does set_pulse, get_buffer and dump_buffer for n pulses */
+  enum audiotap_status(*set_pulses)(struct audiotap *audiotap, const uint32_t *pulses, size_t n);
   void                (*enable_halfwaves)(struct audiotap *audiotap, uint8_t halfwaves);
   void                (*pause)(void *priv);
   void                (*resume)(void *priv);
-  void                (*close)(void *priv);
+  /* Fails if the end of the output (e.g. a file header) cannot be written */
+  enum audiotap_status(*close)(void *priv);
 };
 
+/* Size of the blocks read from TAP files which cannot be memory-mapped,
+   and of the blocks inflated from compressed CSW files */
+#define READ_BLOCK_SIZE 65536
+
 struct tap_read_handle {
   FILE *file;
+  /* Bytes available to the decoders: the whole file if it could be mapped,
+     otherwise the last block read from it */
+  const uint8_t *read_ptr, *read_end;
+  void *map;
+  size_t map_size;
+  uint8_t *block;
+  int64_t block_pos; /* file offset of block[0] */
+  int64_t data_start; /* file offset of the first pulse */
+  uint8_t view_ended; /* the last attempt to fill the block came up short */
+  z_stream *zstream; /* only Z-RLE compressed CSW files use it */
+  uint8_t *zinput;
+  uint8_t zstream_ended; /* the end marker of the compressed data was seen */
+  uint8_t view_error; /* the compressed data is corrupt or truncated */
   enum {
     only_full_waves_supported,
     only_full_waves_supported_v0,
@@ -65,7 +131,13 @@ struct tap_read_handle {
     reading_single_halfwave,
     reading_single_halfwave_one_shot
   } wave_mode;
-  enum audiotap_status(*get_wave)(struct audiotap *audiotap, uint32_t *pulse, uint32_t *raw_pulse);
+  /* When reading both halfwaves, whether the first one from the beginning
+     of data is alone */
+  uint8_t starts_one_shot;
+  /* Decodes up to max pulses (halfwaves, when the file has them) into
+     pulse and raw_pulse. *got is always set; the return value is
+     AUDIOTAP_OK only if max pulses were decoded */
+  enum audiotap_status(*get_pulses)(struct audiotap *audiotap, uint32_t *pulse, uint32_t *raw_pulse, size_t max, size_t *got);
   union{
     uint8_t last_was_0; /* only TAP v0 files use it */
     struct {            /* only DMP files use it */
@@ -75,8 +147,14 @@ struct tap_read_handle {
   };
 };
 
+/* Size of the buffer where TAP writers collect data before writing it */
+#define WRITE_BLOCK_SIZE 65536
+
 struct tap_write_handle {
   FILE *file;
+  uint8_t *outbuf;
+  uint32_t outused;
+  uint64_t written; /* bytes of pulse data written to the file so far */
   unsigned char version;
   uint32_t next_pulse;
   uint32_t second_halfwave;
@@ -88,36 +166,163 @@ struct tap_write_handle {
 static const char c64_tap_header[] = "C64-TAPE-RAW";
 static const char c16_tap_header[] = "C16-TAPE-RAW";
 
+/* A point of the input where reading can restart */
+struct checkpoint {
+  int64_t offset;
+  uint64_t cycles;
+  uint64_t pulse_number;
+  uint32_t remainder;
+};
+
+#define DEFAULT_CHECKPOINT_INTERVAL 4096
+
+/* Pulses are detected either by the TAP encoder library or by the built-in
+   encoder, which has the same interface */
+struct tapenc_functions {
+  struct tap_enc_t *(*init2)(uint32_t min_duration, uint8_t sensitivity, uint8_t initial_threshold, uint8_t inverted);
+  uint32_t (*get_pulse)(struct tap_enc_t *tap, int32_t *buffer, uint32_t buflen, uint32_t *pulse);
+  uint32_t (*flush)(struct tap_enc_t *tap);
+  int32_t (*get_max)(struct tap_enc_t *tap);
+  void (*invert)(struct tap_enc_t *tap);
+  void (*toggle_trigger_on_both_edges)(struct tap_enc_t *tap, uint8_t both_edges);
+  void (*set_silence_threshold)(struct tap_enc_t *tap, uint8_t silence_threshold, uint32_t min_non_silence_duration);
+  void (*exit)(struct tap_enc_t *tap);
+  /* NULL for the library, whose state cannot be copied or compared: then
+     pulses are not detected on several threads */
+  struct tap_enc_t *(*clone)(const struct tap_enc_t *tap);
+  int (*same_state)(const struct tap_enc_t *a, const struct tap_enc_t *b);
+};
+
+/* Audio is synthesized either by the TAP decoder library or by the built-in
+   decoder, which has the same interface */
+struct tapdec_functions {
+  struct tap_dec_t *(*init2)(uint32_t volume, uint8_t inverted, enum tapdec_waveform waveform);
+  void (*set_pulse)(struct tap_dec_t *tap, uint32_t pulse);
+  uint32_t (*get_buffer)(struct tap_dec_t *tap, int32_t *buffer, unsigned int buflen);
+  void (*enable_halfwaves)(struct tap_dec_t *tap, uint8_t halfwaves);
+  void (*exit)(struct tap_dec_t *tap);
+};
+
+/* Frames exchanged with audio files and sound cards at a time */
+#define DEFAULT_BUFFER_FRAMES 512
+
 struct audiotap {
   struct tap_enc_t *tapenc;
+  const struct tapenc_functions *tapenc_functions;
   struct tap_dec_t *tapdec;
-  uint8_t *buffer, bufstart[2048];
+  const struct tapdec_functions *tapdec_functions;
+  uint8_t *buffer, *bufstart;
   uint32_t bufroom;
-  int terminated;
+  uint32_t bufsize; /* in frames */
+  volatile int terminated; /* can be set by another thread */
   int has_flushed;
-  float factor;
-  uint32_t accumulated_samples;
+  uint64_t accumulated_samples;
   const struct tap2audio_functions *tap2audio_functions;
   const struct audio2tap_functions *audio2tap_functions;
   struct wait_event *wait_event;
   void *priv;
+  uint32_t freq;
+  uint32_t clock;
+  uint32_t remainder;    /* left over by the last conversion between samples
+                            and cycles, in 1/freq cycles or 1/clock samples */
+  uint64_t pulse_number; /* pulses read so far */
+  uint64_t cycles;       /* their total length (or that of those written) */
+  uint8_t position_known; /* 0 after jumping to a time in an audio file */
+  struct checkpoint *checkpoints;
+  size_t num_checkpoints, max_checkpoints;
+  uint32_t checkpoint_interval;
+  char *file_name;       /* only audio files opened by name have it */
+  /* What is needed to create encoders like tapenc */
+  struct tapenc_params tapenc_params;
+  uint8_t both_edges;
+  uint32_t carry;         /* samples flushed where the sound card lost some,
+                             not yet in a pulse */
+  uint32_t lost_before_buffer; /* samples the sound card lost before the
+                                  ones just read */
+  /* Pulses detected in advance, on several threads. Read before anything
+     else, if not NULL */
+  uint32_t *detected_pulses;
+  size_t num_detected_pulses, next_detected_pulse;
+  uint32_t bytes_per_frame; /* of audio inputs, for the statistics */
+  struct audiotap_stats stats;
+  uint32_t untimed_calls; /* for single pulses, since the last timed one */
+#ifdef AUDIOTAP_TRACE
+  audiotap_trace_callback trace;
+  void *trace_context;
+  uint32_t trace_pulses; /* given to the synthesizer, not traced yet */
+#endif
 };
 
+/* Tracing is only compiled in with AUDIOTAP_TRACE. TRACE_START gives the
+   time a stage starts at, the other macros report it when it ends */
+#ifdef AUDIOTAP_TRACE
+static void trace_stage(struct audiotap *audiotap, enum audiotap_trace_stage stage, uint64_t start, uint32_t samples, uint32_t pulses){
+  struct audiotap_trace_event event;
+
+  event.stage = stage;
+  event.start_ns = start;
+  event.end_ns = get_time_ns();
+  event.samples = samples;
+  event.pulses = pulses;
+  audiotap->trace(audiotap->trace_context, &event);
+}
+
+#define TRACE_START(audiotap) ((audiotap)->trace != NULL ? get_time_ns() : 0)
+#define TRACE(audiotap, stage, start, samples, pulses)            \
+  do{                                                             \
+    if ((audiotap)->trace != NULL)                                \
+      trace_stage(audiotap, stage, start, samples, pulses);       \
+  }while(0)
+#define TRACE_PULSE(audiotap) ((audiotap)->trace_pulses++)
+#define TRACE_SYNTHESIZE(audiotap, start, samples)                \
+  do{                                                             \
+    if ((audiotap)->trace != NULL){                               \
+      trace_stage(audiotap, AUDIOTAP_TRACE_SYNTHESIZE, start,     \
+                  samples, (audiotap)->trace_pulses);             \
+      (audiotap)->trace_pulses = 0;                               \
+    }                                                             \
+  }while(0)
+#else
+#define TRACE_START(audiotap) 0
+#define TRACE(audiotap, stage, start, samples, pulses) ((void)(start))
+#define TRACE_PULSE(audiotap) ((void)0)
+#define TRACE_SYNTHESIZE(audiotap, start, samples) ((void)(start))
+#endif
+
 extern struct audiotap_init_status status;
 
-static const float tap_clocks[TAP_MACHINE_MAX+1][TAP_VIDEOTYPE_MAX+1]={
+static const uint32_t tap_clocks[TAP_MACHINE_MAX+1][TAP_VIDEOTYPE_MAX+1]={
   {985248,1022727}, /* C64 */
   {1108405,1022727}, /* VIC */
   {886724,894886}  /* C16 */
 };
 
+/* Lengths are converted exactly, as fractions of freq and clock. What is
+   left over is carried to the next conversion, so there is no drift */
+static uint32_t samples_to_cycles(struct audiotap *audiotap, uint32_t samples){
+  uint64_t total = (uint64_t)samples * audiotap->clock + audiotap->remainder;
+  uint64_t cycles = total / audiotap->freq;
+
+  audiotap->remainder = (uint32_t)(total - cycles * audiotap->freq);
+  return cycles > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t)cycles;
+}
+
+static uint32_t cycles_to_samples(struct audiotap *audiotap, uint32_t cycles){
+  uint64_t total = (uint64_t)cycles * audiotap->freq + audiotap->remainder;
+  uint64_t samples = total / audiotap->clock;
+
+  audiotap->remainder = (uint32_t)(total - samples * audiotap->clock);
+  return (uint32_t)samples;
+}
+
 static uint32_t convert_samples(struct audiotap *audiotap, uint32_t raw_samples){
   audiotap->accumulated_samples += raw_samples;
-  return (uint32_t)(raw_samples * audiotap->factor);
+  return samples_to_cycles(audiotap, raw_samples);
 }
 
 static enum audiotap_status audio2tap_open_common(struct audiotap **audiotap,
                                                   struct tap_enc_t *tapenc,
+                                                  const struct tapenc_functions *tapenc_functions,
                                                   uint32_t freq,
                                                   uint8_t machine,
                                                   uint8_t videotype,
@@ -135,17 +340,131 @@ static enum audiotap_status audio2tap_open_common(struct audiotap **audiotap,
     obj->priv = priv;
     obj->audio2tap_functions = audio2tap_functions;
     obj->bufroom = 0;
-    obj->factor = tap_clocks[machine][videotype] / freq;	 
     obj->tapenc = tapenc;
+    obj->tapenc_functions = tapenc_functions;
+    obj->freq = freq;
+    obj->clock = tap_clocks[machine][videotype];
+    obj->position_known = 1;
+    obj->checkpoint_interval = DEFAULT_CHECKPOINT_INTERVAL;
+    if (tapenc != NULL){
+      obj->bufsize = DEFAULT_BUFFER_FRAMES;
+      obj->bufstart = (uint8_t *)malloc(obj->bufsize * sizeof(int32_t));
+      if (obj->bufstart == NULL)
+        break;
+    }
     error = AUDIOTAP_OK;
   }while(0);
- if (error == AUDIOTAP_OK)
-   *audiotap = obj;
- else	 
-   audio2tap_close(obj);  *audiotap = obj;
+  if (error == AUDIOTAP_OK)
+    *audiotap = obj;
+  else{
+    audio2tap_functions->close(priv);
+    if (tapenc != NULL)
+      tapenc_functions->exit(tapenc);
+    free(obj);
+    *audiotap = NULL;
+  }
   return error;
 }
 
+static struct tap_enc_t *external_tapenc_init2(uint32_t min_duration, uint8_t sensitivity, uint8_t initial_threshold, uint8_t inverted){
+  return tapenc_init2(min_duration, sensitivity, initial_threshold, inverted);
+}
+
+static uint32_t external_tapenc_get_pulse(struct tap_enc_t *tap, int32_t *buffer, uint32_t buflen, uint32_t *pulse){
+  return tapenc_get_pulse(tap, buffer, buflen, pulse);
+}
+
+static uint32_t external_tapenc_flush(struct tap_enc_t *tap){
+  return tapenc_flush(tap);
+}
+
+static int32_t external_tapenc_get_max(struct tap_enc_t *tap){
+  return tapenc_get_max(tap);
+}
+
+static void external_tapenc_invert(struct tap_enc_t *tap){
+  tapenc_invert(tap);
+}
+
+static void external_tapenc_toggle_trigger_on_both_edges(struct tap_enc_t *tap, uint8_t both_edges){
+  tapenc_toggle_trigger_on_both_edges(tap, both_edges);
+}
+
+static void external_tapenc_set_silence_threshold(struct tap_enc_t *tap, uint8_t silence_threshold, uint32_t min_non_silence_duration){
+  tapenc_set_silence_threshold(tap, silence_threshold, min_non_silence_duration);
+}
+
+static void external_tapenc_exit(struct tap_enc_t *tap){
+  tapenc_exit(tap);
+}
+
+static const struct tapenc_functions external_tapenc_functions = {
+  external_tapenc_init2,
+  external_tapenc_get_pulse,
+  external_tapenc_flush,
+  external_tapenc_get_max,
+  external_tapenc_invert,
+  external_tapenc_toggle_trigger_on_both_edges,
+  external_tapenc_set_silence_threshold,
+  external_tapenc_exit,
+  NULL,
+  NULL
+};
+
+static const struct tapenc_functions builtin_tapenc_functions = {
+  builtin_tapenc_init2,
+  builtin_tapenc_get_pulse,
+  builtin_tapenc_flush,
+  builtin_tapenc_get_max,
+  builtin_tapenc_invert,
+  builtin_tapenc_toggle_trigger_on_both_edges,
+  builtin_tapenc_set_silence_threshold,
+  builtin_tapenc_exit,
+  builtin_tapenc_clone,
+  builtin_tapenc_same_state
+};
+
+static enum audiotap_engine pulse_detector = AUDIOTAP_ENGINE_AUTO;
+
+void audiotap_set_pulse_detector(enum audiotap_engine engine){
+  pulse_detector = engine;
+}
+
+/* NULL if the chosen encoder is not available */
+static const struct tapenc_functions *get_tapenc_functions(void){
+  if (pulse_detector != AUDIOTAP_ENGINE_BUILTIN
+   && status.tapencoder_init_status == LIBRARY_OK)
+    return &external_tapenc_functions;
+  if (pulse_detector != AUDIOTAP_ENGINE_EXTERNAL)
+    return &builtin_tapenc_functions;
+  return NULL;
+}
+
+/* Samples closer to 0 than this, in 8-bit units, are silence */
+#define SILENCE_THRESHOLD 1
+
+static struct tap_enc_t *create_tapenc(const struct tapenc_functions *tapenc_functions,
+                                       const struct tapenc_params *tapenc_params,
+                                       uint32_t freq){
+  struct tap_enc_t *tapenc = tapenc_functions->init2(tapenc_params->min_duration,
+                                                     tapenc_params->sensitivity,
+                                                     tapenc_params->initial_threshold,
+                                                     tapenc_params->inverted);
+
+  if (tapenc != NULL)
+    tapenc_functions->set_silence_threshold(tapenc, SILENCE_THRESHOLD, freq/10000);
+  return tapenc;
+}
+
+/* A new encoder set up like the handle's one */
+static struct tap_enc_t *create_handle_tapenc(struct audiotap *audiotap){
+  struct tap_enc_t *tapenc = create_tapenc(audiotap->tapenc_functions, &audiotap->tapenc_params, audiotap->freq);
+
+  if (tapenc != NULL && audiotap->both_edges)
+    audiotap->tapenc_functions->toggle_trigger_on_both_edges(tapenc, 1);
+  return tapenc;
+}
+
 static enum audiotap_status audio2tap_audio_open_common(struct audiotap **audiotap,
                                                         uint32_t freq,
                                                         struct tapenc_params *tapenc_params,
@@ -154,22 +473,20 @@ static enum audiotap_status audio2tap_audio_open_common(struct audiotap **audiot
                                                         const struct audio2tap_functions *audio2tap_functions,
                                                         void *priv){
   enum audiotap_status error = AUDIOTAP_WRONG_ARGUMENTS;
+  const struct tapenc_functions *tapenc_functions = get_tapenc_functions();
   struct tap_enc_t *tapenc;
 
   do{
     if (tapenc_params == NULL)
       break;
 
+    error = AUDIOTAP_LIBRARY_UNAVAILABLE;
+    if (tapenc_functions == NULL)
+      break;
+
     error = AUDIOTAP_NO_MEMORY;
 
-    if (
-        (tapenc=tapenc_init2(tapenc_params->min_duration,
-                             tapenc_params->sensitivity,
-                             tapenc_params->initial_threshold,
-                             tapenc_params->inverted
-                            )
-        )==NULL
-       )
+    if ((tapenc = create_tapenc(tapenc_functions, tapenc_params, freq)) == NULL)
       break;
     error = AUDIOTAP_OK;
   }while(0);
@@ -178,68 +495,275 @@ static enum audiotap_status audio2tap_audio_open_common(struct audiotap **audiot
     audio2tap_functions->close(priv);
     return error;
   }
-  tapenc_set_silence_threshold(tapenc, 1, freq/10000);
-  return audio2tap_open_common(audiotap, tapenc, freq, machine, videotype, audio2tap_functions, priv);
+  error = audio2tap_open_common(audiotap, tapenc, tapenc_functions, freq, machine, videotype, audio2tap_functions, priv);
+  if (error == AUDIOTAP_OK){
+    (*audiotap)->tapenc_params = *tapenc_params;
+    (*audiotap)->bytes_per_frame = sizeof(int32_t);
+  }
+  return error;
 }
 
-static enum audiotap_status tapfile_get_pulse(struct audiotap *audiotap, uint32_t *pulse, uint32_t *raw_pulse){
-  struct tap_read_handle *handle = (struct tap_read_handle *)audiotap->priv;
-  uint8_t byte, threebytes[3];
+static int tapfile_open_view(struct tap_read_handle *handle, int64_t data_start){
+  handle->data_start = data_start;
+#ifndef _WIN32
+  {
+    struct stat stats;
+
+    if (fstat(fileno(handle->file), &stats) == 0
+     && stats.st_size > data_start
+     && (uint64_t)stats.st_size <= (size_t)-1){
+      void *map = mmap(NULL, (size_t)stats.st_size, PROT_READ, MAP_PRIVATE, fileno(handle->file), 0);
+      if (map != MAP_FAILED){
+#ifdef MADV_SEQUENTIAL
+        madvise(map, (size_t)stats.st_size, MADV_SEQUENTIAL);
+#endif
+        handle->map = map;
+        handle->map_size = (size_t)stats.st_size;
+        handle->read_ptr = (const uint8_t*)map + data_start;
+        handle->read_end = (const uint8_t*)map + stats.st_size;
+        return 1;
+      }
+    }
+  }
+#endif
+  handle->block = (uint8_t*)malloc(READ_BLOCK_SIZE);
+  handle->block_pos = data_start;
+  handle->read_ptr = handle->read_end = handle->block;
+  return handle->block != NULL;
+}
+
+static int tapfile_open_compressed_view(struct tap_read_handle *handle, int64_t data_start){
+  handle->data_start = data_start;
+  handle->block_pos = data_start;
+  handle->block = (uint8_t*)malloc(READ_BLOCK_SIZE);
+  handle->zinput = (uint8_t*)malloc(READ_BLOCK_SIZE);
+  handle->zstream = (z_stream*)calloc(1, sizeof(z_stream));
+  handle->read_ptr = handle->read_end = handle->block;
+  if (handle->block == NULL || handle->zinput == NULL || handle->zstream == NULL)
+    return 0;
+  if (inflateInit(handle->zstream) != Z_OK){
+    free(handle->zstream);
+    handle->zstream = NULL;
+    return 0;
+  }
+  return 1;
+}
 
-  *pulse = 0;
+/* Fills buffer with up to len bytes inflated from the file. Data which
+   cannot be inflated, or which ends before the end marker, sets view_error */
+static size_t tapfile_inflate(struct tap_read_handle *handle, uint8_t *buffer, size_t len){
+  z_stream *zstream = handle->zstream;
 
-  while(1){
-    if (audiotap->terminated)
-      return AUDIOTAP_INTERRUPTED;
-    if (fread(&byte, 1, 1, handle->file) != 1)
-      return AUDIOTAP_EOF;
-    if (byte != 0){
-      *raw_pulse = byte;
-      *pulse += byte * 8;
-      handle->last_was_0 = 0;
-      return AUDIOTAP_OK;
+  zstream->next_out = buffer;
+  zstream->avail_out = (unsigned int)len;
+  while (zstream->avail_out > 0 && !handle->zstream_ended && !handle->view_error){
+    int ret;
+
+    if (zstream->avail_in == 0){
+      zstream->next_in = handle->zinput;
+      zstream->avail_in = (unsigned int)fread(handle->zinput, 1, READ_BLOCK_SIZE, handle->file);
+      if (zstream->avail_in == 0){
+        handle->view_error = 1;
+        break;
+      }
     }
-    if (handle->wave_mode == only_full_waves_supported_v0){
-      if (handle->last_was_0)
-        continue;
-      *raw_pulse = 0;
-      *pulse = 1000000;
-      handle->last_was_0 = 1;
-      return AUDIOTAP_OK;
+    ret = inflate(zstream, Z_NO_FLUSH);
+    if (ret == Z_STREAM_END)
+      handle->zstream_ended = 1;
+    else if (ret != Z_OK)
+      handle->view_error = 1;
+  }
+  return len - zstream->avail_out;
+}
+
+/* Makes sure at least needed bytes are available to the decoders, unless the
+   file ends before. Returns the number of available bytes */
+static size_t tapfile_fill_view(struct tap_read_handle *handle, size_t needed, struct audiotap_stats *stats){
+  size_t left = handle->read_end - handle->read_ptr;
+
+  if (left < needed && handle->block != NULL){
+    size_t wanted = READ_BLOCK_SIZE - left, filled;
+    uint64_t start = get_time_ns();
+
+    memmove(handle->block, handle->read_ptr, left);
+    handle->block_pos += handle->read_ptr - handle->block;
+    filled = handle->zstream != NULL
+      ? tapfile_inflate(handle, handle->block + left, wanted)
+      : fread(handle->block + left, 1, wanted, handle->file);
+    stats->io_ns += get_time_ns() - start;
+    stats->bytes_read += filled;
+    stats->buffer_refills++;
+    handle->view_ended = filled < wanted;
+    left += filled;
+    handle->read_ptr = handle->block;
+    handle->read_end = handle->block + left;
+  }
+  return left;
+}
+
+static int tapfile_view_in_use(struct tap_read_handle *handle){
+  return handle->map != NULL || handle->block != NULL;
+}
+
+static int64_t tapfile_view_tell(struct tap_read_handle *handle){
+  if (handle->map != NULL)
+    return handle->read_ptr - (const uint8_t*)handle->map;
+  /* for compressed files, this is the position in the compressed data */
+  if (handle->zstream != NULL)
+    return ftello(handle->file) - handle->zstream->avail_in;
+  return handle->block_pos + (handle->read_ptr - handle->block);
+}
+
+static int tapfile_view_seek(struct tap_read_handle *handle, int64_t offset){
+  if (handle->map != NULL){
+    if (offset < 0 || (size_t)offset > handle->map_size)
+      return 0;
+    handle->read_ptr = (const uint8_t*)handle->map + offset;
+    return 1;
+  }
+  /* compressed files can only go back to the start of the data */
+  if (handle->zstream != NULL){
+    if (offset != handle->data_start || inflateReset(handle->zstream) != Z_OK)
+      return 0;
+    handle->zstream->avail_in = 0;
+    handle->zstream_ended = 0;
+    handle->view_error = 0;
+  }
+  if (fseeko(handle->file, offset, SEEK_SET) != 0)
+    return 0;
+  handle->block_pos = offset;
+  handle->read_ptr = handle->read_end = handle->block;
+  handle->view_ended = 0;
+  return 1;
+}
+
+static void tapfile_close_view(struct tap_read_handle *handle){
+#ifndef _WIN32
+  if (handle->map != NULL)
+    munmap(handle->map, handle->map_size);
+#endif
+  if (handle->zstream != NULL)
+    inflateEnd(handle->zstream);
+  free(handle->zstream);
+  free(handle->zinput);
+  free(handle->block);
+}
+
+static enum audiotap_status tapfile_get_pulses(struct audiotap *audiotap, uint32_t *pulse, uint32_t *raw_pulse, size_t max, size_t *got){
+  struct tap_read_handle *handle = (struct tap_read_handle *)audiotap->priv;
+  const uint8_t *data = handle->read_ptr, *data_end = handle->read_end;
+  enum audiotap_status ret = AUDIOTAP_OK;
+  size_t n;
+
+  for (n = 0; n < max; n++){
+    pulse[n] = 0;
+    while(1){
+      uint8_t byte;
+
+      if (ATOMIC_LOAD(audiotap->terminated)){
+        ret = AUDIOTAP_INTERRUPTED;
+        goto out;
+      }
+      if (data_end - data < 4){
+        handle->read_ptr = data;
+        tapfile_fill_view(handle, 4, &audiotap->stats);
+        data = handle->read_ptr;
+        data_end = handle->read_end;
+        if (data == data_end){
+          ret = AUDIOTAP_EOF;
+          goto out;
+        }
+      }
+      byte = *data++;
+      if (byte != 0){
+        raw_pulse[n] = byte;
+        pulse[n] += byte * 8;
+        handle->last_was_0 = 0;
+        break;
+      }
+      if (handle->wave_mode == only_full_waves_supported_v0){
+        if (handle->last_was_0){
+          audiotap->stats.overflow_continuations++;
+          continue;
+        }
+        raw_pulse[n] = 0;
+        pulse[n] = 1000000;
+        handle->last_was_0 = 1;
+        break;
+      }
+      if (data_end - data < 3){
+        data = data_end;
+        ret = AUDIOTAP_EOF;
+        goto out;
+      }
+      raw_pulse[n] = data[0]        +
+                    (data[1] <<  8) +
+                    (data[2] << 16);
+      data += 3;
+      pulse[n] += raw_pulse[n];
+      if (raw_pulse[n] < 0xFFFFFF)
+        break;
+      audiotap->stats.overflow_continuations++;
     }
-    if (fread(threebytes, 3, 1, handle->file) != 1)
-      return AUDIOTAP_EOF;
-    *raw_pulse = threebytes[0]        +
-                (threebytes[1] <<  8) +
-                (threebytes[2] << 16);
-    *pulse += *raw_pulse;
-    if (*raw_pulse < 0xFFFFFF)
-      return AUDIOTAP_OK;
   }
+out:
+  handle->read_ptr = data;
+  *got = n;
+  return ret;
 }
 
-static enum audiotap_status tapfile_get_wave(struct audiotap *audiotap, uint32_t *pulse, uint32_t *raw_pulse){
+/* Number of halfwaves decoded at a time when two of them have to be
+   joined into a full wave */
+#define HALFWAVES_CHUNK 512
+
+static enum audiotap_status tapfile_decode_waves(struct audiotap *audiotap, uint32_t *pulse, uint32_t *raw_pulse, size_t max, size_t *got){
   struct tap_read_handle *handle = (struct tap_read_handle *)audiotap->priv;
-  enum audiotap_status ret = handle->get_wave(audiotap, pulse, raw_pulse);
-  
-  if (ret != AUDIOTAP_OK)
-  {
+  enum audiotap_status ret = AUDIOTAP_OK;
+  size_t n = 0;
+
+  if (max > 0 && handle->wave_mode == reading_single_halfwave_one_shot){
+    if ((ret = handle->get_pulses(audiotap, pulse, raw_pulse, 1, &n)) != AUDIOTAP_OK){
+      *got = n;
+      return ret;
+    }
+    handle->wave_mode = reading_both_halfwaves;
+  }
+  if (handle->wave_mode != reading_both_halfwaves){
+    ret = handle->get_pulses(audiotap, pulse + n, raw_pulse + n, max - n, got);
+    *got += n;
     return ret;
   }
-  if (handle->wave_mode == reading_both_halfwaves)
-  {
-    uint32_t pulse2;
-    if ( (ret = handle->get_wave(audiotap, &pulse2, raw_pulse)) != AUDIOTAP_OK)
-      return ret;
-    *pulse += pulse2;
+
+  while (n < max && ret == AUDIOTAP_OK){
+    uint32_t halfwaves[HALFWAVES_CHUNK], raw_halfwaves[HALFWAVES_CHUNK];
+    size_t wanted = 2 * (max - n), done, i;
+
+    if (wanted > HALFWAVES_CHUNK)
+      wanted = HALFWAVES_CHUNK;
+    ret = handle->get_pulses(audiotap, halfwaves, raw_halfwaves, wanted, &done);
+    /* an unpaired halfwave at the end is dropped */
+    for (i = 0; i + 1 < done; i += 2, n++){
+      pulse[n] = halfwaves[i] + halfwaves[i + 1];
+      raw_pulse[n] = raw_halfwaves[i + 1];
+    }
   }
-  else if (handle->wave_mode == reading_single_halfwave_one_shot)
-    handle->wave_mode = reading_both_halfwaves;
+  *got = n;
+  return ret;
+}
 
-  return AUDIOTAP_OK;
+static enum audiotap_status tapfile_get_waves(struct audiotap *audiotap, uint32_t *pulse, uint32_t *raw_pulse, size_t max, size_t *got){
+  struct tap_read_handle *handle = (struct tap_read_handle *)audiotap->priv;
+  const uint8_t *start = handle->read_ptr;
+  enum audiotap_status ret = tapfile_decode_waves(audiotap, pulse, raw_pulse, max, got);
+
+  /* memory-mapped files are not read in blocks: their bytes are counted
+     as they are decoded */
+  if (handle->map != NULL)
+    audiotap->stats.bytes_read += handle->read_ptr - start;
+  return ret;
 }
 
-static int tapfile_get_total_len(struct audiotap *audiotap){
+static int64_t tapfile_get_total_len(struct audiotap *audiotap){
   struct tap_read_handle *handle = (struct tap_read_handle *)audiotap->priv;
   struct stat stats;
 
@@ -248,18 +772,18 @@ static int tapfile_get_total_len(struct audiotap *audiotap){
   return stats.st_size;
 }
 
-static int tapfile_get_current_pos(struct audiotap *audiotap){
+static int64_t tapfile_get_current_pos(struct audiotap *audiotap){
   struct tap_read_handle *handle = (struct tap_read_handle *)audiotap->priv;
-  long res;
 
-  if ((res = ftell(handle->file)) == -1)
-    return -1;
-  return (int)res;
+  if (tapfile_view_in_use(handle))
+    return tapfile_view_tell(handle);
+  return ftello(handle->file);
 }
 
 static void tapfile_close(void *priv){
   struct tap_read_handle *handle = (struct tap_read_handle *)priv;
 
+  tapfile_close_view(handle);
   fclose(handle->file);
   free(handle);
 }
@@ -267,36 +791,90 @@ static void tapfile_close(void *priv){
 static int tapfile_is_eof(struct audiotap *audiotap){
   struct tap_read_handle *handle = (struct tap_read_handle *)audiotap->priv;
 
+  if (tapfile_view_in_use(handle))
+    return handle->read_ptr == handle->read_end
+        && (handle->map != NULL || handle->view_ended);
   return feof(handle->file);
 }
 
 static void tapfile_invert(struct audiotap *audiotap)
 {
   struct tap_read_handle *handle = (struct tap_read_handle *)audiotap->priv;
-  if (handle->wave_mode == reading_both_halfwaves)
+  if (handle->wave_mode == reading_both_halfwaves){
     handle->wave_mode = reading_single_halfwave_one_shot;
+    handle->starts_one_shot = !handle->starts_one_shot;
+  }
 }
 
 static int tapfile_seek_to_beginning(struct audiotap *audiotap)
 {
   struct tap_read_handle *handle = (struct tap_read_handle *)audiotap->priv;
 
+  if (handle->wave_mode == reading_both_halfwaves
+   || handle->wave_mode == reading_single_halfwave_one_shot)
+    handle->wave_mode = handle->starts_one_shot ? reading_single_halfwave_one_shot : reading_both_halfwaves;
+  if (tapfile_view_in_use(handle))
+    return tapfile_view_seek(handle, handle->data_start);
   return fseek(handle->file, 20, SEEK_SET) == 0;
 }
 
+static int64_t tapfile_tell(struct audiotap *audiotap)
+{
+  struct tap_read_handle *handle = (struct tap_read_handle *)audiotap->priv;
+
+  /* Compressed data can only be read from the beginning, and restarting in
+     the middle of a sequence of zeroes in a TAP v0 file would be wrong */
+  if (!tapfile_view_in_use(handle)
+   || handle->zstream != NULL
+   || handle->wave_mode == reading_single_halfwave_one_shot
+   || (handle->wave_mode == only_full_waves_supported_v0 && handle->last_was_0))
+    return -1;
+  return tapfile_view_tell(handle);
+}
+
+static int tapfile_seek(struct audiotap *audiotap, int64_t offset)
+{
+  struct tap_read_handle *handle = (struct tap_read_handle *)audiotap->priv;
+
+  if (handle->wave_mode == only_full_waves_supported_v0)
+    handle->last_was_0 = 0;
+  /* Checkpoints are never taken with a lone halfwave pending */
+  else if (handle->wave_mode == reading_single_halfwave_one_shot)
+    handle->wave_mode = reading_both_halfwaves;
+  return tapfile_view_seek(handle, offset);
+}
+
 static void tapfile_enable_disable_halfwaves(struct audiotap *audiotap, int halfwaves)
 {
   struct tap_read_handle *handle = (struct tap_read_handle *)audiotap->priv;
 
   if (halfwaves && (handle->wave_mode == reading_both_halfwaves ||
-                    handle->wave_mode == reading_single_halfwave_one_shot))
+                    handle->wave_mode == reading_single_halfwave_one_shot)){
+    if (handle->wave_mode == reading_single_halfwave_one_shot)
+      handle->starts_one_shot = !handle->starts_one_shot;
     handle->wave_mode = reading_single_halfwave;
+  }
   else if (!halfwaves && (handle->wave_mode == reading_single_halfwave))
     handle->wave_mode = reading_both_halfwaves;
 }
 
+static int tapfile_get_index_key(struct audiotap *audiotap, struct index_key *key)
+{
+  struct tap_read_handle *handle = (struct tap_read_handle *)audiotap->priv;
+  struct stat stats;
+
+  if (fstat(fileno(handle->file), &stats) == -1)
+    return 0;
+  key->size = stats.st_size;
+  key->mtime = stats.st_mtime;
+  key->mode = (handle->wave_mode == reading_single_halfwave_one_shot ?
+               reading_both_halfwaves : handle->wave_mode)
+            | handle->starts_one_shot << 8;
+  return 1;
+}
+
 static const struct audio2tap_functions tapfile_read_functions = {
-  tapfile_get_wave,
+  tapfile_get_waves,
   NULL,
   tapfile_get_total_len,
   tapfile_get_current_pos,
@@ -304,11 +882,22 @@ static const struct audio2tap_functions tapfile_read_functions = {
   tapfile_invert,
   tapfile_seek_to_beginning,
   tapfile_enable_disable_halfwaves,
-  tapfile_close
+  tapfile_close,
+  tapfile_tell,
+  tapfile_seek,
+  NULL,
+  tapfile_get_index_key,
+  NULL,
+  NULL,
+  NULL
 };
 
+/* The *file_init functions below are called by audio2tap_open_from_file3 with
+   the file positioned just after the header it recognised. They take
+   ownership of the file, unless they return AUDIOTAP_WRONG_FILETYPE */
+
 static enum audiotap_status tapfile_init(struct audiotap **audiotap,
-                                         const char *file,
+                                         FILE *file,
                                          uint8_t *machine,
                                          uint8_t *videotype,
                                          uint8_t *halfwaves){
@@ -316,27 +905,15 @@ static enum audiotap_status tapfile_init(struct audiotap **audiotap,
   enum audiotap_status err;
   uint8_t version;
 
-  handle = (struct tap_read_handle *)malloc(sizeof(struct tap_read_handle));
-  if (handle == NULL)
+  handle = (struct tap_read_handle *)calloc(1, sizeof(struct tap_read_handle));
+  if (handle == NULL){
+    fclose(file);
     return AUDIOTAP_NO_MEMORY;
-
+  }
 
   do {
-    char file_header[12];
-    handle->file = fopen(file, "rb");
-    if (handle->file == NULL){
-      err = errno == ENOENT ? AUDIOTAP_NO_FILE : AUDIOTAP_LIBRARY_ERROR;
-      break;
-    }
-    err = AUDIOTAP_LIBRARY_ERROR;
-    if (fread(file_header, sizeof(file_header), 1, handle->file) < 1)
-      break;
+    handle->file = file;
     err = AUDIOTAP_WRONG_FILETYPE;
-    if (
-        memcmp(c64_tap_header, file_header, sizeof(file_header))
-     && memcmp(c16_tap_header, file_header, sizeof(file_header))
-       )
-      break;
     if (fread(&version, 1, 1, handle->file) < 1)
       break;
     if (version > 2)
@@ -347,6 +924,9 @@ static enum audiotap_status tapfile_init(struct audiotap **audiotap,
       break;
     if (fseek(handle->file, 20, SEEK_SET) != 0)
       break;
+    err = AUDIOTAP_NO_MEMORY;
+    if (!tapfile_open_view(handle, 20))
+      break;
     err = AUDIOTAP_OK;
   } while (0);
   if (err == AUDIOTAP_OK){
@@ -358,10 +938,11 @@ static enum audiotap_status tapfile_init(struct audiotap **audiotap,
       handle->wave_mode = reading_both_halfwaves;
     else
       handle->wave_mode = reading_single_halfwave;
-    handle->get_wave = tapfile_get_pulse;
+    handle->get_pulses = tapfile_get_pulses;
     handle->last_was_0 = 0;
     *halfwaves = version == 2;
     return audio2tap_open_common(audiotap,
+                                 NULL,
                                  NULL,
                                  0, /*unused*/
                                  *machine,
@@ -369,183 +950,678 @@ static enum audiotap_status tapfile_init(struct audiotap **audiotap,
                                  &tapfile_read_functions,
                                  handle);
   }
-  if (handle->file != NULL)
-    fclose(handle->file);
+  if (err != AUDIOTAP_WRONG_FILETYPE)
+    fclose(file);
   free(handle);
   return err;
 }
 
-static enum audiotap_status audio_get_pulse(struct audiotap *audiotap, uint32_t *pulse, uint32_t *raw_pulse){
-  while(!audiotap->terminated && !audiotap->has_flushed){
+static void free_detected_pulses(struct audiotap *audiotap){
+  free(audiotap->detected_pulses);
+  audiotap->detected_pulses = NULL;
+  audiotap->num_detected_pulses = audiotap->next_detected_pulse = 0;
+}
+
+static enum audiotap_status get_detected_pulses(struct audiotap *audiotap, uint32_t *pulse, uint32_t *raw_pulse, size_t max, size_t *got){
+  size_t n = 0;
+
+  while(n < max
+     && audiotap->next_detected_pulse < audiotap->num_detected_pulses
+     && !ATOMIC_LOAD(audiotap->terminated)){
+    raw_pulse[n] = audiotap->detected_pulses[audiotap->next_detected_pulse++];
+    pulse[n] = convert_samples(audiotap, raw_pulse[n]);
+    n++;
+  }
+  if (audiotap->next_detected_pulse == audiotap->num_detected_pulses){
+    free_detected_pulses(audiotap);
+    audiotap->has_flushed = 1;
+  }
+  *got = n;
+  if (n == max)
+    return AUDIOTAP_OK;
+  return ATOMIC_LOAD(audiotap->terminated) ? AUDIOTAP_INTERRUPTED : AUDIOTAP_EOF;
+}
+
+/* Reading the clock costs about as much as detecting or synthesizing one
+   pulse, so calls for a single pulse are only timed once every
+   TIMED_SINGLE_CALLS, and that time counts for all of them */
+#define TIMED_SINGLE_CALLS 64
+
+/* How many times the time of a call for that many pulses counts: 0 if it
+   is not timed */
+static uint64_t timing_weight(struct audiotap *audiotap, size_t pulses){
+  if (pulses != 1)
+    return 1;
+  if (++audiotap->untimed_calls < TIMED_SINGLE_CALLS)
+    return 0;
+  audiotap->untimed_calls = 0;
+  return TIMED_SINGLE_CALLS;
+}
+
+static enum audiotap_status audio_detect_pulses(struct audiotap *audiotap, uint32_t *pulse, uint32_t *raw_pulse, size_t max, size_t *got){
+  size_t n = 0;
+
+  if (audiotap->detected_pulses != NULL)
+    return get_detected_pulses(audiotap, pulse, raw_pulse, max, got);
+  while(n < max && !ATOMIC_LOAD(audiotap->terminated) && !audiotap->has_flushed){
     uint32_t done_now;
     enum audiotap_status error;
     uint32_t numframes;
+    uint64_t trace_start;
+
+    if (audiotap->bufroom == 0){
+      uint64_t start = get_time_ns();
+
+      error = audiotap->audio2tap_functions->set_buffer(audiotap, (int32_t*)audiotap->bufstart, audiotap->bufsize, &numframes);
+      audiotap->stats.io_ns += get_time_ns() - start;
+      if (error != AUDIOTAP_OK){
+        *got = n;
+        return error;
+      }
+      audiotap->stats.buffer_refills++;
+      audiotap->stats.bytes_read += (uint64_t)numframes * audiotap->bytes_per_frame;
+      TRACE(audiotap, AUDIOTAP_TRACE_READ_BLOCK, start, numframes, 0);
+      /* The signal is broken where samples were lost: the encoder starts
+         over, and the missing time still counts in the next pulse */
+      if (audiotap->lost_before_buffer > 0){
+        audiotap->carry += audiotap->tapenc_functions->flush(audiotap->tapenc)
+                         + audiotap->lost_before_buffer;
+        audiotap->lost_before_buffer = 0;
+      }
+      if (numframes == 0){
+        raw_pulse[n] = audiotap->carry + audiotap->tapenc_functions->flush(audiotap->tapenc);
+        audiotap->carry = 0;
+        pulse[n] = convert_samples(audiotap, raw_pulse[n]);
+        n++;
+        audiotap->has_flushed=1;
+        break;
+      }
+      audiotap->buffer = audiotap->bufstart;
+      audiotap->bufroom = numframes;
+    }
 
-    done_now=tapenc_get_pulse(audiotap->tapenc, (int32_t*)audiotap->buffer, audiotap->bufroom, raw_pulse);
+    trace_start = TRACE_START(audiotap);
+    done_now=audiotap->tapenc_functions->get_pulse(audiotap->tapenc, (int32_t*)audiotap->buffer, audiotap->bufroom, raw_pulse + n);
+    TRACE(audiotap, AUDIOTAP_TRACE_DETECT, trace_start, done_now, raw_pulse[n] > 0);
     audiotap->buffer += done_now * sizeof(int32_t);
     audiotap->bufroom -= done_now;
-    if(*raw_pulse > 0){
-      *pulse = convert_samples(audiotap, *raw_pulse);
-      return AUDIOTAP_OK;
-    }
-    
-    error = audiotap->audio2tap_functions->set_buffer(audiotap->priv, (int32_t*)audiotap->bufstart, sizeof(audiotap->bufstart) / sizeof(int32_t), &numframes);
-    if (error != AUDIOTAP_OK)
-      return error;
-    if (numframes == 0){
-      *raw_pulse = tapenc_flush(audiotap->tapenc);
-      *pulse = convert_samples(audiotap, *raw_pulse);
-      audiotap->has_flushed=1;
-      return AUDIOTAP_OK;
+    if(raw_pulse[n] > 0){
+      raw_pulse[n] += audiotap->carry;
+      audiotap->carry = 0;
+      pulse[n] = convert_samples(audiotap, raw_pulse[n]);
+      n++;
     }
-    audiotap->buffer = audiotap->bufstart;
-    audiotap->bufroom = numframes;
   }
-  return audiotap->terminated ? AUDIOTAP_INTERRUPTED : AUDIOTAP_EOF;
+  *got = n;
+  if (n == max)
+    return AUDIOTAP_OK;
+  return ATOMIC_LOAD(audiotap->terminated) ? AUDIOTAP_INTERRUPTED : AUDIOTAP_EOF;
+}
+
+/* The time spent here, except reading, is the encoder's */
+static enum audiotap_status audio_get_pulses(struct audiotap *audiotap, uint32_t *pulse, uint32_t *raw_pulse, size_t max, size_t *got){
+  uint64_t weight = timing_weight(audiotap, max), start, io_ns;
+  enum audiotap_status ret;
+
+  if (weight == 0)
+    return audio_detect_pulses(audiotap, pulse, raw_pulse, max, got);
+  start = get_time_ns();
+  io_ns = audiotap->stats.io_ns;
+  ret = audio_detect_pulses(audiotap, pulse, raw_pulse, max, got);
+  audiotap->stats.encoder_ns += (get_time_ns() - start - (audiotap->stats.io_ns - io_ns)) * weight;
+  return ret;
+}
+
+/* Makes reading restart with the encoder in its initial state */
+static void audio_restart(struct audiotap *audiotap){
+  audiotap->has_flushed = 0;
+  audiotap->bufroom = 0;
+  audiotap->carry = 0;
+  audiotap->tapenc_functions->flush(audiotap->tapenc);
+  free_detected_pulses(audiotap);
 }
 
 static void audio_invert(struct audiotap *audiotap){
-  tapenc_invert(audiotap->tapenc);
+  audiotap->tapenc_functions->invert(audiotap->tapenc);
+  audiotap->tapenc_params.inverted = !audiotap->tapenc_params.inverted;
 }
 
 static void audio_enable_disable_halfwaves(struct audiotap *audiotap, int halfwaves)
 {
-  tapenc_toggle_trigger_on_both_edges(audiotap->tapenc, halfwaves);
+  audiotap->tapenc_functions->toggle_trigger_on_both_edges(audiotap->tapenc, halfwaves);
+  audiotap->both_edges = halfwaves != 0;
 }
 
-static enum audiotap_status audiofile_set_buffer(void *priv, int32_t *buffer, uint32_t bufsize, uint32_t *numframes) {
-  *numframes=afReadFrames((AFfilehandle)priv, AF_DEFAULT_TRACK, buffer, bufsize);
-  return *numframes == -1 ? AUDIOTAP_LIBRARY_ERROR : AUDIOTAP_OK;
+static int64_t audio_get_current_pos(struct audiotap *audiotap){
+  return audiotap->accumulated_samples;
 }
 
-static void audiofile_close(void *priv){
-  afCloseFile((AFfilehandle)priv);
+static int audio_is_eof(struct audiotap *audiotap){
+  return audiotap->has_flushed;
 }
 
-static int audiofile_get_total_len(struct audiotap *audiotap){
-  return (int)(afGetFrameCount((AFfilehandle)audiotap->priv, AF_DEFAULT_TRACK));
+static enum audiotap_status audiofile_read_frames(void *reader, int32_t *buffer, uint32_t bufsize, uint32_t *numframes) {
+  *numframes=afReadFrames((AFfilehandle)reader, AF_DEFAULT_TRACK, buffer, bufsize);
+  return *numframes == -1 ? AUDIOTAP_LIBRARY_ERROR : AUDIOTAP_OK;
 }
 
-static int audiofile_get_current_pos(struct audiotap *audiotap){
-   return audiotap->accumulated_samples;
+static enum audiotap_status audiofile_set_buffer(struct audiotap *audiotap, int32_t *buffer, uint32_t bufsize, uint32_t *numframes) {
+  return audiofile_read_frames(audiotap->priv, buffer, bufsize, numframes);
 }
 
-static int audiofile_is_eof(struct audiotap *audiotap){
-  return audiotap->has_flushed;
+static void audiofile_close(void *priv){
+  afCloseFile((AFfilehandle)priv);
+}
+
+static int64_t audiofile_get_total_len(struct audiotap *audiotap){
+  return afGetFrameCount((AFfilehandle)audiotap->priv, AF_DEFAULT_TRACK);
 }
 
 static int audiofile_seek_to_beginning(struct audiotap *audiotap)
 {
-  audiotap->has_flushed = 0;
   audiotap->accumulated_samples = 0;
-  audiotap->bufroom = 0;
-  tapenc_flush(audiotap->tapenc);
+  audio_restart(audiotap);
   return afSeekFrame((AFfilehandle)audiotap->priv, AF_DEFAULT_TRACK, 0) == 0;
 }
 
+/* The encoder keeps some state which is lost here, so the pulses read after
+   seeking may be slightly different from those read without seeking */
+static int audiofile_seek(struct audiotap *audiotap, int64_t offset)
+{
+  audiotap->accumulated_samples = offset;
+  audiotap->remainder = (uint32_t)((uint64_t)offset * audiotap->clock % audiotap->freq);
+  audio_restart(audiotap);
+  return afSeekFrame((AFfilehandle)audiotap->priv, AF_DEFAULT_TRACK, offset) == offset;
+}
+
+static int64_t audiofile_tell(struct audiotap *audiotap)
+{
+  AFframecount pos = afTellFrame((AFfilehandle)audiotap->priv, AF_DEFAULT_TRACK);
+
+  if (pos < 0)
+    return -1;
+  return pos - audiotap->bufroom;
+}
+
+static int audiofile_seek_to_cycles(struct audiotap *audiotap, uint64_t cycles)
+{
+  return audiofile_seek(audiotap, (int64_t)(cycles * audiotap->freq / audiotap->clock));
+}
+
+/* Makes audiofile return 32-bit mono samples */
+static enum audiotap_status audiofile_setup(AFfilehandle fh, uint32_t *freq){
+  if ( (*freq=(uint32_t)afGetRate(fh, AF_DEFAULT_TRACK)) == -1)
+    return AUDIOTAP_LIBRARY_ERROR;
+  if (afSetVirtualChannels(fh, AF_DEFAULT_TRACK, 1) == -1)
+    return AUDIOTAP_LIBRARY_ERROR;
+  if (afSetVirtualSampleFormat(fh, AF_DEFAULT_TRACK, AF_SAMPFMT_TWOSCOMP, 32) == -1)
+    return AUDIOTAP_LIBRARY_ERROR;
+  if (afGetVirtualFrameSize(fh, AF_DEFAULT_TRACK, 0) != 4)
+    return AUDIOTAP_LIBRARY_ERROR;
+  return AUDIOTAP_OK;
+}
+
+static void *audiofile_open_reader(struct audiotap *audiotap, int64_t frame){
+  AFfilehandle fh;
+  uint32_t freq;
+
+  if (audiotap->file_name == NULL)
+    return NULL;
+  fh = afOpenFile(audiotap->file_name, "r", NULL);
+  if (fh == AF_NULL_FILEHANDLE)
+    return NULL;
+  if (audiofile_setup(fh, &freq) != AUDIOTAP_OK
+   || afSeekFrame(fh, AF_DEFAULT_TRACK, frame) != frame){
+    afCloseFile(fh);
+    return NULL;
+  }
+  return fh;
+}
+
 static const struct audio2tap_functions audiofile_read_functions = {
-  audio_get_pulse,
+  audio_get_pulses,
   audiofile_set_buffer,
   audiofile_get_total_len,
-  audiofile_get_current_pos,
-  audiofile_is_eof,
+  audio_get_current_pos,
+  audio_is_eof,
   audio_invert,
   audiofile_seek_to_beginning,
   audio_enable_disable_halfwaves,
+  audiofile_close,
+  audiofile_tell,
+  audiofile_seek,
+  audiofile_seek_to_cycles,
+  NULL,
+  audiofile_open_reader,
+  audiofile_read_frames,
   audiofile_close
 };
 
+/* Unlike the other *file_init functions, this one always takes ownership of
+   the file: audiofile reads it through a duplicate of its descriptor.
+   The file is opened again by name to read it on several threads */
 static enum audiotap_status audiofile_read_init(struct audiotap **audiotap,
-                                                const char *file,
+                                                FILE *file,
+                                                const char *file_name,
                                                 struct tapenc_params *params,
                                                 uint8_t machine,
                                                 uint8_t videotype,
                                                 uint8_t *halfwaves){
   uint32_t freq;
-  enum audiotap_status error = AUDIOTAP_LIBRARY_ERROR;
+  enum audiotap_status error;
   AFfilehandle fh;
+  int fd;
 
   if (status.audiofile_init_status != LIBRARY_OK
-   || status.tapencoder_init_status != LIBRARY_OK)
+   || get_tapenc_functions() == NULL){
+    fclose(file);
     return AUDIOTAP_LIBRARY_UNAVAILABLE;
-  fh=afOpenFile(file,"r", NULL);
+  }
+  fd = dup(fileno(file));
+  fclose(file);
+  if (fd == -1)
+    return AUDIOTAP_LIBRARY_ERROR;
+  if (lseek(fd, 0, SEEK_SET) != 0){
+    close(fd);
+    return AUDIOTAP_LIBRARY_ERROR;
+  }
+  /* from now on, fd belongs to audiofile */
+  fh=afOpenFD(fd,"r", NULL);
   if (fh == AF_NULL_FILEHANDLE)
     return AUDIOTAP_LIBRARY_ERROR;
-  do{
-    if ( (freq=(uint32_t)afGetRate(fh, AF_DEFAULT_TRACK)) == -1)
-      break;
-    if (afSetVirtualChannels(fh, AF_DEFAULT_TRACK, 1) == -1)
-      break;
-    if (afSetVirtualSampleFormat(fh, AF_DEFAULT_TRACK, AF_SAMPFMT_TWOSCOMP, 32) == -1)
-      break;
-    if (afGetVirtualFrameSize(fh, AF_DEFAULT_TRACK, 0) != 4)
-      break;
-    error = AUDIOTAP_OK;
-  }while(0);
-  if(error != AUDIOTAP_OK){
+  if((error = audiofile_setup(fh, &freq)) != AUDIOTAP_OK){
     afCloseFile(fh);
     return error;
   }
   *halfwaves = 1;
-  return audio2tap_audio_open_common(audiotap,
-                                     freq,
-                                     params,
-                                     machine,
-                                     videotype,
-                                     &audiofile_read_functions,
-                                     fh);
+  error = audio2tap_audio_open_common(audiotap,
+                                      freq,
+                                      params,
+                                      machine,
+                                      videotype,
+                                      &audiofile_read_functions,
+                                      fh);
+  if (error == AUDIOTAP_OK){
+    (*audiotap)->file_name = strdup(file_name);
+    (*audiotap)->bytes_per_frame = (uint32_t)afGetFrameSize(fh, AF_DEFAULT_TRACK, 0);
+  }
+  return error;
 }
 
-static enum audiotap_status dmpfile_get_pulse(struct audiotap *audiotap, uint32_t *pulse, uint32_t *raw_pulse){
-  struct tap_read_handle *handle = (struct tap_read_handle *)audiotap->priv;
+/* Native reader for PCM WAV files. Frames are converted straight from the
+   file, memory-mapped where possible, into the encoder's buffer. Audio files
+   in other formats are read by audiofile */
+struct wav_read_handle;
 
-  *pulse = 0;
-  while(1){
-    uint32_t this_pulse = 0;
-    int bitshift;
-    for (bitshift = 0; bitshift < handle->bits_per_sample; bitshift += 8){
-      uint8_t byte;
-      if (fread(&byte, 1, 1, handle->file) != 1)
-        return AUDIOTAP_EOF;
-      this_pulse += (byte<<bitshift);
-    }
-    *raw_pulse = this_pulse;
-    *pulse += this_pulse;
-    if (this_pulse < handle->overflow_value){
-      *pulse = (uint32_t)(*pulse * audiotap->factor);
-      return AUDIOTAP_OK;
-    }
+struct wav_reader {
+  const struct wav_read_handle *wav;
+  FILE *file;          /* NULL if the file is mapped */
+  uint8_t *block;      /* frames read from file, before conversion */
+  int64_t next_frame;
+};
+
+struct wav_read_handle {
+  FILE *file;
+  const uint8_t *map;  /* the whole file, if it could be mapped */
+  size_t map_size;
+  int64_t data_start;  /* file offset of the first frame */
+  int64_t num_frames;
+  uint32_t frame_size;
+  pcm_converter convert;
+  struct wav_reader reader;
+};
+
+static int wav_reader_seek(struct wav_reader *reader, int64_t frame){
+  const struct wav_read_handle *wav = reader->wav;
+
+  if (frame < 0 || frame > wav->num_frames)
+    return 0;
+  if (reader->file != NULL
+   && fseeko(reader->file, wav->data_start + frame * wav->frame_size, SEEK_SET) != 0)
+    return 0;
+  reader->next_frame = frame;
+  return 1;
+}
+
+static enum audiotap_status wav_reader_read(void *priv, int32_t *buffer, uint32_t bufsize, uint32_t *numframes){
+  struct wav_reader *reader = (struct wav_reader *)priv;
+  const struct wav_read_handle *wav = reader->wav;
+  int64_t left = wav->num_frames - reader->next_frame;
+  uint32_t n = left < bufsize ? (uint32_t)left : bufsize;
+
+  if (reader->file == NULL)
+    wav->convert(wav->map + wav->data_start + reader->next_frame * wav->frame_size, buffer, n);
+  else{
+    if (n > READ_BLOCK_SIZE / wav->frame_size)
+      n = READ_BLOCK_SIZE / wav->frame_size;
+    n = (uint32_t)fread(reader->block, wav->frame_size, n, reader->file);
+    if (ferror(reader->file))
+      return AUDIOTAP_LIBRARY_ERROR;
+    wav->convert(reader->block, buffer, n);
   }
+  reader->next_frame += n;
+  *numframes = n;
+  return AUDIOTAP_OK;
+}
+
+static void wav_reader_close(void *priv){
+  struct wav_reader *reader = (struct wav_reader *)priv;
+
+  if (reader->file != NULL)
+    fclose(reader->file);
+  free(reader->block);
+  free(reader);
+}
+
+static void *wavfile_open_reader(struct audiotap *audiotap, int64_t frame){
+  const struct wav_read_handle *wav = (const struct wav_read_handle *)audiotap->priv;
+  struct wav_reader *reader = (struct wav_reader *)calloc(1, sizeof(struct wav_reader));
+
+  if (reader == NULL)
+    return NULL;
+  reader->wav = wav;
+  if (wav->map == NULL){
+    if (audiotap->file_name == NULL
+     || (reader->file = fopen(audiotap->file_name, "rb")) == NULL
+     || (reader->block = (uint8_t *)malloc(READ_BLOCK_SIZE)) == NULL){
+      wav_reader_close(reader);
+      return NULL;
+    }
+  }
+  if (!wav_reader_seek(reader, frame)){
+    wav_reader_close(reader);
+    return NULL;
+  }
+  return reader;
+}
+
+static enum audiotap_status wavfile_set_buffer(struct audiotap *audiotap, int32_t *buffer, uint32_t bufsize, uint32_t *numframes){
+  return wav_reader_read(&((struct wav_read_handle *)audiotap->priv)->reader, buffer, bufsize, numframes);
+}
+
+static void wavfile_close(void *priv){
+  struct wav_read_handle *wav = (struct wav_read_handle *)priv;
+
+#ifndef _WIN32
+  if (wav->map != NULL)
+    munmap((void *)wav->map, wav->map_size);
+#endif
+  free(wav->reader.block);
+  fclose(wav->file);
+  free(wav);
+}
+
+static int64_t wavfile_get_total_len(struct audiotap *audiotap){
+  return ((struct wav_read_handle *)audiotap->priv)->num_frames;
+}
+
+static int wavfile_seek_to_beginning(struct audiotap *audiotap)
+{
+  audiotap->accumulated_samples = 0;
+  audio_restart(audiotap);
+  return wav_reader_seek(&((struct wav_read_handle *)audiotap->priv)->reader, 0);
+}
+
+/* Same as audiofile_seek */
+static int wavfile_seek(struct audiotap *audiotap, int64_t offset)
+{
+  audiotap->accumulated_samples = offset;
+  audiotap->remainder = (uint32_t)((uint64_t)offset * audiotap->clock % audiotap->freq);
+  audio_restart(audiotap);
+  return wav_reader_seek(&((struct wav_read_handle *)audiotap->priv)->reader, offset);
+}
+
+static int64_t wavfile_tell(struct audiotap *audiotap)
+{
+  return ((struct wav_read_handle *)audiotap->priv)->reader.next_frame - audiotap->bufroom;
+}
+
+static int wavfile_seek_to_cycles(struct audiotap *audiotap, uint64_t cycles)
+{
+  int64_t offset = (int64_t)(cycles * audiotap->freq / audiotap->clock);
+  int64_t num_frames = ((struct wav_read_handle *)audiotap->priv)->num_frames;
+
+  return wavfile_seek(audiotap, offset < num_frames ? offset : num_frames);
+}
+
+static const struct audio2tap_functions wavfile_read_functions = {
+  audio_get_pulses,
+  wavfile_set_buffer,
+  wavfile_get_total_len,
+  audio_get_current_pos,
+  audio_is_eof,
+  audio_invert,
+  wavfile_seek_to_beginning,
+  audio_enable_disable_halfwaves,
+  wavfile_close,
+  wavfile_tell,
+  wavfile_seek,
+  wavfile_seek_to_cycles,
+  NULL,
+  wavfile_open_reader,
+  wav_reader_read,
+  wav_reader_close
+};
+
+static uint32_t get_le16(const uint8_t *buf){
+  return buf[0] | buf[1] << 8;
+}
+
+static uint32_t get_le32(const uint8_t *buf){
+  return buf[0] | buf[1] << 8 | buf[2] << 16 | (uint32_t)buf[3] << 24;
+}
+
+#define WAVE_FORMAT_PCM        0x0001
+#define WAVE_FORMAT_EXTENSIBLE 0xFFFE
+
+/* Like the other *file_init functions, this one leaves the file open if it
+   is not of the right type, so audiofile can try it */
+static enum audiotap_status wavfile_read_init(struct audiotap **audiotap,
+                                              FILE *file,
+                                              const char *file_name,
+                                              struct tapenc_params *params,
+                                              uint8_t machine,
+                                              uint8_t videotype,
+                                              uint8_t *halfwaves){
+  struct wav_read_handle *wav;
+  uint8_t header[12], fmt[26];
+  uint32_t freq = 0, format = 0, channels = 0, bits = 0, block_align = 0, data_size;
+  int64_t chunk_start = 12;
+  enum audiotap_status error;
+  struct stat stats;
+  pcm_converter convert;
+
+  if (fseeko(file, 0, SEEK_SET) != 0
+   || fread(header, 1, 12, file) != 12
+   || memcmp(header, "RIFF", 4) || memcmp(header + 8, "WAVE", 4))
+    return AUDIOTAP_WRONG_FILETYPE;
+  /* the data chunk must come after the fmt chunk */
+  for(;;){
+    uint8_t chunk[8];
+    uint32_t chunk_size;
+
+    if (fread(chunk, 1, 8, file) != 8)
+      return AUDIOTAP_WRONG_FILETYPE;
+    chunk_size = get_le32(chunk + 4);
+    chunk_start += 8;
+    if (!memcmp(chunk, "data", 4) && bits != 0){
+      data_size = chunk_size;
+      break;
+    }
+    if (!memcmp(chunk, "fmt ", 4) && chunk_size >= 16){
+      size_t fmt_size = chunk_size < sizeof(fmt) ? chunk_size : sizeof(fmt);
+
+      if (fread(fmt, 1, fmt_size, file) != fmt_size)
+        return AUDIOTAP_WRONG_FILETYPE;
+      format = get_le16(fmt);
+      channels = get_le16(fmt + 2);
+      freq = get_le32(fmt + 4);
+      block_align = get_le16(fmt + 12);
+      bits = get_le16(fmt + 14);
+      /* the sub-format starts with the format tag */
+      if (format == WAVE_FORMAT_EXTENSIBLE && fmt_size >= 26)
+        format = get_le16(fmt + 24);
+    }
+    chunk_start += chunk_size + (chunk_size & 1);
+    if (fseeko(file, chunk_start, SEEK_SET) != 0)
+      return AUDIOTAP_WRONG_FILETYPE;
+  }
+  if (format != WAVE_FORMAT_PCM
+   || freq == 0
+   || block_align != channels * bits / 8
+   || (convert = get_pcm_converter(bits, channels)) == NULL)
+    return AUDIOTAP_WRONG_FILETYPE;
+
+  if (get_tapenc_functions() == NULL){
+    fclose(file);
+    return AUDIOTAP_LIBRARY_UNAVAILABLE;
+  }
+  wav = (struct wav_read_handle *)calloc(1, sizeof(struct wav_read_handle));
+  if (wav == NULL){
+    fclose(file);
+    return AUDIOTAP_NO_MEMORY;
+  }
+  error = AUDIOTAP_LIBRARY_ERROR;
+  do{
+    wav->file = file;
+    wav->data_start = chunk_start;
+    wav->frame_size = block_align;
+    wav->convert = convert;
+    if (fstat(fileno(file), &stats) != 0)
+      break;
+    /* the size in the header may be wrong if recording was interrupted */
+    if (stats.st_size - chunk_start < data_size)
+      data_size = stats.st_size > chunk_start ? (uint32_t)(stats.st_size - chunk_start) : 0;
+    wav->num_frames = data_size / block_align;
+#ifndef _WIN32
+    if ((uint64_t)stats.st_size <= (size_t)-1 && stats.st_size > 0){
+      void *map = mmap(NULL, (size_t)stats.st_size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+      if (map != MAP_FAILED){
+#ifdef MADV_SEQUENTIAL
+        madvise(map, (size_t)stats.st_size, MADV_SEQUENTIAL);
+#endif
+        wav->map = (const uint8_t *)map;
+        wav->map_size = (size_t)stats.st_size;
+      }
+    }
+#endif
+    wav->reader.wav = wav;
+    if (wav->map == NULL){
+      wav->reader.file = file;
+      error = AUDIOTAP_NO_MEMORY;
+      if ((wav->reader.block = (uint8_t *)malloc(READ_BLOCK_SIZE)) == NULL)
+        break;
+    }
+    if (!wav_reader_seek(&wav->reader, 0))
+      break;
+    error = AUDIOTAP_OK;
+  }while(0);
+  if (error != AUDIOTAP_OK){
+    wavfile_close(wav);
+    return error;
+  }
+  *halfwaves = 1;
+  error = audio2tap_audio_open_common(audiotap,
+                                      freq,
+                                      params,
+                                      machine,
+                                      videotype,
+                                      &wavfile_read_functions,
+                                      wav);
+  if (error == AUDIOTAP_OK){
+    (*audiotap)->file_name = strdup(file_name);
+    (*audiotap)->bytes_per_frame = wav->frame_size;
+  }
+  return error;
+}
+
+static inline uint32_t dmpfile_sample(const uint8_t *data, const int bytes_per_sample){
+  switch(bytes_per_sample){
+  case 1:
+    return data[0];
+  case 2:
+    return data[0] + (data[1] << 8);
+  case 3:
+    return data[0] + (data[1] << 8) + (data[2] << 16);
+  default:
+    return data[0] + (data[1] << 8) + (data[2] << 16) + ((uint32_t)data[3] << 24);
+  }
+}
+
+/* Called with a constant bytes_per_sample, so each caller below gets its own
+   copy of the loop with the sample width known at compile time */
+static inline enum audiotap_status dmpfile_decode(struct audiotap *audiotap, uint32_t *pulse, uint32_t *raw_pulse, size_t max, size_t *got, const int bytes_per_sample){
+  struct tap_read_handle *handle = (struct tap_read_handle *)audiotap->priv;
+  const uint8_t *data = handle->read_ptr, *data_end = handle->read_end;
+  const uint32_t overflow_value = handle->overflow_value;
+  enum audiotap_status ret = AUDIOTAP_OK;
+  size_t n, i;
+
+  for (n = 0; n < max; n++){
+    uint32_t this_pulse, sum = 0;
+    do{
+      if (data_end - data < bytes_per_sample){
+        handle->read_ptr = data;
+        tapfile_fill_view(handle, bytes_per_sample, &audiotap->stats);
+        data = handle->read_ptr;
+        data_end = handle->read_end;
+        if (data_end - data < bytes_per_sample){
+          ret = AUDIOTAP_EOF;
+          goto out;
+        }
+      }
+      this_pulse = dmpfile_sample(data, bytes_per_sample);
+      data += bytes_per_sample;
+      sum += this_pulse;
+      if (this_pulse >= overflow_value)
+        audiotap->stats.overflow_continuations++;
+    }while(this_pulse >= overflow_value);
+    raw_pulse[n] = this_pulse;
+    pulse[n] = sum;
+  }
+out:
+  handle->read_ptr = data;
+  for (i = 0; i < n; i++)
+    pulse[i] = samples_to_cycles(audiotap, pulse[i]);
+  *got = n;
+  return ret;
+}
+
+static enum audiotap_status dmpfile_get_pulses8(struct audiotap *audiotap, uint32_t *pulse, uint32_t *raw_pulse, size_t max, size_t *got){
+  return dmpfile_decode(audiotap, pulse, raw_pulse, max, got, 1);
+}
+
+static enum audiotap_status dmpfile_get_pulses16(struct audiotap *audiotap, uint32_t *pulse, uint32_t *raw_pulse, size_t max, size_t *got){
+  return dmpfile_decode(audiotap, pulse, raw_pulse, max, got, 2);
+}
+
+static enum audiotap_status dmpfile_get_pulses24(struct audiotap *audiotap, uint32_t *pulse, uint32_t *raw_pulse, size_t max, size_t *got){
+  return dmpfile_decode(audiotap, pulse, raw_pulse, max, got, 3);
+}
+
+static enum audiotap_status dmpfile_get_pulses32(struct audiotap *audiotap, uint32_t *pulse, uint32_t *raw_pulse, size_t max, size_t *got){
+  return dmpfile_decode(audiotap, pulse, raw_pulse, max, got, 4);
 }
 
 static enum audiotap_status dmpfile_init(struct audiotap **audiotap,
-                                         const char *file,
+                                         FILE *file,
                                          uint8_t *machine,
                                          uint8_t *videotype,
                                          uint8_t *halfwaves){
   uint32_t freq;
   uint8_t version;
   uint8_t freq_on_file[4];
-  const char dmp_file_header[] = "DC2N-TAP-RAW";
-  struct tap_read_handle *handle = (struct tap_read_handle *)malloc(sizeof(struct tap_read_handle));
+  struct tap_read_handle *handle = (struct tap_read_handle *)calloc(1, sizeof(struct tap_read_handle));
   enum audiotap_status err;
 
-  if (handle == NULL)
+  if (handle == NULL){
+    fclose(file);
     return AUDIOTAP_NO_MEMORY;
+  }
 
   do {
-    char file_header[12];
-    handle->file = fopen(file, "rb");
-    if (handle->file == NULL){
-      err = errno == ENOENT ? AUDIOTAP_NO_FILE : AUDIOTAP_LIBRARY_ERROR;
-      break;
-    }
-    err = AUDIOTAP_LIBRARY_ERROR;
-    if (fread(file_header, sizeof(file_header), 1, handle->file) < 1)
-      break;
+    handle->file = file;
     err = AUDIOTAP_WRONG_FILETYPE;
-    if (memcmp(dmp_file_header, file_header, sizeof(file_header)))
-      break;
     if (fread(&version, 1, 1, handle->file) < 1)
       break;
     if (version > 1)
@@ -571,53 +1647,92 @@ static enum audiotap_status dmpfile_init(struct audiotap **audiotap,
       break;
     if (fread(&handle->bits_per_sample, 1, 1, handle->file) < 1)
       break;
-    handle->overflow_value = (1<<handle->bits_per_sample) - 1;
-    handle->get_wave = dmpfile_get_pulse;
+    if (handle->bits_per_sample == 0 || handle->bits_per_sample > 32)
+      break;
+    handle->overflow_value = handle->bits_per_sample == 32
+      ? 0xFFFFFFFF
+      : (1u<<handle->bits_per_sample) - 1;
+    handle->get_pulses =
+      handle->bits_per_sample <=  8 ? dmpfile_get_pulses8  :
+      handle->bits_per_sample <= 16 ? dmpfile_get_pulses16 :
+      handle->bits_per_sample <= 24 ? dmpfile_get_pulses24 :
+                                      dmpfile_get_pulses32;
     if (fread(freq_on_file, sizeof(freq_on_file), 1, handle->file) < 1)
       break;
     freq = freq_on_file[0]
         + (freq_on_file[1]<< 8)
         + (freq_on_file[2]<<16)
         + (freq_on_file[3]<<24);
+    /* pulses are converted by dividing by it */
+    if (freq == 0)
+      break;
+    err = AUDIOTAP_NO_MEMORY;
+    if (!tapfile_open_view(handle, 20))
+      break;
     err = AUDIOTAP_OK;
   } while (0);
   if (err == AUDIOTAP_OK)
     return audio2tap_open_common(audiotap,
+                                 NULL,
                                  NULL,
                                  freq,
                                  *machine,
                                  *videotype,
                                  &tapfile_read_functions,
                                  handle);
-  if (handle->file != NULL)
-    fclose(handle->file);
+  if (err != AUDIOTAP_WRONG_FILETYPE)
+    fclose(file);
   free(handle);
   return err;
 }
 
-static enum audiotap_status cswfile_get_pulse(struct audiotap *audiotap, uint32_t *pulse, uint32_t *raw_pulse){
+/* Status when the pulses run out: compressed data may have stopped early */
+static enum audiotap_status tapfile_view_end_status(struct tap_read_handle *handle){
+  return handle->view_error ? AUDIOTAP_LIBRARY_ERROR : AUDIOTAP_EOF;
+}
+
+static enum audiotap_status cswfile_get_pulses(struct audiotap *audiotap, uint32_t *pulse, uint32_t *raw_pulse, size_t max, size_t *got){
   struct tap_read_handle *handle = (struct tap_read_handle *)audiotap->priv;
-  uint8_t byte, fourbytes[4];
-
-  if (fread(&byte, 1, 1, handle->file) != 1)
-    return AUDIOTAP_EOF;
-  if (byte != 0)
-    *pulse = byte;
-  else {
-    if (fread(fourbytes, 4, 1, handle->file) != 1)
-      return AUDIOTAP_EOF;
-    *pulse = fourbytes[0]
-          + (fourbytes[1]<< 8)
-          + (fourbytes[2]<<16)
-          + (fourbytes[3]<<24);
-  }
-  *raw_pulse = *pulse;
-  *pulse = (uint32_t)(*pulse * audiotap->factor + 1);
-  return AUDIOTAP_OK;
+  const uint8_t *data = handle->read_ptr, *data_end = handle->read_end;
+  enum audiotap_status ret = AUDIOTAP_OK;
+  size_t n;
+
+  for (n = 0; n < max; n++){
+    uint32_t this_pulse;
+
+    if (data_end - data < 5){
+      handle->read_ptr = data;
+      tapfile_fill_view(handle, 5, &audiotap->stats);
+      data = handle->read_ptr;
+      data_end = handle->read_end;
+      if (data == data_end){
+        ret = tapfile_view_end_status(handle);
+        break;
+      }
+    }
+    this_pulse = *data++;
+    if (this_pulse == 0){
+      if (data_end - data < 4){
+        data = data_end;
+        ret = tapfile_view_end_status(handle);
+        break;
+      }
+      this_pulse = data[0]
+                + (data[1]<< 8)
+                + (data[2]<<16)
+                + ((uint32_t)data[3]<<24);
+      data += 4;
+    }
+    raw_pulse[n] = this_pulse;
+    pulse[n] = samples_to_cycles(audiotap, this_pulse);
+  }
+  handle->read_ptr = data;
+  *got = n;
+  return ret;
 }
 
 static enum audiotap_status cswfile_init(struct audiotap **audiotap,
-                                         const char *file,
+                                         FILE *file,
                                          uint8_t *machine,
                                          uint8_t *videotype,
                                          uint8_t *halfwaves){
@@ -626,26 +1741,17 @@ static enum audiotap_status cswfile_init(struct audiotap **audiotap,
   uint8_t freq_on_file[4] = {0,0,0,0};
   uint8_t file_size[4];
   uint8_t discarded[17];
-  const char csw_file_header[] = {'C','o','m','p','r','e','s','s','e','d',' ','S','q','u','a','r','e',' ','W','a','v','e',0x1a};
-  struct tap_read_handle *handle = (struct tap_read_handle *)malloc(sizeof(struct tap_read_handle));
+  struct tap_read_handle *handle = (struct tap_read_handle *)calloc(1, sizeof(struct tap_read_handle));
   enum audiotap_status err;
 
-  if (handle == NULL)
+  if (handle == NULL){
+    fclose(file);
     return AUDIOTAP_NO_MEMORY;
+  }
 
   do {
-    char file_header[sizeof(csw_file_header)];
-    handle->file = fopen(file, "rb");
-    if (handle->file == NULL){
-      err = errno == ENOENT ? AUDIOTAP_NO_FILE : AUDIOTAP_LIBRARY_ERROR;
-      break;
-    }
-    err = AUDIOTAP_LIBRARY_ERROR;
-    if (fread(file_header, sizeof(file_header), 1, handle->file) < 1)
-      break;
+    handle->file = file;
     err = AUDIOTAP_WRONG_FILETYPE;
-    if (memcmp(csw_file_header, file_header, sizeof(file_header)))
-      break;
     if (fread(&version_major, 1, 1, handle->file) < 1)
       break;
     if (fread(&version_minor, 1, 1, handle->file) < 1)
@@ -660,35 +1766,79 @@ static enum audiotap_status cswfile_init(struct audiotap **audiotap,
       break;
     if (fread(&compression_type, 1, 1, handle->file) < 1)
       break;
-    if (compression_type != 1)
+    /* Z-RLE only exists in version 2 */
+    if (compression_type != 1
+     && (compression_type != 2 || version_major != 2))
       break;
     if (fread(&flags, 1, 1, handle->file) < 1)
       break;
     if (fread(discarded, version_major == 2 ? 17 : 3, 1, handle->file) < 1)
       break;
+    /* skip header extension */
+    if (version_major == 2 && fseek(handle->file, discarded[0], SEEK_CUR) != 0)
+      break;
     freq = freq_on_file[0]
         + (freq_on_file[1]<< 8)
         + (freq_on_file[2]<<16)
         + (freq_on_file[3]<<24);
+    if (freq == 0)
+      break;
     handle->wave_mode = (flags&1) ? reading_both_halfwaves : reading_single_halfwave_one_shot;
-    handle->get_wave = cswfile_get_pulse;
+    handle->starts_one_shot = !(flags&1);
+    handle->get_pulses = cswfile_get_pulses;
     *halfwaves = 1;
+    if (compression_type == 2){
+      err = AUDIOTAP_LIBRARY_UNAVAILABLE;
+      if (zlib_init_status != LIBRARY_OK)
+        break;
+      err = AUDIOTAP_NO_MEMORY;
+      if (!tapfile_open_compressed_view(handle, ftello(handle->file)))
+        break;
+    }
+    else{
+      err = AUDIOTAP_NO_MEMORY;
+      if (!tapfile_open_view(handle, ftello(handle->file)))
+        break;
+    }
     err = AUDIOTAP_OK;
   }while (0);
   if (err == AUDIOTAP_OK)
     return audio2tap_open_common(audiotap,
+                                 NULL,
                                  NULL,
                                  freq,
                                  *machine,
                                  *videotype,
                                  &tapfile_read_functions,
                                  handle);
-  if (handle->file != NULL)
-    fclose(handle->file);
+  tapfile_close_view(handle);
+  if (err != AUDIOTAP_WRONG_FILETYPE)
+    fclose(file);
   free(handle);
   return err;
 }
 
+static const char dmp_file_header[] = "DC2N-TAP-RAW";
+static const char csw_file_header[] = {'C','o','m','p','r','e','s','s','e','d',' ','S','q','u','a','r','e',' ','W','a','v','e',0x1a};
+
+static const struct file_format {
+  const char *header;
+  size_t header_size;
+  enum audiotap_status (*init)(struct audiotap **audiotap,
+                               FILE *file,
+                               uint8_t *machine,
+                               uint8_t *videotype,
+                               uint8_t *halfwaves);
+} file_formats[] = {
+  {c64_tap_header , sizeof(c64_tap_header) - 1, tapfile_init},
+  {c16_tap_header , sizeof(c16_tap_header) - 1, tapfile_init},
+  {dmp_file_header, sizeof(dmp_file_header) - 1, dmpfile_init},
+  {csw_file_header, sizeof(csw_file_header)    , cswfile_init}
+};
+
+/* Enough for the longest header in file_formats */
+#define MAX_FILE_HEADER_SIZE sizeof(csw_file_header)
+
 enum audiotap_status audio2tap_open_from_file3(struct audiotap **audiotap,
                                               const char *file,
                                               struct tapenc_params *params,
@@ -696,27 +1846,44 @@ enum audiotap_status audio2tap_open_from_file3(struct audiotap **audiotap,
                                               uint8_t *videotype,
                                               uint8_t *halfwaves){
   enum audiotap_status error;
+  uint8_t file_header[MAX_FILE_HEADER_SIZE];
+  size_t header_size, i;
+  FILE *fd;
 
   if (machine == NULL || videotype == NULL || halfwaves == NULL)
     return AUDIOTAP_WRONG_ARGUMENTS;
-  error = tapfile_init(audiotap, file, machine, videotype, halfwaves);
-  if (error == AUDIOTAP_OK)
-    return AUDIOTAP_OK;
-  if (error != AUDIOTAP_WRONG_FILETYPE)
-    return error;
-  error = dmpfile_init(audiotap, file, machine, videotype, halfwaves);
-  if (error == AUDIOTAP_OK)
-    return AUDIOTAP_OK;
-  if (error != AUDIOTAP_WRONG_FILETYPE)
-    return error;
-  error = cswfile_init(audiotap, file, machine, videotype, halfwaves);
-  if (error == AUDIOTAP_OK)
-    return AUDIOTAP_OK;
+  fd = fopen(file, "rb");
+  if (fd == NULL)
+    return errno == ENOENT ? AUDIOTAP_NO_FILE : AUDIOTAP_LIBRARY_ERROR;
+  header_size = fread(file_header, 1, sizeof(file_header), fd);
+  for (i = 0; i < sizeof(file_formats) / sizeof(file_formats[0]); i++){
+    const struct file_format *format = &file_formats[i];
+
+    if (header_size < format->header_size
+     || memcmp(format->header, file_header, format->header_size))
+      continue;
+    if (fseek(fd, (long)format->header_size, SEEK_SET) != 0)
+      break;
+    error = format->init(audiotap, fd, machine, videotype, halfwaves);
+    if (error != AUDIOTAP_WRONG_FILETYPE)
+      return error;
+    break;
+  }
+  if (params == NULL){
+    fclose(fd);
+    return AUDIOTAP_WRONG_ARGUMENTS;
+  }
+  error = wavfile_read_init(audiotap,
+                           fd,
+                           file,
+                           params,
+                           *machine,
+                           *videotype,
+                           halfwaves);
   if (error != AUDIOTAP_WRONG_FILETYPE)
     return error;
-  if (params == NULL)
-    return AUDIOTAP_WRONG_ARGUMENTS;
   return audiofile_read_init(audiotap,
+                        fd,
                         file,
                         params,
                         *machine,
@@ -724,8 +1891,8 @@ enum audiotap_status audio2tap_open_from_file3(struct audiotap **audiotap,
                         halfwaves);
 }
 
-static enum audiotap_status portaudio_set_buffer(void *priv, int32_t *buffer, uint32_t bufsize, uint32_t *numframes){
-  if (Pa_ReadStream((PaStream*)priv, buffer, bufsize) != paNoError)
+static enum audiotap_status portaudio_set_buffer(struct audiotap *audiotap, int32_t *buffer, uint32_t bufsize, uint32_t *numframes){
+  if (Pa_ReadStream((PaStream*)audiotap->priv, buffer, bufsize) != paNoError)
     return AUDIOTAP_LIBRARY_ERROR;
   *numframes=bufsize;
   return AUDIOTAP_OK;
@@ -736,11 +1903,11 @@ static void portaudio_close(void *priv){
   Pa_CloseStream((PaStream*)priv);
 }
 
-static int portaudio_get_total_len(struct audiotap *audiotap){
+static int64_t portaudio_get_total_len(struct audiotap *audiotap){
   return -1;
 }
 
-static int portaudio_get_current_pos(struct audiotap *audiotap){
+static int64_t portaudio_get_current_pos(struct audiotap *audiotap){
   return -1;
 }
 
@@ -754,7 +1921,7 @@ static int portaudio_seek_to_beginning(struct audiotap *audiotap)
 }
 
 static const struct audio2tap_functions portaudio_read_functions = {
-  audio_get_pulse,
+  audio_get_pulses,
   portaudio_set_buffer,
   portaudio_get_total_len,
   portaudio_get_current_pos,
@@ -762,7 +1929,78 @@ static const struct audio2tap_functions portaudio_read_functions = {
   audio_invert,
   portaudio_seek_to_beginning,
   audio_enable_disable_halfwaves,
-  portaudio_close
+  portaudio_close,
+  NULL,
+  NULL,
+  NULL,
+  NULL,
+  NULL,
+  NULL,
+  NULL
+};
+
+/* Capture through a callback: PortAudio's thread puts samples in a ring,
+   and the encoder takes them from there, so a slow consumer does not make
+   the sound card lose data */
+struct portaudio_capture {
+  PaStream *stream;
+  struct ring_buffer *ring;
+  long wait_ms; /* how long to sleep when the ring is empty */
+};
+
+static int portaudio_capture_callback(const void *input, void *output,
+                                      unsigned long frames,
+                                      const PaStreamCallbackTimeInfo *time_info,
+                                      PaStreamCallbackFlags status_flags,
+                                      void *priv){
+  struct portaudio_capture *capture = (struct portaudio_capture *)priv;
+
+  write_to_ring_buffer(capture->ring, (const int32_t *)input, (uint32_t)frames);
+  return paContinue;
+}
+
+static enum audiotap_status portaudio_ring_set_buffer(struct audiotap *audiotap, int32_t *buffer, uint32_t bufsize, uint32_t *numframes){
+  struct portaudio_capture *capture = (struct portaudio_capture *)audiotap->priv;
+  uint32_t lost;
+
+  while ((*numframes = read_from_ring_buffer(capture->ring, buffer, bufsize, &lost)) == 0){
+    audiotap->lost_before_buffer += lost;
+    audiotap->stats.samples_lost += lost;
+    if (ATOMIC_LOAD(audiotap->terminated))
+      return AUDIOTAP_INTERRUPTED;
+    if (lost == 0)
+      Pa_Sleep(capture->wait_ms);
+  }
+  audiotap->lost_before_buffer += lost;
+  audiotap->stats.samples_lost += lost;
+  return AUDIOTAP_OK;
+}
+
+static void portaudio_ring_close(void *priv){
+  struct portaudio_capture *capture = (struct portaudio_capture *)priv;
+
+  portaudio_close(capture->stream);
+  destroy_ring_buffer(capture->ring);
+  free(capture);
+}
+
+static const struct audio2tap_functions portaudio_ring_read_functions = {
+  audio_get_pulses,
+  portaudio_ring_set_buffer,
+  portaudio_get_total_len,
+  portaudio_get_current_pos,
+  portaudio_is_eof,
+  audio_invert,
+  portaudio_seek_to_beginning,
+  audio_enable_disable_halfwaves,
+  portaudio_ring_close,
+  NULL,
+  NULL,
+  NULL,
+  NULL,
+  NULL,
+  NULL,
+  NULL
 };
 
 enum audiotap_status audio2tap_from_soundcard4(struct audiotap **audiotap,
@@ -770,77 +2008,768 @@ enum audiotap_status audio2tap_from_soundcard4(struct audiotap **audiotap,
                                               struct tapenc_params *params,
                                               uint8_t machine,
                                               uint8_t videotype){
-  enum audiotap_status error=AUDIOTAP_LIBRARY_ERROR;
+  return audio2tap_from_soundcard5(audiotap,
+                                   freq,
+                                   params,
+                                   machine,
+                                   videotype,
+                                   DEFAULT_BUFFER_FRAMES,
+                                   0);
+}
+
+enum audiotap_status audio2tap_from_soundcard5(struct audiotap **audiotap,
+                                              uint32_t freq,
+                                              struct tapenc_params *params,
+                                              uint8_t machine,
+                                              uint8_t videotype,
+                                              uint32_t frames_per_buffer,
+                                              uint32_t ring_ms){
   PaStream *pastream;
+  struct portaudio_capture *capture;
+
+  if (status.portaudio_init_status != LIBRARY_OK
+   || get_tapenc_functions() == NULL)
+    return AUDIOTAP_LIBRARY_UNAVAILABLE;
+  if (freq == 0)
+    return AUDIOTAP_WRONG_ARGUMENTS;
+  if (ring_ms == 0){
+    if (Pa_OpenDefaultStream(&pastream, 1, 0, paInt32, freq, frames_per_buffer, NULL, NULL) != paNoError)
+      return AUDIOTAP_LIBRARY_ERROR;
+    if (Pa_StartStream(pastream) != paNoError){
+      Pa_CloseStream(pastream);
+      return AUDIOTAP_LIBRARY_ERROR;
+    }
+    return audio2tap_audio_open_common(audiotap,
+                                       freq,
+                                       params,
+                                       machine,
+                                       videotype,
+                                       &portaudio_read_functions,
+                                       pastream);
+  }
+
+  capture = (struct portaudio_capture *)malloc(sizeof(struct portaudio_capture));
+  if (capture == NULL)
+    return AUDIOTAP_NO_MEMORY;
+  capture->ring = create_ring_buffer((uint32_t)((uint64_t)freq * ring_ms / 1000));
+  if (capture->ring == NULL){
+    free(capture);
+    return AUDIOTAP_NO_MEMORY;
+  }
+  /* wake up about twice per callback */
+  capture->wait_ms = frames_per_buffer ? (long)((uint64_t)frames_per_buffer * 500 / freq) : 5;
+  if (capture->wait_ms == 0)
+    capture->wait_ms = 1;
+  if (Pa_OpenDefaultStream(&capture->stream, 1, 0, paInt32, freq, frames_per_buffer, portaudio_capture_callback, capture) != paNoError){
+    destroy_ring_buffer(capture->ring);
+    free(capture);
+    return AUDIOTAP_LIBRARY_ERROR;
+  }
+  if (Pa_StartStream(capture->stream) != paNoError){
+    Pa_CloseStream(capture->stream);
+    destroy_ring_buffer(capture->ring);
+    free(capture);
+    return AUDIOTAP_LIBRARY_ERROR;
+  }
+  return audio2tap_audio_open_common(audiotap,
+                                     freq,
+                                     params,
+                                     machine,
+                                     videotype,
+                                     &portaudio_ring_read_functions,
+                                     capture);
+}
+
+/* Pulses to read before the next checkpoint is due (0 if it is due now),
+   or UINT64_MAX if no checkpoints are being recorded. Checkpoints are
+   due at multiples of the interval (the start needs none) */
+static uint64_t pulses_to_checkpoint(struct audiotap *audiotap){
+  uint64_t next_pulse_number;
+
+  if (audiotap->checkpoint_interval == 0
+   || !audiotap->position_known
+   || audiotap->detected_pulses != NULL
+   || audiotap->audio2tap_functions->tell == NULL)
+    return UINT64_MAX;
+  next_pulse_number = audiotap->checkpoint_interval;
+  if (audiotap->num_checkpoints > 0)
+    next_pulse_number += audiotap->checkpoints[audiotap->num_checkpoints - 1].pulse_number
+                       / audiotap->checkpoint_interval * audiotap->checkpoint_interval;
+  return audiotap->pulse_number < next_pulse_number ? next_pulse_number - audiotap->pulse_number : 0;
+}
+
+static void record_checkpoint(struct audiotap *audiotap){
+  struct checkpoint *checkpoint;
+  int64_t offset;
+
+  if (pulses_to_checkpoint(audiotap) != 0)
+    return;
+  if ((offset = audiotap->audio2tap_functions->tell(audiotap)) < 0)
+    return;
+  if (audiotap->num_checkpoints == audiotap->max_checkpoints){
+    size_t max_checkpoints = audiotap->max_checkpoints ? 2 * audiotap->max_checkpoints : 64;
+    struct checkpoint *checkpoints = (struct checkpoint *)realloc(audiotap->checkpoints, max_checkpoints * sizeof(struct checkpoint));
+
+    if (checkpoints == NULL)
+      return;
+    audiotap->checkpoints = checkpoints;
+    audiotap->max_checkpoints = max_checkpoints;
+  }
+  checkpoint = &audiotap->checkpoints[audiotap->num_checkpoints++];
+  checkpoint->offset = offset;
+  checkpoint->cycles = audiotap->cycles;
+  checkpoint->pulse_number = audiotap->pulse_number;
+  checkpoint->remainder = audiotap->remainder;
+}
+
+static void clear_checkpoints(struct audiotap *audiotap){
+  audiotap->num_checkpoints = 0;
+}
+
+/* All reading goes through here, to keep track of the position. Reading
+   stops at each checkpoint on the way, so it can be recorded */
+static enum audiotap_status read_pulses(struct audiotap *audiotap, uint32_t *pulses, uint32_t *raw_pulses, size_t max, size_t *got){
+  enum audiotap_status ret = AUDIOTAP_OK;
+  size_t done = 0;
+
+  while (done < max && ret == AUDIOTAP_OK){
+    uint64_t due = pulses_to_checkpoint(audiotap), cycles = 0;
+    size_t wanted = max - done, got_now, i;
+
+    if (due > 0 && due < wanted)
+      wanted = (size_t)due;
+    ret = audiotap->audio2tap_functions->get_pulses(audiotap, pulses + done, raw_pulses + done, wanted, &got_now);
+    for (i = done; i < done + got_now; i++)
+      cycles += pulses[i];
+    audiotap->cycles += cycles;
+    audiotap->pulse_number += got_now;
+    audiotap->stats.pulses_read += got_now;
+    done += got_now;
+    record_checkpoint(audiotap);
+  }
+  *got = done;
+  return ret;
+}
+
+enum audiotap_status audio2tap_get_pulses(struct audiotap *audiotap, uint32_t *pulse, uint32_t *raw_pulse){
+  size_t got;
+
+  return read_pulses(audiotap, pulse, raw_pulse, 1, &got);
+}
+
+enum audiotap_status audio2tap_get_pulses_batch(struct audiotap *audiotap, uint32_t *pulses, uint32_t *raw_pulses, size_t max, size_t *got){
+  return read_pulses(audiotap, pulses, raw_pulses, max, got);
+}
+
+/* Detection of pulses on several threads. The input is split into
+   segments, each detected by an encoder of its own, which starts from
+   scratch and so may get the first pulses of the segment wrong. Its state
+   is saved after each of its first pulses. Then, segment after segment, the
+   encoder which has read everything before goes on into the next segment
+   until it is in one of those states, at the same sample: the pulses after
+   that one are those it would have detected too. So the pulses are the same
+   as those detected on one thread. Only the built-in encoder, whose state
+   can be saved and compared, is used like this */
+
+/* More segments than threads, so threads finishing early can take more */
+#define SEGMENTS_PER_THREAD 4
+/* States saved after the first pulses of a segment */
+#define SEGMENT_SNAPSHOTS 32
+
+struct pulse_list {
+  uint32_t *raw_pulses;
+  size_t num_pulses, max_pulses;
+};
+
+struct snapshot {
+  int64_t pos;          /* of the sample after the pulse */
+  size_t pulse;         /* index of the pulse in the segment */
+  struct tap_enc_t *tapenc;
+};
+
+struct segment {
+  int64_t start, end;   /* in samples. The last segment ends with the input */
+  struct pulse_list pulses;
+  struct tap_enc_t *tapenc; /* state at the end */
+  struct snapshot snapshots[SEGMENT_SNAPSHOTS];
+  unsigned int num_snapshots;
+  uint8_t at_eof;       /* the input ended in it, and the last pulse was flushed */
+  enum audiotap_status status;
+  struct audiotap_stats stats;
+};
+
+struct parallel_detection {
+  struct audiotap *audiotap;
+  struct segment *segments;
+  long num_segments;
+  volatile long next;  /* first segment not yet taken by a thread */
+};
+
+static enum audiotap_status add_pulse(struct pulse_list *list, uint32_t raw_pulse){
+  if (list->num_pulses == list->max_pulses){
+    size_t max_pulses = list->max_pulses ? 2 * list->max_pulses : 4096;
+    uint32_t *raw_pulses = (uint32_t *)realloc(list->raw_pulses, max_pulses * sizeof(uint32_t));
+
+    if (raw_pulses == NULL)
+      return AUDIOTAP_NO_MEMORY;
+    list->raw_pulses = raw_pulses;
+    list->max_pulses = max_pulses;
+  }
+  list->raw_pulses[list->num_pulses++] = raw_pulse;
+  return AUDIOTAP_OK;
+}
+
+static enum audiotap_status read_segment_frames(struct audiotap *audiotap, struct segment *segment, void *reader, int32_t *buffer, uint32_t *numframes){
+  uint64_t start = get_time_ns();
+  enum audiotap_status ret = audiotap->audio2tap_functions->read_frames(reader, buffer, audiotap->bufsize, numframes);
+
+  segment->stats.io_ns += get_time_ns() - start;
+  segment->stats.buffer_refills++;
+  segment->stats.bytes_read += (uint64_t)*numframes * audiotap->bytes_per_frame;
+  return ret;
+}
+
+/* Feeds the samples of segment to tapenc, adding the pulses detected to
+   list, up to the end of the segment, or of the input (then the last pulse
+   is flushed, and *at_eof set). If join is not 0, stops as soon as tapenc
+   is in the state of one of the segment's snapshots, at *joined (otherwise
+   left to NULL). Otherwise, saves the snapshots */
+static enum audiotap_status feed_segment(struct audiotap *audiotap, struct segment *segment, struct tap_enc_t *tapenc,
+                                         struct pulse_list *list, int join, const struct snapshot **joined,
+                                         uint8_t *at_eof, int32_t *buffer){
+  const struct tapenc_functions *tapenc_functions = audiotap->tapenc_functions;
+  int64_t pos = segment->start;
+  int32_t *samples = buffer;
+  uint32_t room = 0, numframes, raw_pulse, done_now;
+  unsigned int next_snapshot = 0;
+  enum audiotap_status ret = AUDIOTAP_OK;
+  void *reader = audiotap->audio2tap_functions->open_reader(audiotap, pos);
+
+  if (reader == NULL)
+    return AUDIOTAP_LIBRARY_ERROR;
+  while (pos < segment->end){
+    if (room == 0){
+      if (ATOMIC_LOAD(audiotap->terminated)){
+        ret = AUDIOTAP_INTERRUPTED;
+        break;
+      }
+      if ((ret = read_segment_frames(audiotap, segment, reader, buffer, &numframes)) != AUDIOTAP_OK)
+        break;
+      if (numframes == 0){
+        *at_eof = 1;
+        ret = add_pulse(list, tapenc_functions->flush(tapenc));
+        break;
+      }
+      samples = buffer;
+      room = numframes;
+    }
+    done_now = tapenc_functions->get_pulse(tapenc, samples,
+                                           segment->end - pos < room ? (uint32_t)(segment->end - pos) : room,
+                                           &raw_pulse);
+    samples += done_now;
+    room -= done_now;
+    pos += done_now;
+    if (raw_pulse == 0)
+      continue;
+    if ((ret = add_pulse(list, raw_pulse)) != AUDIOTAP_OK)
+      break;
+    if (join){
+      while (next_snapshot < segment->num_snapshots && segment->snapshots[next_snapshot].pos < pos)
+        next_snapshot++;
+      if (next_snapshot < segment->num_snapshots
+       && segment->snapshots[next_snapshot].pos == pos
+       && tapenc_functions->same_state(tapenc, segment->snapshots[next_snapshot].tapenc)){
+        *joined = &segment->snapshots[next_snapshot];
+        break;
+      }
+    }
+    else if (segment->start > 0 && segment->num_snapshots < SEGMENT_SNAPSHOTS){
+      struct snapshot *snapshot = &segment->snapshots[segment->num_snapshots];
+
+      if ((snapshot->tapenc = tapenc_functions->clone(tapenc)) == NULL){
+        ret = AUDIOTAP_NO_MEMORY;
+        break;
+      }
+      snapshot->pos = pos;
+      snapshot->pulse = list->num_pulses - 1;
+      segment->num_snapshots++;
+    }
+  }
+  audiotap->audio2tap_functions->close_reader(reader);
+  return ret;
+}
+
+static void detect_segments(void *arg){
+  struct parallel_detection *detection = (struct parallel_detection *)arg;
+  struct audiotap *audiotap = detection->audiotap;
+  int32_t *buffer = (int32_t *)malloc(audiotap->bufsize * sizeof(int32_t));
+  long i;
+
+  while ((i = ATOMIC_FETCH_ADD(detection->next, 1)) < detection->num_segments){
+    struct segment *segment = &detection->segments[i];
+    uint64_t begin = get_time_ns();
+
+    if (buffer == NULL || (segment->tapenc = create_handle_tapenc(audiotap)) == NULL)
+      segment->status = AUDIOTAP_NO_MEMORY;
+    else
+      segment->status = feed_segment(audiotap, segment, segment->tapenc, &segment->pulses, 0, NULL, &segment->at_eof, buffer);
+    segment->stats.encoder_ns = get_time_ns() - begin - segment->stats.io_ns;
+  }
+  free(buffer);
+}
+
+/* Goes on with *tapenc, which has read everything before segment, into it,
+   adding the right pulses of the segment to list. *tapenc is then the
+   encoder which has read the whole segment */
+static enum audiotap_status join_segment(struct audiotap *audiotap, struct segment *segment, struct tap_enc_t **tapenc,
+                                         struct pulse_list *list, uint8_t *at_eof, int32_t *buffer){
+  const struct snapshot *joined = NULL;
+  uint64_t begin = get_time_ns(), io_ns = segment->stats.io_ns;
+  enum audiotap_status ret = feed_segment(audiotap, segment, *tapenc, list, 1, &joined, at_eof, buffer);
+  size_t i;
+
+  segment->stats.encoder_ns += get_time_ns() - begin - (segment->stats.io_ns - io_ns);
+  if (ret != AUDIOTAP_OK || joined == NULL)
+    return ret;
+  for (i = joined->pulse + 1; i < segment->pulses.num_pulses && ret == AUDIOTAP_OK; i++)
+    ret = add_pulse(list, segment->pulses.raw_pulses[i]);
+  audiotap->tapenc_functions->exit(*tapenc);
+  *tapenc = segment->tapenc;
+  segment->tapenc = NULL;
+  *at_eof = segment->at_eof;
+  return ret;
+}
+
+static void free_segment(struct audiotap *audiotap, struct segment *segment){
+  unsigned int i;
+
+  for (i = 0; i < segment->num_snapshots; i++)
+    audiotap->tapenc_functions->exit(segment->snapshots[i].tapenc);
+  if (segment->tapenc != NULL)
+    audiotap->tapenc_functions->exit(segment->tapenc);
+  free(segment->pulses.raw_pulses);
+}
+
+enum audiotap_status audio2tap_detect_pulses_in_parallel(struct audiotap *audiotap, unsigned int threads){
+  struct parallel_detection detection;
+  struct pulse_list pulses = {NULL, 0, 0};
+  struct tap_enc_t *tapenc = NULL;
+  enum audiotap_status ret = AUDIOTAP_OK;
+  int64_t total_len;
+  int32_t *buffer;
+  uint8_t at_eof;
+  long i;
+
+  if (audiotap->audio2tap_functions->open_reader == NULL
+   || audiotap->tapenc_functions->clone == NULL)
+    return AUDIOTAP_OK;
+  if (threads == 0)
+    threads = get_num_cores();
+  if (threads < 2
+   || (total_len = audiotap->audio2tap_functions->get_total_len(audiotap)) <= 0)
+    return AUDIOTAP_OK;
+  if (!audio2tap_seek_to_beginning(audiotap))
+    return AUDIOTAP_LIBRARY_ERROR;
+  detection.audiotap = audiotap;
+  detection.num_segments = (long)threads * SEGMENTS_PER_THREAD;
+  detection.next = 0;
+  detection.segments = (struct segment *)calloc(detection.num_segments, sizeof(struct segment));
+  if (detection.segments == NULL)
+    return AUDIOTAP_NO_MEMORY;
+  for (i = 0; i < detection.num_segments; i++){
+    detection.segments[i].start = total_len * i / detection.num_segments;
+    /* the last segment goes on to the end, even if the length was wrong */
+    detection.segments[i].end = i == detection.num_segments - 1 ? INT64_MAX
+      : total_len * (i + 1) / detection.num_segments;
+  }
+  run_on_threads(threads, detect_segments, &detection);
+
+  for (i = 0; i < detection.num_segments && ret == AUDIOTAP_OK; i++)
+    ret = detection.segments[i].status;
+  buffer = (int32_t *)malloc(audiotap->bufsize * sizeof(int32_t));
+  if (ret == AUDIOTAP_OK && buffer == NULL)
+    ret = AUDIOTAP_NO_MEMORY;
+  /* the first segment starts where the input does, so it is right */
+  if (ret == AUDIOTAP_OK){
+    pulses = detection.segments[0].pulses;
+    detection.segments[0].pulses.raw_pulses = NULL;
+    tapenc = detection.segments[0].tapenc;
+    detection.segments[0].tapenc = NULL;
+    at_eof = detection.segments[0].at_eof;
+    for (i = 1; i < detection.num_segments && !at_eof && ret == AUDIOTAP_OK; i++)
+      ret = join_segment(audiotap, &detection.segments[i], &tapenc, &pulses, &at_eof, buffer);
+  }
+  free(buffer);
+  if (tapenc != NULL)
+    audiotap->tapenc_functions->exit(tapenc);
+  for (i = 0; i < detection.num_segments; i++){
+    struct segment *segment = &detection.segments[i];
+
+    audiotap->stats.bytes_read += segment->stats.bytes_read;
+    audiotap->stats.buffer_refills += segment->stats.buffer_refills;
+    audiotap->stats.encoder_ns += segment->stats.encoder_ns;
+    audiotap->stats.io_ns += segment->stats.io_ns;
+    free_segment(audiotap, segment);
+  }
+  free(detection.segments);
+  if (ret != AUDIOTAP_OK){
+    free(pulses.raw_pulses);
+    return ret;
+  }
+  /* nothing at all was detected: reading ends at once */
+  if (pulses.num_pulses == 0){
+    free(pulses.raw_pulses);
+    audiotap->has_flushed = 1;
+    return AUDIOTAP_OK;
+  }
+  audiotap->detected_pulses = pulses.raw_pulses;
+  audiotap->num_detected_pulses = pulses.num_pulses;
+  return AUDIOTAP_OK;
+}
+
+/* Last checkpoint before the given pulse number (or time, if by_cycles) */
+static const struct checkpoint *find_checkpoint(struct audiotap *audiotap, uint64_t target, int by_cycles){
+  size_t low = 0, high = audiotap->num_checkpoints;
+
+  while (low < high){
+    size_t mid = low + (high - low) / 2;
+    uint64_t value = by_cycles ? audiotap->checkpoints[mid].cycles
+                               : audiotap->checkpoints[mid].pulse_number;
+    if (value <= target)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  return low > 0 ? &audiotap->checkpoints[low - 1] : NULL;
+}
+
+/* Goes back to the closest known position before target, unless the
+   current position is closer */
+static enum audiotap_status rewind_to_checkpoint(struct audiotap *audiotap, uint64_t target, int by_cycles){
+  const struct checkpoint *checkpoint = find_checkpoint(audiotap, target, by_cycles);
+  uint64_t current = by_cycles ? audiotap->cycles : audiotap->pulse_number;
+
+  if (audiotap->position_known && current <= target
+   && (checkpoint == NULL || checkpoint->pulse_number <= audiotap->pulse_number))
+    return AUDIOTAP_OK;
+  if (checkpoint != NULL){
+    if (!audiotap->audio2tap_functions->seek(audiotap, checkpoint->offset))
+      return AUDIOTAP_ERR;
+    audiotap->pulse_number = checkpoint->pulse_number;
+    audiotap->cycles = checkpoint->cycles;
+    audiotap->remainder = checkpoint->remainder;
+  }
+  else if (!audio2tap_seek_to_beginning(audiotap))
+    return AUDIOTAP_ERR;
+  audiotap->position_known = 1;
+  return AUDIOTAP_OK;
+}
+
+enum audiotap_status audio2tap_seek_to_pulse(struct audiotap *audiotap, uint64_t pulse_number){
+  enum audiotap_status ret;
+
+  if (audiotap->audio2tap_functions->seek == NULL)
+    return AUDIOTAP_ERR;
+  if ((ret = rewind_to_checkpoint(audiotap, pulse_number, 0)) != AUDIOTAP_OK)
+    return ret;
+  while (audiotap->pulse_number < pulse_number){
+    uint32_t pulses[256], raw_pulses[256];
+    size_t wanted = pulse_number - audiotap->pulse_number, got;
+
+    if (wanted > sizeof(pulses) / sizeof(pulses[0]))
+      wanted = sizeof(pulses) / sizeof(pulses[0]);
+    if ((ret = read_pulses(audiotap, pulses, raw_pulses, wanted, &got)) != AUDIOTAP_OK)
+      return ret;
+  }
+  return AUDIOTAP_OK;
+}
+
+enum audiotap_status audio2tap_seek_to_time(struct audiotap *audiotap, uint64_t milliseconds){
+  uint64_t cycles = milliseconds * audiotap->clock / 1000;
+  enum audiotap_status ret;
+
+  if (audiotap->audio2tap_functions->seek == NULL)
+    return AUDIOTAP_ERR;
+  /* Jump straight there if nothing is known about that part of the input */
+  if (audiotap->audio2tap_functions->seek_to_cycles != NULL
+   && (audiotap->num_checkpoints == 0
+    || audiotap->checkpoints[audiotap->num_checkpoints - 1].cycles < cycles)
+   && (!audiotap->position_known || audiotap->cycles < cycles)){
+    if (!audiotap->audio2tap_functions->seek_to_cycles(audiotap, cycles))
+      return AUDIOTAP_ERR;
+    audiotap->cycles = cycles;
+    audiotap->position_known = 0;
+    return AUDIOTAP_OK;
+  }
+  if ((ret = rewind_to_checkpoint(audiotap, cycles, 1)) != AUDIOTAP_OK)
+    return ret;
+  while (audiotap->cycles < cycles){
+    uint32_t pulse, raw_pulse;
+    size_t got;
+
+    if ((ret = read_pulses(audiotap, &pulse, &raw_pulse, 1, &got)) != AUDIOTAP_OK)
+      return ret;
+  }
+  return AUDIOTAP_OK;
+}
+
+void audio2tap_set_checkpoint_interval(struct audiotap *audiotap, uint32_t pulses){
+  if (pulses != audiotap->checkpoint_interval)
+    clear_checkpoints(audiotap);
+  audiotap->checkpoint_interval = pulses;
+}
+
+enum audiotap_status audio2tap_build_index(struct audiotap *audiotap){
+  uint64_t pulse_number = audiotap->pulse_number;
+  enum audiotap_status ret;
+
+  if (!audiotap->position_known)
+    return AUDIOTAP_ERR;
+  if ((ret = audio2tap_seek_to_pulse(audiotap, UINT64_MAX)) != AUDIOTAP_EOF)
+    return ret;
+  return audio2tap_seek_to_pulse(audiotap, pulse_number);
+}
+
+/* Index files start with a header, then have one record per checkpoint.
+   All numbers are 64-bit little-endian */
+
+static const char index_file_header[] = "AUDIOTAP-INDEX\x1a\x02";
+
+#define INDEX_KEY_SIZE 32
+#define INDEX_RECORD_SIZE 32
+
+static void put_le64(uint8_t *buf, uint64_t value){
+  int i;
+
+  for (i = 0; i < 8; i++, value >>= 8)
+    buf[i] = (uint8_t)value;
+}
+
+static uint64_t get_le64(const uint8_t *buf){
+  uint64_t value = 0;
+  int i;
+
+  for (i = 7; i >= 0; i--)
+    value = value << 8 | buf[i];
+  return value;
+}
+
+static int get_index_key(struct audiotap *audiotap, uint8_t *buf){
+  struct index_key key;
+
+  if (audiotap->audio2tap_functions->get_index_key == NULL
+   || !audiotap->audio2tap_functions->get_index_key(audiotap, &key))
+    return 0;
+  put_le64(buf, key.size);
+  put_le64(buf + 8, (uint64_t)key.mtime);
+  put_le64(buf + 16, key.mode);
+  put_le64(buf + 24, audiotap->clock);
+  return 1;
+}
+
+enum audiotap_status audio2tap_save_index(struct audiotap *audiotap, const char *filename){
+  uint8_t key[INDEX_KEY_SIZE], record[INDEX_RECORD_SIZE];
+  enum audiotap_status ret = AUDIOTAP_WRONG_ARGUMENTS;
+  FILE *file;
+  size_t i;
+
+  if (!get_index_key(audiotap, key))
+    return ret;
+  if ((file = fopen(filename, "wb")) == NULL)
+    return AUDIOTAP_NO_FILE;
+  do{
+    ret = AUDIOTAP_ERR;
+    if (fwrite(index_file_header, sizeof(index_file_header) - 1, 1, file) != 1
+     || fwrite(key, sizeof(key), 1, file) != 1)
+      break;
+    for (i = 0; i < audiotap->num_checkpoints; i++){
+      put_le64(record, (uint64_t)audiotap->checkpoints[i].offset);
+      put_le64(record + 8, audiotap->checkpoints[i].cycles);
+      put_le64(record + 16, audiotap->checkpoints[i].pulse_number);
+      put_le64(record + 24, audiotap->checkpoints[i].remainder);
+      if (fwrite(record, sizeof(record), 1, file) != 1)
+        break;
+    }
+    if (i < audiotap->num_checkpoints)
+      break;
+    ret = AUDIOTAP_OK;
+  }while(0);
+  if (fclose(file) != 0 && ret == AUDIOTAP_OK)
+    ret = AUDIOTAP_ERR;
+  if (ret != AUDIOTAP_OK)
+    remove(filename);
+  return ret;
+}
 
-  if (status.portaudio_init_status != LIBRARY_OK
-   || status.tapencoder_init_status != LIBRARY_OK)
-    return AUDIOTAP_LIBRARY_UNAVAILABLE;
-  if (Pa_OpenDefaultStream(&pastream, 1, 0, paInt32, freq, sizeof((*audiotap)->bufstart) / sizeof(int32_t), NULL, NULL) != paNoError)
-    return AUDIOTAP_LIBRARY_ERROR;
-  if (Pa_StartStream(pastream) != paNoError){
-    Pa_CloseStream(pastream);
-    return AUDIOTAP_LIBRARY_ERROR;
+/* The loaded index replaces the one built so far, unless that one is longer */
+enum audiotap_status audio2tap_load_index(struct audiotap *audiotap, const char *filename){
+  uint8_t header[sizeof(index_file_header) - 1], key[INDEX_KEY_SIZE], key_on_file[INDEX_KEY_SIZE], record[INDEX_RECORD_SIZE];
+  enum audiotap_status ret = AUDIOTAP_WRONG_ARGUMENTS;
+  struct checkpoint *checkpoints = NULL;
+  size_t num_checkpoints = 0, max_checkpoints = 0;
+  FILE *file;
+
+  if (!get_index_key(audiotap, key))
+    return ret;
+  if ((file = fopen(filename, "rb")) == NULL)
+    return AUDIOTAP_NO_FILE;
+  do{
+    ret = AUDIOTAP_WRONG_FILETYPE;
+    if (fread(header, sizeof(header), 1, file) != 1
+     || memcmp(header, index_file_header, sizeof(header))
+     || fread(key_on_file, sizeof(key_on_file), 1, file) != 1
+     || memcmp(key, key_on_file, sizeof(key)))
+      break;
+    while (fread(record, sizeof(record), 1, file) == 1){
+      struct checkpoint checkpoint;
+
+      checkpoint.offset = (int64_t)get_le64(record);
+      checkpoint.cycles = get_le64(record + 8);
+      checkpoint.pulse_number = get_le64(record + 16);
+      checkpoint.remainder = (uint32_t)get_le64(record + 24);
+      if (num_checkpoints > 0
+       && checkpoint.pulse_number <= checkpoints[num_checkpoints - 1].pulse_number)
+        break;
+      if (num_checkpoints == max_checkpoints){
+        struct checkpoint *new_checkpoints;
+
+        max_checkpoints = max_checkpoints ? 2 * max_checkpoints : 64;
+        new_checkpoints = (struct checkpoint *)realloc(checkpoints, max_checkpoints * sizeof(struct checkpoint));
+        if (new_checkpoints == NULL){
+          ret = AUDIOTAP_NO_MEMORY;
+          break;
+        }
+        checkpoints = new_checkpoints;
+      }
+      checkpoints[num_checkpoints++] = checkpoint;
+    }
+    if (!feof(file)){
+      if (ferror(file))
+        ret = AUDIOTAP_ERR;
+      break;
+    }
+    ret = AUDIOTAP_OK;
+  }while(0);
+  fclose(file);
+  if (ret == AUDIOTAP_OK && num_checkpoints > audiotap->num_checkpoints){
+    free(audiotap->checkpoints);
+    audiotap->checkpoints = checkpoints;
+    audiotap->num_checkpoints = num_checkpoints;
+    audiotap->max_checkpoints = max_checkpoints;
   }
-  return audio2tap_audio_open_common(audiotap,
-                                     freq,
-                                     params,
-                                     machine,
-                                     videotype,
-                                     &portaudio_read_functions,
-                                     pastream);
+  else
+    free(checkpoints);
+  return ret;
 }
 
-enum audiotap_status audio2tap_get_pulses(struct audiotap *audiotap, uint32_t *pulse, uint32_t *raw_pulse){
-  return audiotap->audio2tap_functions->get_pulse(audiotap, pulse, raw_pulse);
+int audio2tap_get_total_len(struct audiotap *audiotap){
+  return (int)audiotap->audio2tap_functions->get_total_len(audiotap);
 }
 
-int audio2tap_get_total_len(struct audiotap *audiotap){
+int audio2tap_get_current_pos(struct audiotap *audiotap){
+  return (int)audiotap->audio2tap_functions->get_current_pos(audiotap);
+}
+
+int64_t audio2tap_get_total_len2(struct audiotap *audiotap){
   return audiotap->audio2tap_functions->get_total_len(audiotap);
 }
 
-int audio2tap_get_current_pos(struct audiotap *audiotap){
+int64_t audio2tap_get_current_pos2(struct audiotap *audiotap){
   return audiotap->audio2tap_functions->get_current_pos(audiotap);
 }
 
 int audio2tap_is_eof(struct audiotap *audiotap){
-  return audiotap->terminated == 1 || audiotap->audio2tap_functions->is_eof(audiotap);
+  return ATOMIC_LOAD(audiotap->terminated) == 1 || audiotap->audio2tap_functions->is_eof(audiotap);
 }
 
 int32_t audio2tap_get_current_sound_level(struct audiotap *audiotap){
   if (!audiotap->tapenc)
     return -1;
-  return tapenc_get_max(audiotap->tapenc);
+  return audiotap->tapenc_functions->get_max(audiotap->tapenc);
 }
 
+/* Inverting and switching halfwaves change the pulses read from then on,
+   so the checkpoints taken so far no longer apply */
+
 void audio2tap_invert(struct audiotap *audiotap)
 {
   audiotap->audio2tap_functions->invert(audiotap);
+  clear_checkpoints(audiotap);
 }
 
 int audio2tap_seek_to_beginning(struct audiotap *audiotap)
 {
+  audiotap->pulse_number = 0;
+  audiotap->cycles = 0;
+  audiotap->remainder = 0;
+  audiotap->position_known = 1;
   return audiotap->audio2tap_functions->seek_to_beginning(audiotap);
 }
 
 void audio2tap_enable_disable_halfwaves(struct audiotap *audiotap, int halfwaves)
 {
   audiotap->audio2tap_functions->enable_disable_halfwaves(audiotap, halfwaves);
+  clear_checkpoints(audiotap);
 }
 
 void audiotap_terminate(struct audiotap *audiotap){
-  audiotap->terminated = 1;
+  ATOMIC_STORE(audiotap->terminated, 1);
+  /* a paused writer must notice too */
+  if (audiotap->wait_event != NULL)
+    resume_from_pause(audiotap->wait_event);
 }
 
 int audiotap_is_terminated(struct audiotap *audiotap){
-  return audiotap->terminated;
+  return ATOMIC_LOAD(audiotap->terminated);
+}
+
+/* When reading, the samples not yet processed are kept, so the buffer never
+   gets smaller than them */
+enum audiotap_status audiotap_set_buffer_size(struct audiotap *audiotap, uint32_t frames){
+  uint8_t *bufstart;
+
+  if (audiotap->bufstart == NULL || frames == 0 || frames > 0x10000000)
+    return AUDIOTAP_WRONG_ARGUMENTS;
+  if (frames < audiotap->bufroom)
+    frames = audiotap->bufroom;
+  bufstart = (uint8_t *)malloc(frames * sizeof(int32_t));
+  if (bufstart == NULL)
+    return AUDIOTAP_NO_MEMORY;
+  memcpy(bufstart, audiotap->buffer, audiotap->bufroom * sizeof(int32_t));
+  free(audiotap->bufstart);
+  audiotap->bufstart = audiotap->buffer = bufstart;
+  audiotap->bufsize = frames;
+  return AUDIOTAP_OK;
+}
+
+uint64_t audiotap_get_cycles(struct audiotap *audiotap){
+  return audiotap->cycles;
+}
+
+void audiotap_get_stats(struct audiotap *audiotap, struct audiotap_stats *stats){
+  *stats = audiotap->stats;
+}
+
+enum audiotap_status audiotap_set_trace(struct audiotap *audiotap, audiotap_trace_callback callback, void *context){
+#ifdef AUDIOTAP_TRACE
+  audiotap->trace = callback;
+  audiotap->trace_context = context;
+  audiotap->trace_pulses = 0;
+  return AUDIOTAP_OK;
+#else
+  return AUDIOTAP_LIBRARY_UNAVAILABLE;
+#endif
 }
 
 void audio2tap_close(struct audiotap *audiotap){
   if (audiotap){
     audiotap->audio2tap_functions->close(audiotap->priv);
-    if (status.tapencoder_init_status == LIBRARY_OK)
-      tapenc_exit(audiotap->tapenc);
+    if (audiotap->tapenc != NULL)
+      audiotap->tapenc_functions->exit(audiotap->tapenc);
+    free(audiotap->checkpoints);
+    free(audiotap->bufstart);
+    free(audiotap->detected_pulses);
+    free(audiotap->file_name);
   }
   free(audiotap);
 }
@@ -864,10 +2793,11 @@ static void tapfile_set_pulse(struct audiotap *audiotap, uint32_t pulse){
 
 static uint32_t tapfile_get_buffer(struct audiotap *audiotap){
   struct tap_write_handle *handle = (struct tap_write_handle *)audiotap->priv;
-  uint8_t *buffer = audiotap->bufstart;
-  uint32_t bufroom = sizeof(audiotap->bufstart);
+  uint8_t *buffer = handle->outbuf + handle->outused;
+  uint32_t bufroom = WRITE_BLOCK_SIZE - handle->outused;
   uint8_t not_enough_bufroom = 0;
 
+  audiotap->buffer = buffer;
   if(handle->version > 0){
     while(handle->next_pulse >= 0xFFFFFF){
       if(bufroom < 4){
@@ -883,6 +2813,7 @@ static uint32_t tapfile_get_buffer(struct audiotap *audiotap){
       *buffer++ = 0xFF;
       bufroom--;
       handle->next_pulse -= 0xFFFFFF;
+      audiotap->stats.overflow_continuations++;
       if (handle->next_pulse == 0)
         handle->exhausted = 1;
     }
@@ -918,38 +2849,66 @@ static uint32_t tapfile_get_buffer(struct audiotap *audiotap){
     handle->next_pulse = handle->second_halfwave;
     handle->second_halfwave = 0;
   }
-  return sizeof(audiotap->bufstart) - bufroom;
+  return WRITE_BLOCK_SIZE - handle->outused - bufroom;
 }
 
-static enum audiotap_status tapfile_dump_buffer(uint8_t *buffer, uint32_t bufsize, void *priv){
-  return fwrite(buffer, bufsize, 1, ((struct tap_write_handle *)priv)->file) == 1
-   ? AUDIOTAP_OK
-   : AUDIOTAP_LIBRARY_ERROR;
+/* stats is NULL when closing */
+static enum audiotap_status tapfile_flush(struct tap_write_handle *handle, struct audiotap_stats *stats){
+  uint32_t outused = handle->outused;
+  uint64_t start;
+  size_t written;
+
+  handle->outused = 0;
+  if (outused == 0)
+    return AUDIOTAP_OK;
+  handle->written += outused;
+  start = get_time_ns();
+  written = fwrite(handle->outbuf, outused, 1, handle->file);
+  if (stats != NULL){
+    stats->io_ns += get_time_ns() - start;
+    stats->bytes_written += outused;
+    stats->flushes++;
+  }
+  return written == 1 ? AUDIOTAP_OK : AUDIOTAP_LIBRARY_ERROR;
+}
+
+/* The data is already in the output buffer: it is only written to the file
+   when there may not be room for a long pulse (4 bytes) any more */
+static enum audiotap_status tapfile_dump_buffer(struct audiotap *audiotap, uint8_t *buffer, uint32_t bufsize){
+  struct tap_write_handle *handle = (struct tap_write_handle *)audiotap->priv;
+
+  handle->outused += bufsize;
+  if (WRITE_BLOCK_SIZE - handle->outused < 4)
+    return tapfile_flush(handle, &audiotap->stats);
+  return AUDIOTAP_OK;
 }
 
-static void tapfile_write_close(void *file){
+static enum audiotap_status tapfile_write_close(void *file){
   struct tap_write_handle *handle = (struct tap_write_handle *)file;
-  long size;
+  enum audiotap_status ret = AUDIOTAP_LIBRARY_ERROR;
+  uint32_t size;
   unsigned char size_header[4];
 
   do{
-    if ((fseek(handle->file, 0, SEEK_END)) != 0)
-      break;
-    if ((size = ftell(handle->file)) == -1)
-      break;
-    size -= 20;
-    if (size < 0)
+    /* if the data is not all there, the size would be wrong */
+    if (tapfile_flush(handle, NULL) != AUDIOTAP_OK)
       break;
+    /* The header has room for 32 bits only */
+    size = handle->written > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t)handle->written;
     size_header[0] = (unsigned char) (size & 0xFF);
     size_header[1] = (unsigned char) ((size >> 8) & 0xFF);
     size_header[2] = (unsigned char) ((size >> 16) & 0xFF);
     size_header[3] = (unsigned char) ((size >> 24) & 0xFF);
-    if ((fseek(handle->file, 16, SEEK_SET)) != 0)
+    if (fseek(handle->file, 16, SEEK_SET) != 0
+     || fwrite(size_header, 4, 1, handle->file) != 1)
       break;
-    fwrite(size_header, 4, 1, handle->file);
+    ret = AUDIOTAP_OK;
   }while(0);
-  fclose(handle->file);
+  if (fclose(handle->file) != 0)
+    ret = AUDIOTAP_LIBRARY_ERROR;
+  free(handle->outbuf);
   free(handle);
+  return ret;
 }
 
 static void tapfile_enable_halfwaves(struct audiotap *audiotap, uint8_t halfwaves){
@@ -959,6 +2918,24 @@ static void tapfile_enable_halfwaves(struct audiotap *audiotap, uint8_t halfwave
     handle->split_into_halfwaves = !halfwaves;
 }
 
+static enum audiotap_status tapfile_set_pulses(struct audiotap *audiotap, const uint32_t *pulses, size_t n){
+  struct tap_write_handle *handle = (struct tap_write_handle *)audiotap->priv;
+  size_t i;
+
+  for (i = 0; i < n; i++){
+    uint32_t numbytes;
+
+    tapfile_set_pulse(audiotap, pulses[i]);
+    while ((numbytes = tapfile_get_buffer(audiotap)) > 0){
+      handle->outused += numbytes;
+      if (WRITE_BLOCK_SIZE - handle->outused < 4
+       && tapfile_flush(handle, &audiotap->stats) != AUDIOTAP_OK)
+        return AUDIOTAP_LIBRARY_ERROR;
+    }
+  }
+  return AUDIOTAP_OK;
+}
+
 static void tap2audio_file_pause(void *priv){}
 static void tap2audio_file_resume(void *priv){}
 
@@ -966,40 +2943,269 @@ static const struct tap2audio_functions tapfile_write_functions = {
   tapfile_set_pulse,
   tapfile_get_buffer,
   tapfile_dump_buffer,
+  tapfile_set_pulses,
   tapfile_enable_halfwaves,
   tap2audio_file_pause,
   tap2audio_file_resume,
   tapfile_write_close,
 };
 
+static struct tap_dec_t *external_tapdec_init2(uint32_t volume, uint8_t inverted, enum tapdec_waveform waveform){
+  return tapdec_init2(volume, inverted, waveform);
+}
+
+static void external_tapdec_set_pulse(struct tap_dec_t *tap, uint32_t pulse){
+  tapdec_set_pulse(tap, pulse);
+}
+
+static uint32_t external_tapdec_get_buffer(struct tap_dec_t *tap, int32_t *buffer, unsigned int buflen){
+  return tapdec_get_buffer(tap, buffer, buflen);
+}
+
+static void external_tapdec_enable_halfwaves(struct tap_dec_t *tap, uint8_t halfwaves){
+  tapdec_enable_halfwaves(tap, halfwaves);
+}
+
+static void external_tapdec_exit(struct tap_dec_t *tap){
+  tapdec_exit(tap);
+}
+
+static const struct tapdec_functions external_tapdec_functions = {
+  external_tapdec_init2,
+  external_tapdec_set_pulse,
+  external_tapdec_get_buffer,
+  external_tapdec_enable_halfwaves,
+  external_tapdec_exit
+};
+
+static const struct tapdec_functions builtin_tapdec_functions = {
+  builtin_tapdec_init2,
+  builtin_tapdec_set_pulse,
+  builtin_tapdec_get_buffer,
+  builtin_tapdec_enable_halfwaves,
+  builtin_tapdec_exit
+};
+
+static enum audiotap_engine synthesizer = AUDIOTAP_ENGINE_AUTO;
+
+void audiotap_set_synthesizer(enum audiotap_engine engine){
+  synthesizer = engine;
+}
+
+/* NULL if the chosen decoder is not available */
+static const struct tapdec_functions *get_tapdec_functions(void){
+  if (synthesizer != AUDIOTAP_ENGINE_BUILTIN
+   && status.tapdecoder_init_status == LIBRARY_OK)
+    return &external_tapdec_functions;
+  if (synthesizer != AUDIOTAP_ENGINE_EXTERNAL)
+    return &builtin_tapdec_functions;
+  return NULL;
+}
+
 static void audio_set_pulse(struct audiotap *audiotap, uint32_t pulse){
-  tapdec_set_pulse(audiotap->tapdec, (uint32_t)(pulse / audiotap->factor));
+  audiotap->tapdec_functions->set_pulse(audiotap->tapdec, cycles_to_samples(audiotap, pulse));
+  TRACE_PULSE(audiotap);
 }
 
 static uint32_t audio_get_buffer(struct audiotap *audiotap){
-  return tapdec_get_buffer(audiotap->tapdec, (int32_t*)audiotap->bufstart, (uint32_t)(sizeof(audiotap->bufstart) / sizeof(uint32_t)) );
+  uint64_t trace_start = TRACE_START(audiotap);
+  uint32_t numframes;
+
+  audiotap->buffer = audiotap->bufstart;
+  numframes = audiotap->tapdec_functions->get_buffer(audiotap->tapdec, (int32_t*)audiotap->bufstart, audiotap->bufsize);
+  if (numframes > 0)
+    TRACE_SYNTHESIZE(audiotap, trace_start, numframes);
+  return numframes;
+}
+
+static void wait_while_paused(struct audiotap *audiotap){
+  uint64_t trace_start = TRACE_START(audiotap);
+
+  if (pause_if_necessary(audiotap->wait_event))
+    TRACE(audiotap, AUDIOTAP_TRACE_PAUSE, trace_start, 0, 0);
+}
+
+/* For audio outputs, the time spent here (including pauses) is I/O */
+static enum audiotap_status audio_dump_buffer(struct audiotap *audiotap, uint32_t numframes){
+  uint64_t start = get_time_ns(), trace_start;
+  enum audiotap_status error;
+
+  wait_while_paused(audiotap);
+  if (ATOMIC_LOAD(audiotap->terminated))
+    error = AUDIOTAP_INTERRUPTED;
+  else{
+    trace_start = TRACE_START(audiotap);
+    error = audiotap->tap2audio_functions->dump_buffer(audiotap, audiotap->bufstart, numframes);
+    TRACE(audiotap, AUDIOTAP_TRACE_DUMP_BUFFER, trace_start, numframes, 0);
+  }
+  audiotap->stats.io_ns += get_time_ns() - start;
+  return error;
+}
+
+/* Fills the whole buffer from as many pulses as needed before dumping it */
+static enum audiotap_status audio_set_pulses(struct audiotap *audiotap, const uint32_t *pulses, size_t n){
+  int32_t *buffer = (int32_t*)audiotap->bufstart;
+  const uint32_t bufsize = audiotap->bufsize;
+  const struct tapdec_functions *tapdec_functions = audiotap->tapdec_functions;
+  uint32_t filled = 0;
+  enum audiotap_status error = AUDIOTAP_OK;
+  size_t i;
+
+  for (i = 0; i < n && error == AUDIOTAP_OK; i++){
+    uint32_t numframes;
+    uint64_t trace_start;
+
+    audio_set_pulse(audiotap, pulses[i]);
+    while (error == AUDIOTAP_OK){
+      trace_start = TRACE_START(audiotap);
+      if ((numframes = tapdec_functions->get_buffer(audiotap->tapdec, buffer + filled, bufsize - filled)) == 0)
+        break;
+      TRACE_SYNTHESIZE(audiotap, trace_start, numframes);
+      filled += numframes;
+      if (filled == bufsize){
+        error = audio_dump_buffer(audiotap, filled);
+        filled = 0;
+      }
+    }
+  }
+  if (error == AUDIOTAP_OK && filled > 0)
+    error = audio_dump_buffer(audiotap, filled);
+  return error;
 }
 
 static void audio_enable_halfwaves(struct audiotap *audiotap, uint8_t halfwaves){
-  tapdec_enable_halfwaves(audiotap->tapdec, halfwaves);
+  audiotap->tapdec_functions->enable_halfwaves(audiotap->tapdec, halfwaves);
+}
+
+/* Size of the buffer where WAV writers collect samples before writing them */
+#define WAV_WRITE_BLOCK_SIZE 262144
+
+#define WAV_HEADER_SIZE 44
+
+struct wav_write_handle {
+  FILE *file;
+  uint8_t *outbuf;
+  uint32_t outused;
+  uint64_t written;    /* bytes of samples written to the file so far */
+  uint32_t sample_size;
+  pcm_packer pack;
+};
+
+/* stats is NULL when closing */
+static enum audiotap_status wavfile_flush(struct wav_write_handle *handle, struct audiotap_stats *stats){
+  uint32_t outused = handle->outused;
+
+  handle->outused = 0;
+  if (outused == 0)
+    return AUDIOTAP_OK;
+  handle->written += outused;
+  if (stats != NULL){
+    stats->bytes_written += outused;
+    stats->flushes++;
+  }
+  return fwrite(handle->outbuf, outused, 1, handle->file) == 1
+   ? AUDIOTAP_OK
+   : AUDIOTAP_LIBRARY_ERROR;
+}
+
+static enum audiotap_status wavfile_dump_buffer(struct audiotap *audiotap, uint8_t *buffer, uint32_t bufsize){
+  struct wav_write_handle *handle = (struct wav_write_handle *)audiotap->priv;
+
+  while (bufsize > 0){
+    uint32_t room = (WAV_WRITE_BLOCK_SIZE - handle->outused) / handle->sample_size;
+    uint32_t n = bufsize < room ? bufsize : room;
+
+    if (n == 0){
+      if (wavfile_flush(handle, &audiotap->stats) != AUDIOTAP_OK)
+        return AUDIOTAP_LIBRARY_ERROR;
+      continue;
+    }
+    handle->pack((const int32_t *)buffer, handle->outbuf + handle->outused, n);
+    handle->outused += n * handle->sample_size;
+    buffer += n * sizeof(int32_t);
+    bufsize -= n;
+  }
+  return AUDIOTAP_OK;
+}
+
+static void put_le16(uint8_t *buf, uint32_t value){
+  buf[0] = (uint8_t)value;
+  buf[1] = (uint8_t)(value >> 8);
+}
+
+static void put_le32(uint8_t *buf, uint32_t value){
+  put_le16(buf, value);
+  put_le16(buf + 2, value >> 16);
+}
+
+/* Sizes are not known until the end: if the file cannot be rewound to
+   write them (e.g. it is a pipe), they stay as big as possible */
+static void wavfile_put_header(uint8_t *header, uint32_t freq, uint32_t sample_size, uint64_t data_size){
+  uint32_t size = data_size > 0xFFFFFFFF - WAV_HEADER_SIZE ? 0xFFFFFFFF - WAV_HEADER_SIZE : (uint32_t)data_size;
+
+  memcpy(header, "RIFF", 4);
+  put_le32(header + 4, size + (size & 1) + WAV_HEADER_SIZE - 8);
+  memcpy(header + 8, "WAVEfmt ", 8);
+  put_le32(header + 16, 16);
+  put_le16(header + 20, WAVE_FORMAT_PCM);
+  put_le16(header + 22, 1);
+  put_le32(header + 24, freq);
+  put_le32(header + 28, freq * sample_size);
+  put_le16(header + 32, sample_size);
+  put_le16(header + 34, 8 * sample_size);
+  memcpy(header + 36, "data", 4);
+  put_le32(header + 40, size);
 }
 
-static enum audiotap_status audiofile_dump_buffer(uint8_t *buffer, uint32_t bufsize, void *priv){
-  return (afWriteFrames((AFfilehandle)priv, AF_DEFAULT_TRACK, buffer, (int)bufsize) == (int)bufsize) ? AUDIOTAP_OK : AUDIOTAP_LIBRARY_ERROR;
+static enum audiotap_status wavfile_write_close(void *priv){
+  struct wav_write_handle *handle = (struct wav_write_handle *)priv;
+  enum audiotap_status ret = AUDIOTAP_LIBRARY_ERROR;
+  uint8_t header[WAV_HEADER_SIZE];
+
+  do{
+    /* if the data is not all there, the sizes would be wrong */
+    if (wavfile_flush(handle, NULL) != AUDIOTAP_OK)
+      break;
+    /* the data chunk must have an even size */
+    if ((handle->written & 1) && fputc(0, handle->file) == EOF)
+      break;
+    wavfile_put_header(header, 0, handle->sample_size, handle->written);
+    /* a pipe cannot be rewound: the sizes stay as big as possible. Flushing
+       first tells that apart from data which could not be written */
+    if (fflush(handle->file) != 0)
+      break;
+    if (fseeko(handle->file, 4, SEEK_SET) != 0){
+      ret = AUDIOTAP_OK;
+      break;
+    }
+    if (fwrite(header + 4, 4, 1, handle->file) != 1
+     || fseeko(handle->file, 40, SEEK_SET) != 0
+     || fwrite(header + 40, 4, 1, handle->file) != 1)
+      break;
+    ret = AUDIOTAP_OK;
+  }while(0);
+  if (handle->file == stdout ? fflush(stdout) != 0 : fclose(handle->file) != 0)
+    ret = AUDIOTAP_LIBRARY_ERROR;
+  free(handle->outbuf);
+  free(handle);
+  return ret;
 }
 
-static const struct tap2audio_functions audiofile_write_functions = {
+static const struct tap2audio_functions wavfile_write_functions = {
   audio_set_pulse,
   audio_get_buffer,
-  audiofile_dump_buffer,
+  wavfile_dump_buffer,
+  audio_set_pulses,
   audio_enable_halfwaves,
   tap2audio_file_pause,
   tap2audio_file_resume,
-  audiofile_close,
+  wavfile_write_close,
 };
 
-static enum audiotap_status portaudio_dump_buffer(uint8_t *buffer, uint32_t bufsize, void *priv){
-  return Pa_WriteStream((PaStream*)priv, buffer, bufsize) == paNoError ? AUDIOTAP_OK : AUDIOTAP_LIBRARY_ERROR;
+static enum audiotap_status portaudio_dump_buffer(struct audiotap *audiotap, uint8_t *buffer, uint32_t bufsize){
+  audiotap->stats.bytes_written += (uint64_t)bufsize * sizeof(int32_t);
+  audiotap->stats.flushes++;
+  return Pa_WriteStream((PaStream*)audiotap->priv, buffer, bufsize) == paNoError ? AUDIOTAP_OK : AUDIOTAP_LIBRARY_ERROR;
 }
 
 static void portaudio_pause(void *priv){
@@ -1010,14 +3216,124 @@ static void portaudio_resume(void *priv){
   Pa_StartStream((PaStream*)priv);
 }
 
+static enum audiotap_status portaudio_write_close(void *priv){
+  portaudio_close(priv);
+  return AUDIOTAP_OK;
+}
+
 static const struct tap2audio_functions portaudio_write_functions = {
   audio_set_pulse,
   audio_get_buffer,
   portaudio_dump_buffer,
+  audio_set_pulses,
   audio_enable_halfwaves,
   portaudio_pause,
   portaudio_resume,
-  portaudio_close,
+  portaudio_write_close,
+};
+
+/* Playback through a callback: the decoder puts samples in a ring, and
+   PortAudio's thread takes them from there. If they do not come in time,
+   silence is played */
+struct portaudio_playback {
+  PaStream *stream;
+  struct ring_buffer *ring;
+  long wait_ms; /* how long to sleep when the ring is full */
+  volatile int paused; /* set by the thread calling tap2audio_pause */
+  volatile int *terminated; /* the handle's */
+};
+
+/* How long closing waits for the ring to drain if no samples are played */
+#define PLAYBACK_STALL_MS 1000
+
+static int portaudio_playback_callback(const void *input, void *output,
+                                       unsigned long frames,
+                                       const PaStreamCallbackTimeInfo *time_info,
+                                       PaStreamCallbackFlags status_flags,
+                                       void *priv){
+  struct portaudio_playback *playback = (struct portaudio_playback *)priv;
+  uint32_t lost; /* only the decoder writes to the ring, and it waits for room */
+  uint32_t done = read_from_ring_buffer(playback->ring, (int32_t *)output, (uint32_t)frames, &lost);
+
+  memset((int32_t *)output + done, 0, (frames - done) * sizeof(int32_t));
+  return paContinue;
+}
+
+static enum audiotap_status portaudio_ring_dump_buffer(struct audiotap *audiotap, uint8_t *buffer, uint32_t bufsize){
+  struct portaudio_playback *playback = (struct portaudio_playback *)audiotap->priv;
+  const int32_t *samples = (const int32_t *)buffer;
+
+  audiotap->stats.bytes_written += (uint64_t)bufsize * sizeof(int32_t);
+  audiotap->stats.flushes++;
+  while (bufsize > 0){
+    uint32_t room = room_in_ring_buffer(playback->ring);
+
+    if (room == 0){
+      if (ATOMIC_LOAD(audiotap->terminated))
+        return AUDIOTAP_INTERRUPTED;
+      /* nothing makes room if the stream stopped by itself */
+      if (!ATOMIC_LOAD(playback->paused) && Pa_IsStreamActive(playback->stream) != 1)
+        return AUDIOTAP_LIBRARY_ERROR;
+      Pa_Sleep(playback->wait_ms);
+      continue;
+    }
+    if (room > bufsize)
+      room = bufsize;
+    write_to_ring_buffer(playback->ring, samples, room);
+    samples += room;
+    bufsize -= room;
+  }
+  return AUDIOTAP_OK;
+}
+
+static void portaudio_ring_pause(void *priv){
+  struct portaudio_playback *playback = (struct portaudio_playback *)priv;
+
+  ATOMIC_STORE(playback->paused, 1);
+  Pa_StopStream(playback->stream);
+}
+
+static void portaudio_ring_resume(void *priv){
+  struct portaudio_playback *playback = (struct portaudio_playback *)priv;
+
+  Pa_StartStream(playback->stream);
+  ATOMIC_STORE(playback->paused, 0);
+}
+
+/* Lets what is left in the ring play before closing, unless the handle was
+   paused or terminated, or the stream stopped or stalled */
+static enum audiotap_status portaudio_ring_write_close(void *priv){
+  struct portaudio_playback *playback = (struct portaudio_playback *)priv;
+  uint32_t left = samples_in_ring_buffer(playback->ring);
+  long stalled_ms = 0;
+
+  while (left > 0
+      && !ATOMIC_LOAD(playback->paused)
+      && !(playback->terminated != NULL && ATOMIC_LOAD(*playback->terminated))
+      && Pa_IsStreamActive(playback->stream) == 1
+      && stalled_ms < PLAYBACK_STALL_MS){
+    uint32_t now;
+
+    Pa_Sleep(playback->wait_ms);
+    now = samples_in_ring_buffer(playback->ring);
+    stalled_ms = now < left ? 0 : stalled_ms + playback->wait_ms;
+    left = now;
+  }
+  portaudio_close(playback->stream);
+  destroy_ring_buffer(playback->ring);
+  free(playback);
+  return AUDIOTAP_OK;
+}
+
+static const struct tap2audio_functions portaudio_ring_write_functions = {
+  audio_set_pulse,
+  audio_get_buffer,
+  portaudio_ring_dump_buffer,
+  audio_set_pulses,
+  audio_enable_halfwaves,
+  portaudio_ring_pause,
+  portaudio_ring_resume,
+  portaudio_ring_write_close,
 };
 
 static enum audiotap_status tap2audio_open_common(struct audiotap **audiotap
@@ -1033,31 +3349,46 @@ static enum audiotap_status tap2audio_open_common(struct audiotap **audiotap
     error = AUDIOTAP_NO_MEMORY;
     obj = (struct audiotap *)calloc(1, sizeof(struct audiotap));
     if (obj != NULL){
-      obj->factor = tap_clocks[machine][videotype] / freq;
+      obj->freq = freq;
+      obj->clock = tap_clocks[machine][videotype];
       obj->priv = priv;
       obj->tap2audio_functions = functions;
-      if (params == NULL)
-        error = AUDIOTAP_OK;
-      else{
-        enum tapdec_waveform waveform =
-          params->waveform == AUDIOTAP_WAVE_TRIANGLE ? TAPDEC_TRIANGLE :
-          params->waveform == AUDIOTAP_WAVE_SQUARE   ? TAPDEC_SQUARE   :
-                                                       TAPDEC_SINE;
-        if(
-           (obj->tapdec = tapdec_init2(params->volume,
-                                       params->inverted,
-                                       waveform))
-            != NULL
-          )
+      obj->wait_event = (struct wait_event *)malloc(size_of_wait_event());
+      if (obj->wait_event != NULL){
+        create_wait_event(obj->wait_event);
+        if (params == NULL)
           error = AUDIOTAP_OK;
+        else if ((obj->tapdec_functions = get_tapdec_functions()) == NULL)
+          error = AUDIOTAP_LIBRARY_UNAVAILABLE;
+        else{
+          enum tapdec_waveform waveform =
+            params->waveform == AUDIOTAP_WAVE_TRIANGLE ? TAPDEC_TRIANGLE :
+            params->waveform == AUDIOTAP_WAVE_SQUARE   ? TAPDEC_SQUARE   :
+                                                         TAPDEC_SINE;
+          if(
+             (obj->tapdec = obj->tapdec_functions->init2(params->volume,
+                                                         params->inverted,
+                                                         waveform))
+              != NULL
+            ){
+            obj->bufsize = DEFAULT_BUFFER_FRAMES;
+            obj->bufstart = (uint8_t *)malloc(obj->bufsize * sizeof(int32_t));
+            if (obj->bufstart != NULL)
+              error = AUDIOTAP_OK;
+            else
+              obj->tapdec_functions->exit(obj->tapdec);
+          }
+        }
+        if (error != AUDIOTAP_OK)
+          destroy_wait_event(obj->wait_event);
       }
-      obj->wait_event = malloc(size_of_wait_event());
-      create_wait_event(obj->wait_event);
     }
   }
 
   if (error != AUDIOTAP_OK) {
     functions->close(priv);
+    if (obj != NULL)
+      free(obj->wait_event);
     free(obj);
     obj = NULL;
   }
@@ -1071,25 +3402,81 @@ enum audiotap_status tap2audio_open_to_soundcard4(struct audiotap **audiotap
                                                  ,uint32_t freq
                                                  ,uint8_t machine
                                                  ,uint8_t videotype){
+  return tap2audio_open_to_soundcard5(audiotap
+                                     ,params
+                                     ,freq
+                                     ,machine
+                                     ,videotype
+                                     ,4 * DEFAULT_BUFFER_FRAMES /* as it always did */
+                                     ,0);
+}
+
+enum audiotap_status tap2audio_open_to_soundcard5(struct audiotap **audiotap
+                                                 ,struct tapdec_params *params
+                                                 ,uint32_t freq
+                                                 ,uint8_t machine
+                                                 ,uint8_t videotype
+                                                 ,uint32_t frames_per_buffer
+                                                 ,uint32_t ring_ms){
   PaStream *pastream;
+  struct portaudio_playback *playback;
+  enum audiotap_status ret;
 
   if (status.portaudio_init_status != LIBRARY_OK
-   || status.tapdecoder_init_status != LIBRARY_OK)
+   || get_tapdec_functions() == NULL)
     return AUDIOTAP_LIBRARY_UNAVAILABLE;
-  if (Pa_OpenDefaultStream(&pastream, 0, 1, paInt32, freq, sizeof(((struct audiotap*)NULL)->bufstart), NULL, NULL) != paNoError)
+  if (freq == 0)
+    return AUDIOTAP_WRONG_ARGUMENTS;
+  if (ring_ms == 0){
+    if (Pa_OpenDefaultStream(&pastream, 0, 1, paInt32, freq, frames_per_buffer, NULL, NULL) != paNoError)
+      return AUDIOTAP_LIBRARY_ERROR;
+    if (Pa_StartStream(pastream) != paNoError){
+      Pa_CloseStream(pastream);
+      return AUDIOTAP_LIBRARY_ERROR;
+    }
+
+    return tap2audio_open_common(audiotap
+                                ,params
+                                ,freq
+                                ,machine
+                                ,videotype
+                                ,&portaudio_write_functions
+                                ,pastream);
+  }
+
+  playback = (struct portaudio_playback *)calloc(1, sizeof(struct portaudio_playback));
+  if (playback == NULL)
+    return AUDIOTAP_NO_MEMORY;
+  playback->ring = create_ring_buffer((uint32_t)((uint64_t)freq * ring_ms / 1000));
+  if (playback->ring == NULL){
+    free(playback);
+    return AUDIOTAP_NO_MEMORY;
+  }
+  playback->wait_ms = frames_per_buffer ? (long)((uint64_t)frames_per_buffer * 500 / freq) : 5;
+  if (playback->wait_ms == 0)
+    playback->wait_ms = 1;
+  if (Pa_OpenDefaultStream(&playback->stream, 0, 1, paInt32, freq, frames_per_buffer, portaudio_playback_callback, playback) != paNoError){
+    destroy_ring_buffer(playback->ring);
+    free(playback);
     return AUDIOTAP_LIBRARY_ERROR;
-  if (Pa_StartStream(pastream) != paNoError){
-    Pa_CloseStream(pastream);
+  }
+  if (Pa_StartStream(playback->stream) != paNoError){
+    Pa_CloseStream(playback->stream);
+    destroy_ring_buffer(playback->ring);
+    free(playback);
     return AUDIOTAP_LIBRARY_ERROR;
   }
 
-  return tap2audio_open_common(audiotap
-                              ,params
-                              ,freq
-                              ,machine
-                              ,videotype
-                              ,&portaudio_write_functions
-                              ,pastream);
+  ret = tap2audio_open_common(audiotap
+                             ,params
+                             ,freq
+                             ,machine
+                             ,videotype
+                             ,&portaudio_ring_write_functions
+                             ,playback);
+  if (ret == AUDIOTAP_OK)
+    playback->terminated = &(*audiotap)->terminated;
+  return ret;
 }
 
 enum audiotap_status tap2audio_open_to_wavfile4(struct audiotap **audiotap
@@ -1098,39 +3485,66 @@ enum audiotap_status tap2audio_open_to_wavfile4(struct audiotap **audiotap
                                                ,uint32_t freq
                                                ,uint8_t machine
                                                ,uint8_t videotype){
-  AFfilehandle fh;
-  AFfilesetup setup;
+  return tap2audio_open_to_wavfile5(audiotap
+                                   ,file
+                                   ,params
+                                   ,freq
+                                   ,machine
+                                   ,videotype
+                                   ,8);
+}
 
-  if (status.audiofile_init_status != LIBRARY_OK
-   || status.tapdecoder_init_status != LIBRARY_OK)
+enum audiotap_status tap2audio_open_to_wavfile5(struct audiotap **audiotap
+                                               ,const char *file
+                                               ,struct tapdec_params *params
+                                               ,uint32_t freq
+                                               ,uint8_t machine
+                                               ,uint8_t videotype
+                                               ,uint8_t bits){
+  struct wav_write_handle *handle;
+  uint8_t header[WAV_HEADER_SIZE];
+  pcm_packer pack = get_pcm_packer(bits);
+
+  if (get_tapdec_functions() == NULL)
     return AUDIOTAP_LIBRARY_UNAVAILABLE;
-  setup=afNewFileSetup();
-  if (setup == AF_NULL_FILESETUP)
+  if (pack == NULL || freq == 0 || params == NULL)
+    return AUDIOTAP_WRONG_ARGUMENTS;
+  if((handle = (struct wav_write_handle *)calloc(1, sizeof(struct wav_write_handle))) == NULL)
     return AUDIOTAP_NO_MEMORY;
-  afInitRate(setup, AF_DEFAULT_TRACK, freq);
-  afInitChannels(setup, AF_DEFAULT_TRACK, 1);
-  afInitFileFormat(setup, AF_FILE_WAVE);
-  afInitSampleFormat(setup, AF_DEFAULT_TRACK, AF_SAMPFMT_UNSIGNED, 8);
-  if (file)
-    fh=afOpenFile(file,"w", setup);
-  else
-    fh=afOpenFD(STDOUT_FILENO,"w", setup);
-  afFreeFileSetup(setup);
-  if (fh == AF_NULL_FILEHANDLE)
-    return AUDIOTAP_LIBRARY_ERROR;
-  if (afSetVirtualSampleFormat(fh, AF_DEFAULT_TRACK, AF_SAMPFMT_TWOSCOMP, 32) == -1
-   || afGetVirtualFrameSize(fh, AF_DEFAULT_TRACK, 0) != 4){
-    afCloseFile(fh);
-    return AUDIOTAP_LIBRARY_ERROR;
+  if((handle->outbuf = (uint8_t *)malloc(WAV_WRITE_BLOCK_SIZE)) == NULL){
+    free(handle);
+    return AUDIOTAP_NO_MEMORY;
+  }
+  handle->sample_size = bits / 8;
+  handle->pack = pack;
+
+  if (file){
+    handle->file = fopen(file, "wb");
+    if (handle->file == NULL){
+      free(handle->outbuf);
+      free(handle);
+      return AUDIOTAP_NO_FILE;
+    }
+  }
+  else{
+#ifdef _WIN32
+    _setmode(STDOUT_FILENO, _O_BINARY);
+#endif
+    handle->file = stdout;
   }
 
+  wavfile_put_header(header, freq, handle->sample_size, UINT64_MAX);
+  if (fwrite(header, sizeof(header), 1, handle->file) != 1){
+    wavfile_write_close(handle);
+    return AUDIOTAP_LIBRARY_ERROR;
+  }
   return tap2audio_open_common(audiotap
                               ,params
                               ,freq
                               ,machine
                               ,videotype
-                              ,&audiofile_write_functions
-                              ,fh);
+                              ,&wavfile_write_functions
+                              ,handle);
 }
 
 enum audiotap_status tap2audio_open_to_tapfile3(struct audiotap **audiotap
@@ -1146,9 +3560,16 @@ enum audiotap_status tap2audio_open_to_tapfile3(struct audiotap **audiotap
     return AUDIOTAP_WRONG_ARGUMENTS;
   if((handle = (struct tap_write_handle *)malloc(sizeof(struct tap_write_handle))) == NULL)
     return AUDIOTAP_NO_MEMORY;
+  if((handle->outbuf = (uint8_t *)malloc(WRITE_BLOCK_SIZE)) == NULL){
+    free(handle);
+    return AUDIOTAP_NO_MEMORY;
+  }
+  handle->outused = 0;
+  handle->written = 0;
 
   handle->file = fopen(name, "wb");
   if (handle->file == NULL) {
+    free(handle->outbuf);
     free(handle);
     return AUDIOTAP_NO_FILE;
   }
@@ -1172,6 +3593,7 @@ enum audiotap_status tap2audio_open_to_tapfile3(struct audiotap **audiotap
 
   if(error != AUDIOTAP_OK){
     fclose(handle->file);
+    free(handle->outbuf);
     free(handle);
     return error;
   }
@@ -1187,15 +3609,50 @@ enum audiotap_status tap2audio_open_to_tapfile3(struct audiotap **audiotap
 enum audiotap_status tap2audio_set_pulse(struct audiotap *audiotap, uint32_t pulse){
   uint32_t numframes;
   enum audiotap_status error = AUDIOTAP_OK;
+  /* only audio outputs have a decoder to time */
+  const uint64_t weight = audiotap->tapdec != NULL ? timing_weight(audiotap, 1) : 0;
+  uint64_t start = weight ? get_time_ns() : 0, io_ns = audiotap->stats.io_ns;
 
   audiotap->tap2audio_functions->set_pulse(audiotap, pulse);
+  audiotap->cycles += pulse;
+  audiotap->stats.pulses_written++;
 
   while(error == AUDIOTAP_OK && (numframes = audiotap->tap2audio_functions->get_buffer(audiotap)) > 0){
-    pause_if_necessary(audiotap->wait_event);
-    error = audiotap->terminated ? AUDIOTAP_INTERRUPTED :
-    audiotap->tap2audio_functions->dump_buffer(audiotap->bufstart, numframes, audiotap->priv);
+    uint64_t dump_start = audiotap->tapdec != NULL ? get_time_ns() : 0, trace_start;
+
+    wait_while_paused(audiotap);
+    trace_start = TRACE_START(audiotap);
+    error = ATOMIC_LOAD(audiotap->terminated) ? AUDIOTAP_INTERRUPTED :
+    audiotap->tap2audio_functions->dump_buffer(audiotap, audiotap->buffer, numframes);
+    TRACE(audiotap, AUDIOTAP_TRACE_DUMP_BUFFER, trace_start, numframes, 0);
+    if (audiotap->tapdec != NULL)
+      audiotap->stats.io_ns += get_time_ns() - dump_start;
   }
 
+  if (weight)
+    audiotap->stats.decoder_ns += (get_time_ns() - start - (audiotap->stats.io_ns - io_ns)) * weight;
+  return error;
+}
+
+enum audiotap_status tap2audio_set_pulses(struct audiotap *audiotap, const uint32_t *pulses, size_t n){
+  uint64_t cycles = 0, start, io_ns;
+  enum audiotap_status error;
+  size_t i;
+
+  wait_while_paused(audiotap);
+  if (ATOMIC_LOAD(audiotap->terminated))
+    return AUDIOTAP_INTERRUPTED;
+  for (i = 0; i < n; i++)
+    cycles += pulses[i];
+  audiotap->cycles += cycles;
+  audiotap->stats.pulses_written += n;
+  if (audiotap->tapdec == NULL)
+    return audiotap->tap2audio_functions->set_pulses(audiotap, pulses, n);
+  /* the time spent here, except dumping buffers, is the decoder's */
+  start = get_time_ns();
+  io_ns = audiotap->stats.io_ns;
+  error = audiotap->tap2audio_functions->set_pulses(audiotap, pulses, n);
+  audiotap->stats.decoder_ns += get_time_ns() - start - (audiotap->stats.io_ns - io_ns);
   return error;
 }
 
@@ -1214,11 +3671,134 @@ void tap2audio_enable_halfwaves(struct audiotap *audiotap, uint8_t halfwaves)
   audiotap->tap2audio_functions->enable_halfwaves(audiotap, halfwaves);
 }
 
-void tap2audio_close(struct audiotap *audiotap){
-  audiotap->tap2audio_functions->close(audiotap->priv);
-  if (status.tapdecoder_init_status == LIBRARY_OK)
-    tapdec_exit(audiotap->tapdec);
+enum audiotap_status tap2audio_close(struct audiotap *audiotap){
+  enum audiotap_status ret = audiotap->tap2audio_functions->close(audiotap->priv);
+
+  if (audiotap->tapdec != NULL)
+    audiotap->tapdec_functions->exit(audiotap->tapdec);
   destroy_wait_event(audiotap->wait_event);
   free(audiotap->wait_event);
+  free(audiotap->bufstart);
   free(audiotap);
+  return ret;
+}
+
+/* Batch conversion */
+
+#define CONVERSION_PULSES 4096
+
+/* Buffers owned by one thread, used for all the files it converts */
+struct conversion_buffers {
+  uint32_t pulses[CONVERSION_PULSES];
+  uint32_t raw_pulses[CONVERSION_PULSES];
+};
+
+static enum audiotap_status convert_file(const char *input,
+                                         const char *output,
+                                         const struct audiotap_conversion_params *params,
+                                         unsigned int threads,
+                                         struct conversion_buffers *buffers){
+  struct audiotap *in, *out;
+  struct tapenc_params tapenc_params = params->tapenc_params;
+  struct tapdec_params tapdec_params = params->tapdec_params;
+  uint8_t machine = params->machine, videotype = params->videotype, halfwaves = 0;
+  enum audiotap_status ret, write_ret = AUDIOTAP_OK, close_ret;
+
+  ret = audio2tap_open_from_file3(&in, input, &tapenc_params, &machine, &videotype, &halfwaves);
+  if (ret != AUDIOTAP_OK)
+    return ret;
+  if (params->output_format == AUDIOTAP_OUTPUT_TAP)
+    ret = tap2audio_open_to_tapfile3(&out, output, params->tap_version, machine, videotype);
+  else
+    ret = tap2audio_open_to_wavfile5(&out, output, &tapdec_params, params->freq, machine, videotype, params->bits ? params->bits : 8);
+  if (ret != AUDIOTAP_OK){
+    audio2tap_close(in);
+    return ret;
+  }
+  /* If the input has halfwaves, they are kept, unless the output is a TAP
+     file which cannot hold them */
+  if (halfwaves && (params->output_format != AUDIOTAP_OUTPUT_TAP || params->tap_version == 2)){
+    audio2tap_enable_disable_halfwaves(in, 1);
+    tap2audio_enable_halfwaves(out, 1);
+  }
+  /* with one thread, pulses are simply read as they are detected */
+  if (threads != 1)
+    ret = audio2tap_detect_pulses_in_parallel(in, threads);
+  while(ret == AUDIOTAP_OK && write_ret == AUDIOTAP_OK){
+    size_t got;
+
+    ret = audio2tap_get_pulses_batch(in, buffers->pulses, buffers->raw_pulses, CONVERSION_PULSES, &got);
+    if (got > 0)
+      write_ret = tap2audio_set_pulses(out, buffers->pulses, got);
+  }
+  audio2tap_close(in);
+  close_ret = tap2audio_close(out);
+  if (write_ret != AUDIOTAP_OK)
+    ret = write_ret;
+  else if (ret == AUDIOTAP_EOF)
+    ret = close_ret;
+  if (ret != AUDIOTAP_OK)
+    remove(output);
+  return ret;
+}
+
+enum audiotap_status audiotap_convert_file(const char *input,
+                                           const char *output,
+                                           const struct audiotap_conversion_params *params){
+  struct conversion_buffers *buffers = (struct conversion_buffers *)malloc(sizeof(struct conversion_buffers));
+  enum audiotap_status ret;
+
+  if (buffers == NULL)
+    return AUDIOTAP_NO_MEMORY;
+  ret = convert_file(input, output, params, params->threads, buffers);
+  free(buffers);
+  return ret;
+}
+
+struct conversion_batch {
+  struct audiotap_conversion *conversions;
+  long num_conversions;
+  volatile long next;   /* first conversion not yet taken by a thread */
+  volatile long failed;
+  const struct audiotap_conversion_params *params;
+  unsigned int threads_per_file;
+};
+
+static void convert_batch(void *arg){
+  struct conversion_batch *batch = (struct conversion_batch *)arg;
+  struct conversion_buffers *buffers = (struct conversion_buffers *)malloc(sizeof(struct conversion_buffers));
+  long i;
+
+  while ((i = ATOMIC_FETCH_ADD(batch->next, 1)) < batch->num_conversions){
+    struct audiotap_conversion *conversion = &batch->conversions[i];
+
+    conversion->status = buffers == NULL ? AUDIOTAP_NO_MEMORY :
+      convert_file(conversion->input, conversion->output, batch->params, batch->threads_per_file, buffers);
+    if (conversion->status != AUDIOTAP_OK)
+      ATOMIC_FETCH_ADD(batch->failed, 1);
+  }
+  free(buffers);
+}
+
+size_t audiotap_convert_files(struct audiotap_conversion *conversions,
+                              size_t num_conversions,
+                              const struct audiotap_conversion_params *params){
+  struct conversion_batch batch;
+  unsigned int threads = params->threads ? params->threads : get_num_cores();
+
+  /* threads left over when there are few files work on each of them */
+  batch.threads_per_file = 1;
+  if (threads > num_conversions){
+    if (num_conversions > 0)
+      batch.threads_per_file = threads / (unsigned int)num_conversions;
+    threads = (unsigned int)num_conversions;
+  }
+  batch.conversions = conversions;
+  batch.num_conversions = (long)num_conversions;
+  batch.next = 0;
+  batch.failed = 0;
+  batch.params = params;
+  if (threads > 0)
+    run_on_threads(threads, convert_batch, &batch);
+  return (size_t)batch.failed;
 }
@@ -18,6 +18,8 @@
 #include "tapencoder.h"
 #define TAPDECODER_DECLARE_HERE
 #include "tapdecoder.h"
+#define ZLIB_DECLARE_HERE
+#include "zlib.h"
 #include "audiotap.h"
 
 #ifndef _WIN32
@@ -36,6 +38,11 @@ struct audiotap_init_status status = {
   LIBRARY_UNINIT
 };
 
+#if __GNUC__ >= 4
+ __attribute__ ((visibility ("hidden")))
+#endif
+enum library_status zlib_init_status = LIBRARY_UNINIT;
+
 static enum library_status audiofile_init(){
 #if defined(WIN32)
   HINSTANCE handle;
@@ -140,8 +147,10 @@ static enum library_status portaudio_init(){
   LOAD(Pa_CloseStream)
   LOAD(Pa_StartStream)
   LOAD(Pa_StopStream)
+  LOAD(Pa_IsStreamActive)
   LOAD(Pa_ReadStream)
   LOAD(Pa_WriteStream)
+  LOAD(Pa_Sleep)
 
   if (Pa_Initialize() != paNoError)
   {
@@ -224,11 +233,46 @@ static enum library_status libtapdecoder_init(){
   return LIBRARY_OK;
 }
 
+static enum library_status zlib_init(){
+#if defined(WIN32)
+  HMODULE
+#else
+  void *
+#endif
+  handle;
+
+  static const char* zlib_library_name =
+#if (defined _WIN32 || defined __CYGWIN__)
+    "zlib1.dll"
+#elif defined __APPLE__
+    "libz.1.dylib"
+#else
+    "libz.so.1"
+#endif//__WIN32 or __CYGWIN__
+    ;
+
+#if defined(WIN32)
+  handle=LoadLibraryA(zlib_library_name);
+#else
+  handle=dlopen(zlib_library_name, RTLD_LAZY);
+#endif
+  if (!handle)
+    return LIBRARY_MISSING;
+
+  LOAD(inflateInit_)
+  LOAD(inflate)
+  LOAD(inflateReset)
+  LOAD(inflateEnd)
+
+  return LIBRARY_OK;
+}
+
 struct audiotap_init_status audiotap_initialize2(void){
   status.audiofile_init_status = audiofile_init();
   status.portaudio_init_status = portaudio_init();
   status.tapencoder_init_status = libtapencoder_init();
   status.tapdecoder_init_status = libtapdecoder_init();
+  zlib_init_status = zlib_init();
 
   return status;
 }
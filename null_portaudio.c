@@ -0,0 +1,224 @@
+/* Audiotap shared library: a higher-level interface to TAP shared library
+ *
+ * A stand-in for PortAudio with a null device, so sound card input and output
+ * can be tested where there is no sound card. Built as libportaudio.so.2 in a
+ * directory of its own, it is loaded instead of the real one when that
+ * directory comes first in LD_LIBRARY_PATH.
+ *
+ * Played samples are appended (as native 32-bit integers) to the file named
+ * by AUDIOTAP_NULL_OUTPUT, if set. Captured samples are silence. Callback
+ * streams run in real time on a thread of their own. If
+ * AUDIOTAP_NULL_STOP_AFTER is set when a stream is opened, the stream stops
+ * by itself after that many frames, like a device going away.
+ *
+ * The program is distributed under the GNU Lesser General Public License.
+ * See file LESSER-LICENSE.TXT for details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+/* The parts of portaudio.h used here, as functions rather than pointers */
+typedef int PaError;
+typedef unsigned long PaSampleFormat;
+typedef void PaStream;
+typedef struct PaStreamCallbackTimeInfo{
+  double inputBufferAdcTime;
+  double currentTime;
+  double outputBufferDacTime;
+} PaStreamCallbackTimeInfo;
+typedef unsigned long PaStreamCallbackFlags;
+typedef int PaStreamCallback(const void *input, void *output,
+                             unsigned long frames,
+                             const PaStreamCallbackTimeInfo *time_info,
+                             PaStreamCallbackFlags status_flags,
+                             void *priv);
+
+#define paNoError 0
+#define paInsufficientMemory (-9992)
+#define paStreamIsNotStopped (-9982)
+#define paContinue 0
+
+/* Frames per callback when the caller lets the device choose */
+#define NULL_DEFAULT_FRAMES 256
+
+struct null_stream {
+  int inputs, outputs;
+  double rate;
+  unsigned long frames_per_buffer;
+  PaStreamCallback *callback;
+  void *priv;
+  FILE *output;
+  uint64_t frames_done, stop_after;
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  int running; /* the thread is there */
+  int active;  /* and it is still calling back */
+  int stopping;
+};
+
+static void null_sleep_ns(uint64_t ns){
+  struct timespec ts;
+
+  ts.tv_sec = (time_t)(ns / 1000000000);
+  ts.tv_nsec = (long)(ns % 1000000000);
+  nanosleep(&ts, NULL);
+}
+
+static uint64_t null_time_ns(void){
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void null_play(struct null_stream *stream, const int32_t *samples, unsigned long frames){
+  if (stream->output != NULL)
+    fwrite(samples, sizeof(int32_t), frames, stream->output);
+}
+
+/* Calls back once per buffer, at the pace of a real device */
+static void *null_stream_thread(void *arg){
+  struct null_stream *stream = (struct null_stream *)arg;
+  unsigned long frames = stream->frames_per_buffer;
+  int32_t *input = (int32_t *)calloc(frames, sizeof(int32_t));
+  int32_t *output = (int32_t *)calloc(frames, sizeof(int32_t));
+  uint64_t start = null_time_ns();
+  PaStreamCallbackTimeInfo time_info = {0, 0, 0};
+
+  while (input != NULL && output != NULL){
+    uint64_t due;
+    int stop;
+
+    pthread_mutex_lock(&stream->mutex);
+    stop = stream->stopping
+        || (stream->stop_after > 0 && stream->frames_done >= stream->stop_after);
+    pthread_mutex_unlock(&stream->mutex);
+    if (stop)
+      break;
+    if (stream->callback(stream->inputs ? input : NULL,
+                         stream->outputs ? output : NULL,
+                         frames, &time_info, 0, stream->priv) != paContinue)
+      break;
+    if (stream->outputs)
+      null_play(stream, output, frames);
+    stream->frames_done += frames;
+    due = start + (uint64_t)(stream->frames_done * 1e9 / stream->rate);
+    if (due > null_time_ns())
+      null_sleep_ns(due - null_time_ns());
+  }
+  pthread_mutex_lock(&stream->mutex);
+  stream->active = 0;
+  pthread_mutex_unlock(&stream->mutex);
+  free(input);
+  free(output);
+  return NULL;
+}
+
+PaError Pa_Initialize(void){
+  return paNoError;
+}
+
+PaError Pa_Terminate(void){
+  return paNoError;
+}
+
+PaError Pa_OpenDefaultStream(PaStream **pastream,
+                             int inputs,
+                             int outputs,
+                             PaSampleFormat format,
+                             double rate,
+                             unsigned long frames_per_buffer,
+                             PaStreamCallback *callback,
+                             void *priv){
+  struct null_stream *stream = (struct null_stream *)calloc(1, sizeof(struct null_stream));
+  const char *output = getenv("AUDIOTAP_NULL_OUTPUT");
+  const char *stop_after = getenv("AUDIOTAP_NULL_STOP_AFTER");
+
+  if (stream == NULL)
+    return paInsufficientMemory;
+  stream->inputs = inputs;
+  stream->outputs = outputs;
+  stream->rate = rate;
+  stream->frames_per_buffer = frames_per_buffer ? frames_per_buffer : NULL_DEFAULT_FRAMES;
+  stream->callback = callback;
+  stream->priv = priv;
+  if (outputs && output != NULL)
+    stream->output = fopen(output, "ab");
+  if (stop_after != NULL)
+    stream->stop_after = strtoull(stop_after, NULL, 10);
+  pthread_mutex_init(&stream->mutex, NULL);
+  *pastream = stream;
+  return paNoError;
+}
+
+PaError Pa_StartStream(PaStream *pastream){
+  struct null_stream *stream = (struct null_stream *)pastream;
+
+  if (stream->running)
+    return paStreamIsNotStopped;
+  stream->stopping = 0;
+  stream->active = 1;
+  if (stream->callback == NULL)
+    return paNoError;
+  if (pthread_create(&stream->thread, NULL, null_stream_thread, stream) != 0){
+    stream->active = 0;
+    return paInsufficientMemory;
+  }
+  stream->running = 1;
+  return paNoError;
+}
+
+PaError Pa_StopStream(PaStream *pastream){
+  struct null_stream *stream = (struct null_stream *)pastream;
+
+  pthread_mutex_lock(&stream->mutex);
+  stream->stopping = 1;
+  pthread_mutex_unlock(&stream->mutex);
+  if (stream->running)
+    pthread_join(stream->thread, NULL);
+  stream->running = 0;
+  stream->active = 0;
+  return paNoError;
+}
+
+PaError Pa_IsStreamActive(PaStream *pastream){
+  struct null_stream *stream = (struct null_stream *)pastream;
+  int active;
+
+  pthread_mutex_lock(&stream->mutex);
+  active = stream->active;
+  pthread_mutex_unlock(&stream->mutex);
+  return active;
+}
+
+PaError Pa_CloseStream(PaStream *pastream){
+  struct null_stream *stream = (struct null_stream *)pastream;
+
+  Pa_StopStream(pastream);
+  if (stream->output != NULL)
+    fclose(stream->output);
+  pthread_mutex_destroy(&stream->mutex);
+  free(stream);
+  return paNoError;
+}
+
+/* Blocking streams take no time */
+PaError Pa_ReadStream(PaStream *pastream, void *buffer, unsigned long frames){
+  memset(buffer, 0, frames * sizeof(int32_t));
+  return paNoError;
+}
+
+PaError Pa_WriteStream(PaStream *pastream, const void *buffer, unsigned long frames){
+  null_play((struct null_stream *)pastream, (const int32_t *)buffer, frames);
+  return paNoError;
+}
+
+void Pa_Sleep(long msec){
+  null_sleep_ns((uint64_t)msec * 1000000);
+}
@@ -0,0 +1,425 @@
+/* Audiotap shared library: a higher-level interface to TAP shared library
+ *
+ * Conversion of PCM samples, as stored in WAV files, to 32-bit mono and
+ * back. The most common formats are converted with SSE2, SSSE3 or AVX2 where
+ * available.
+ *
+ * The program is distributed under the GNU Lesser General Public License.
+ * See file LESSER-LICENSE.TXT for details.
+ */
+
+#include <string.h>
+#include "pcm_convert.h"
+
+#if defined __GNUC__ && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)) \
+ && (defined __x86_64__ || defined __i386__)
+#define X86_KERNELS
+#include <immintrin.h>
+#endif
+
+static int32_t sample8(const uint8_t *p){
+  return (int32_t)((uint32_t)(p[0] ^ 0x80) << 24);
+}
+
+static int32_t sample16(const uint8_t *p){
+  return (int32_t)((uint32_t)p[0] << 16 | (uint32_t)p[1] << 24);
+}
+
+static int32_t sample24(const uint8_t *p){
+  return (int32_t)((uint32_t)p[0] << 8 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 24);
+}
+
+static int32_t sample32(const uint8_t *p){
+  return (int32_t)((uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+}
+
+static int32_t average(int32_t left, int32_t right){
+  return (int32_t)(((int64_t)left + right) >> 1);
+}
+
+static void convert8_mono(const uint8_t *in, int32_t *out, uint32_t n){
+  uint32_t i;
+
+  for (i = 0; i < n; i++)
+    out[i] = sample8(in + i);
+}
+
+static void convert8_stereo(const uint8_t *in, int32_t *out, uint32_t n){
+  uint32_t i;
+
+  for (i = 0; i < n; i++)
+    out[i] = average(sample8(in + 2 * i), sample8(in + 2 * i + 1));
+}
+
+static void convert16_mono(const uint8_t *in, int32_t *out, uint32_t n){
+  uint32_t i;
+
+  for (i = 0; i < n; i++)
+    out[i] = sample16(in + 2 * i);
+}
+
+static void convert16_stereo(const uint8_t *in, int32_t *out, uint32_t n){
+  uint32_t i;
+
+  for (i = 0; i < n; i++)
+    out[i] = average(sample16(in + 4 * i), sample16(in + 4 * i + 2));
+}
+
+static void convert24_mono(const uint8_t *in, int32_t *out, uint32_t n){
+  uint32_t i;
+
+  for (i = 0; i < n; i++)
+    out[i] = sample24(in + 3 * i);
+}
+
+static void convert24_stereo(const uint8_t *in, int32_t *out, uint32_t n){
+  uint32_t i;
+
+  for (i = 0; i < n; i++)
+    out[i] = average(sample24(in + 6 * i), sample24(in + 6 * i + 3));
+}
+
+static void convert32_mono(const uint8_t *in, int32_t *out, uint32_t n){
+#if defined __BYTE_ORDER__ && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  memcpy(out, in, n * sizeof(int32_t));
+#else
+  uint32_t i;
+
+  for (i = 0; i < n; i++)
+    out[i] = sample32(in + 4 * i);
+#endif
+}
+
+static void convert32_stereo(const uint8_t *in, int32_t *out, uint32_t n){
+  uint32_t i;
+
+  for (i = 0; i < n; i++)
+    out[i] = average(sample32(in + 8 * i), sample32(in + 8 * i + 4));
+}
+
+static void pack8(const int32_t *in, uint8_t *out, uint32_t n){
+  uint32_t i;
+
+  for (i = 0; i < n; i++)
+    out[i] = (uint8_t)((in[i] >> 24) ^ 0x80);
+}
+
+static void pack16(const int32_t *in, uint8_t *out, uint32_t n){
+  uint32_t i;
+
+  for (i = 0; i < n; i++){
+    out[2 * i    ] = (uint8_t)(in[i] >> 16);
+    out[2 * i + 1] = (uint8_t)(in[i] >> 24);
+  }
+}
+
+static void pack24(const int32_t *in, uint8_t *out, uint32_t n){
+  uint32_t i;
+
+  for (i = 0; i < n; i++){
+    out[3 * i    ] = (uint8_t)(in[i] >> 8);
+    out[3 * i + 1] = (uint8_t)(in[i] >> 16);
+    out[3 * i + 2] = (uint8_t)(in[i] >> 24);
+  }
+}
+
+static void pack32(const int32_t *in, uint8_t *out, uint32_t n){
+#if defined __BYTE_ORDER__ && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  memcpy(out, in, n * sizeof(int32_t));
+#else
+  uint32_t i;
+
+  for (i = 0; i < n; i++){
+    out[4 * i    ] = (uint8_t)(in[i]);
+    out[4 * i + 1] = (uint8_t)(in[i] >> 8);
+    out[4 * i + 2] = (uint8_t)(in[i] >> 16);
+    out[4 * i + 3] = (uint8_t)(in[i] >> 24);
+  }
+#endif
+}
+
+#ifdef X86_KERNELS
+
+/* Stereo samples are added as 16-bit pairs by madd, which is exact */
+
+__attribute__ ((target ("sse2")))
+static void convert8_mono_sse2(const uint8_t *in, int32_t *out, uint32_t n){
+  const __m128i zero = _mm_setzero_si128(), sign = _mm_set1_epi8((char)0x80);
+  uint32_t i;
+
+  for (i = 0; i + 16 <= n; i += 16){
+    __m128i x = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(in + i)), sign);
+    __m128i lo = _mm_unpacklo_epi8(zero, x), hi = _mm_unpackhi_epi8(zero, x);
+
+    _mm_storeu_si128((__m128i *)(out + i     ), _mm_unpacklo_epi16(zero, lo));
+    _mm_storeu_si128((__m128i *)(out + i +  4), _mm_unpackhi_epi16(zero, lo));
+    _mm_storeu_si128((__m128i *)(out + i +  8), _mm_unpacklo_epi16(zero, hi));
+    _mm_storeu_si128((__m128i *)(out + i + 12), _mm_unpackhi_epi16(zero, hi));
+  }
+  convert8_mono(in + i, out + i, n - i);
+}
+
+__attribute__ ((target ("sse2")))
+static void convert8_stereo_sse2(const uint8_t *in, int32_t *out, uint32_t n){
+  const __m128i sign = _mm_set1_epi8((char)0x80), ones = _mm_set1_epi16(1);
+  uint32_t i;
+
+  for (i = 0; i + 8 <= n; i += 8){
+    __m128i x = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(in + 2 * i)), sign);
+    __m128i lo = _mm_srai_epi16(_mm_unpacklo_epi8(x, x), 8);
+    __m128i hi = _mm_srai_epi16(_mm_unpackhi_epi8(x, x), 8);
+
+    _mm_storeu_si128((__m128i *)(out + i    ), _mm_slli_epi32(_mm_madd_epi16(lo, ones), 23));
+    _mm_storeu_si128((__m128i *)(out + i + 4), _mm_slli_epi32(_mm_madd_epi16(hi, ones), 23));
+  }
+  convert8_stereo(in + 2 * i, out + i, n - i);
+}
+
+__attribute__ ((target ("sse2")))
+static void convert16_mono_sse2(const uint8_t *in, int32_t *out, uint32_t n){
+  const __m128i zero = _mm_setzero_si128();
+  uint32_t i;
+
+  for (i = 0; i + 8 <= n; i += 8){
+    __m128i x = _mm_loadu_si128((const __m128i *)(in + 2 * i));
+
+    _mm_storeu_si128((__m128i *)(out + i    ), _mm_unpacklo_epi16(zero, x));
+    _mm_storeu_si128((__m128i *)(out + i + 4), _mm_unpackhi_epi16(zero, x));
+  }
+  convert16_mono(in + 2 * i, out + i, n - i);
+}
+
+__attribute__ ((target ("sse2")))
+static void convert16_stereo_sse2(const uint8_t *in, int32_t *out, uint32_t n){
+  const __m128i ones = _mm_set1_epi16(1);
+  uint32_t i;
+
+  for (i = 0; i + 4 <= n; i += 4){
+    __m128i x = _mm_loadu_si128((const __m128i *)(in + 4 * i));
+
+    _mm_storeu_si128((__m128i *)(out + i), _mm_slli_epi32(_mm_madd_epi16(x, ones), 15));
+  }
+  convert16_stereo(in + 4 * i, out + i, n - i);
+}
+
+/* floor((l + r) / 2) without overflowing */
+__attribute__ ((target ("sse2")))
+static void convert32_stereo_sse2(const uint8_t *in, int32_t *out, uint32_t n){
+  const __m128i one = _mm_set1_epi32(1);
+  uint32_t i;
+
+  for (i = 0; i + 4 <= n; i += 4){
+    __m128 a = _mm_castsi128_ps(_mm_loadu_si128((const __m128i *)(in + 8 * i)));
+    __m128 b = _mm_castsi128_ps(_mm_loadu_si128((const __m128i *)(in + 8 * i + 16)));
+    __m128i left = _mm_castps_si128(_mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+    __m128i right = _mm_castps_si128(_mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+    __m128i sum = _mm_add_epi32(_mm_srai_epi32(left, 1), _mm_srai_epi32(right, 1));
+
+    sum = _mm_add_epi32(sum, _mm_and_si128(_mm_and_si128(left, right), one));
+    _mm_storeu_si128((__m128i *)(out + i), sum);
+  }
+  convert32_stereo(in + 8 * i, out + i, n - i);
+}
+
+/* 24-bit samples are moved to the top of 32-bit lanes. Loads are 16 bytes
+   long, of which only 12 are used, so the loops stop early enough not to
+   read past the end */
+
+__attribute__ ((target ("ssse3")))
+static __m128i load24(const uint8_t *in){
+  const __m128i spread = _mm_setr_epi8(-1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11);
+
+  return _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)in), spread);
+}
+
+__attribute__ ((target ("ssse3")))
+static void convert24_mono_ssse3(const uint8_t *in, int32_t *out, uint32_t n){
+  uint32_t i;
+
+  for (i = 0; i + 6 <= n; i += 4)
+    _mm_storeu_si128((__m128i *)(out + i), load24(in + 3 * i));
+  convert24_mono(in + 3 * i, out + i, n - i);
+}
+
+/* The lowest 8 bits are 0, so halving before adding is exact */
+__attribute__ ((target ("ssse3")))
+static void convert24_stereo_ssse3(const uint8_t *in, int32_t *out, uint32_t n){
+  uint32_t i;
+
+  for (i = 0; i + 5 <= n; i += 4){
+    __m128i a = _mm_srai_epi32(load24(in + 6 * i), 1);
+    __m128i b = _mm_srai_epi32(load24(in + 6 * i + 12), 1);
+
+    _mm_storeu_si128((__m128i *)(out + i), _mm_hadd_epi32(a, b));
+  }
+  convert24_stereo(in + 6 * i, out + i, n - i);
+}
+
+__attribute__ ((target ("avx2")))
+static void convert8_mono_avx2(const uint8_t *in, int32_t *out, uint32_t n){
+  const __m128i sign = _mm_set1_epi8((char)0x80);
+  uint32_t i;
+
+  for (i = 0; i + 16 <= n; i += 16){
+    __m128i x = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(in + i)), sign);
+
+    _mm256_storeu_si256((__m256i *)(out + i    ), _mm256_slli_epi32(_mm256_cvtepi8_epi32(x), 24));
+    _mm256_storeu_si256((__m256i *)(out + i + 8), _mm256_slli_epi32(_mm256_cvtepi8_epi32(_mm_srli_si128(x, 8)), 24));
+  }
+  convert8_mono_sse2(in + i, out + i, n - i);
+}
+
+__attribute__ ((target ("avx2")))
+static void convert16_mono_avx2(const uint8_t *in, int32_t *out, uint32_t n){
+  uint32_t i;
+
+  for (i = 0; i + 8 <= n; i += 8){
+    __m128i x = _mm_loadu_si128((const __m128i *)(in + 2 * i));
+
+    _mm256_storeu_si256((__m256i *)(out + i), _mm256_slli_epi32(_mm256_cvtepi16_epi32(x), 16));
+  }
+  convert16_mono(in + 2 * i, out + i, n - i);
+}
+
+__attribute__ ((target ("avx2")))
+static void convert16_stereo_avx2(const uint8_t *in, int32_t *out, uint32_t n){
+  const __m256i ones = _mm256_set1_epi16(1);
+  uint32_t i;
+
+  for (i = 0; i + 8 <= n; i += 8){
+    __m256i x = _mm256_loadu_si256((const __m256i *)(in + 4 * i));
+
+    _mm256_storeu_si256((__m256i *)(out + i), _mm256_slli_epi32(_mm256_madd_epi16(x, ones), 15));
+  }
+  convert16_stereo_sse2(in + 4 * i, out + i, n - i);
+}
+
+/* Samples are shifted down first, so the saturating packs are exact */
+
+__attribute__ ((target ("sse2")))
+static void pack8_sse2(const int32_t *in, uint8_t *out, uint32_t n){
+  const __m128i sign = _mm_set1_epi8((char)0x80);
+  uint32_t i;
+
+  for (i = 0; i + 16 <= n; i += 16){
+    __m128i a = _mm_srai_epi32(_mm_loadu_si128((const __m128i *)(in + i     )), 24);
+    __m128i b = _mm_srai_epi32(_mm_loadu_si128((const __m128i *)(in + i +  4)), 24);
+    __m128i c = _mm_srai_epi32(_mm_loadu_si128((const __m128i *)(in + i +  8)), 24);
+    __m128i d = _mm_srai_epi32(_mm_loadu_si128((const __m128i *)(in + i + 12)), 24);
+    __m128i x = _mm_packs_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d));
+
+    _mm_storeu_si128((__m128i *)(out + i), _mm_xor_si128(x, sign));
+  }
+  pack8(in + i, out + i, n - i);
+}
+
+__attribute__ ((target ("sse2")))
+static void pack16_sse2(const int32_t *in, uint8_t *out, uint32_t n){
+  uint32_t i;
+
+  for (i = 0; i + 8 <= n; i += 8){
+    __m128i a = _mm_srai_epi32(_mm_loadu_si128((const __m128i *)(in + i    )), 16);
+    __m128i b = _mm_srai_epi32(_mm_loadu_si128((const __m128i *)(in + i + 4)), 16);
+
+    _mm_storeu_si128((__m128i *)(out + 2 * i), _mm_packs_epi32(a, b));
+  }
+  pack16(in + i, out + 2 * i, n - i);
+}
+
+/* Stores are 16 bytes long, of which only 12 are used, so the loop stops
+   early enough not to write past the end */
+__attribute__ ((target ("ssse3")))
+static void pack24_ssse3(const int32_t *in, uint8_t *out, uint32_t n){
+  const __m128i gather = _mm_setr_epi8(1, 2, 3, 5, 6, 7, 9, 10, 11, 13, 14, 15, -1, -1, -1, -1);
+  uint32_t i;
+
+  for (i = 0; i + 6 <= n; i += 4)
+    _mm_storeu_si128((__m128i *)(out + 3 * i), _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(in + i)), gather));
+  pack24(in + i, out + 3 * i, n - i);
+}
+
+/* packs works within 128-bit lanes, so the result is put back in order */
+__attribute__ ((target ("avx2")))
+static void pack16_avx2(const int32_t *in, uint8_t *out, uint32_t n){
+  uint32_t i;
+
+  for (i = 0; i + 16 <= n; i += 16){
+    __m256i a = _mm256_srai_epi32(_mm256_loadu_si256((const __m256i *)(in + i    )), 16);
+    __m256i b = _mm256_srai_epi32(_mm256_loadu_si256((const __m256i *)(in + i + 8)), 16);
+
+    _mm256_storeu_si256((__m256i *)(out + 2 * i), _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), 0xD8));
+  }
+  pack16_sse2(in + i, out + 2 * i, n - i);
+}
+
+#endif /* X86_KERNELS */
+
+#if __GNUC__ >= 4
+ __attribute__ ((visibility ("hidden")))
+#endif
+pcm_converter get_pcm_converter(unsigned int bits, unsigned int channels){
+  if (channels != 1 && channels != 2)
+    return NULL;
+#ifdef X86_KERNELS
+  if (__builtin_cpu_supports("avx2")){
+    if (bits == 8 && channels == 1)
+      return convert8_mono_avx2;
+    if (bits == 16)
+      return channels == 1 ? convert16_mono_avx2 : convert16_stereo_avx2;
+  }
+  if (bits == 24 && __builtin_cpu_supports("ssse3"))
+    return channels == 1 ? convert24_mono_ssse3 : convert24_stereo_ssse3;
+  if (__builtin_cpu_supports("sse2")){
+    switch (bits){
+    case 8:
+      return channels == 1 ? convert8_mono_sse2 : convert8_stereo_sse2;
+    case 16:
+      return channels == 1 ? convert16_mono_sse2 : convert16_stereo_sse2;
+    case 32:
+      if (channels == 2)
+        return convert32_stereo_sse2;
+      break;
+    }
+  }
+#endif
+  switch (bits){
+  case 8:
+    return channels == 1 ? convert8_mono : convert8_stereo;
+  case 16:
+    return channels == 1 ? convert16_mono : convert16_stereo;
+  case 24:
+    return channels == 1 ? convert24_mono : convert24_stereo;
+  case 32:
+    return channels == 1 ? convert32_mono : convert32_stereo;
+  }
+  return NULL;
+}
+
+#if __GNUC__ >= 4
+ __attribute__ ((visibility ("hidden")))
+#endif
+pcm_packer get_pcm_packer(unsigned int bits){
+#ifdef X86_KERNELS
+  if (bits == 16 && __builtin_cpu_supports("avx2"))
+    return pack16_avx2;
+  if (bits == 24 && __builtin_cpu_supports("ssse3"))
+    return pack24_ssse3;
+  if (__builtin_cpu_supports("sse2")){
+    if (bits == 8)
+      return pack8_sse2;
+    if (bits == 16)
+      return pack16_sse2;
+  }
+#endif
+  switch (bits){
+  case 8:
+    return pack8;
+  case 16:
+    return pack16;
+  case 24:
+    return pack24;
+  case 32:
+    return pack32;
+  }
+  return NULL;
+}
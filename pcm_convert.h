@@ -0,0 +1,30 @@
+/* Audiotap shared library: a higher-level interface to TAP shared library
+ *
+ * Conversion of PCM samples, as stored in WAV files, to 32-bit mono and back
+ *
+ * The program is distributed under the GNU Lesser General Public License.
+ * See file LESSER-LICENSE.TXT for details.
+ */
+
+#include <stdint.h>
+
+/* Converts n frames of little-endian PCM (8-bit unsigned, 16, 24 or 32-bit
+   signed) to 32-bit samples, the most significant bits being those of the
+   input. Two channels are mixed by taking their average */
+typedef void (*pcm_converter)(const uint8_t *in, int32_t *out, uint32_t n);
+
+/* NULL if the format is not supported */
+#if __GNUC__ >= 4
+ __attribute__ ((visibility ("hidden")))
+#endif
+pcm_converter get_pcm_converter(unsigned int bits, unsigned int channels);
+
+/* Converts n 32-bit samples to little-endian PCM (8-bit unsigned, 16, 24 or
+   32-bit signed), keeping the most significant bits */
+typedef void (*pcm_packer)(const int32_t *in, uint8_t *out, uint32_t n);
+
+/* NULL if the format is not supported */
+#if __GNUC__ >= 4
+ __attribute__ ((visibility ("hidden")))
+#endif
+pcm_packer get_pcm_packer(unsigned int bits);
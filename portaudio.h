@@ -61,20 +61,54 @@ EXTERN PaError (*Pa_Initialize)( void );
 EXTERN PaError (*Pa_Terminate)( void );
 
 typedef void PaStream;
+
+typedef double PaTime;
+
+typedef struct PaStreamCallbackTimeInfo{
+    PaTime inputBufferAdcTime;
+    PaTime currentTime;
+    PaTime outputBufferDacTime;
+} PaStreamCallbackTimeInfo;
+
+typedef unsigned long PaStreamCallbackFlags;
+
+#define paInputUnderflow   ((PaStreamCallbackFlags) 0x00000001)
+#define paInputOverflow    ((PaStreamCallbackFlags) 0x00000002)
+#define paOutputUnderflow  ((PaStreamCallbackFlags) 0x00000004)
+#define paOutputOverflow   ((PaStreamCallbackFlags) 0x00000008)
+#define paPrimingOutput    ((PaStreamCallbackFlags) 0x00000010)
+
+typedef enum PaStreamCallbackResult
+{
+    paContinue=0,
+    paComplete=1,
+    paAbort=2
+} PaStreamCallbackResult;
+
+typedef int PaStreamCallback(
+    const void *input, void *output,
+    unsigned long frameCount,
+    const PaStreamCallbackTimeInfo* timeInfo,
+    PaStreamCallbackFlags statusFlags,
+    void *userData );
+
 EXTERN PaError (*Pa_OpenDefaultStream)( PaStream** stream,
                              int numInputChannels,
                              int numOutputChannels,
                              PaSampleFormat sampleFormat,
                              double sampleRate,
                              unsigned long framesPerBuffer,
-                             void *streamCallback,
+                             PaStreamCallback *streamCallback,
                              void *userData );
 EXTERN PaError (*Pa_CloseStream)( PaStream *stream );
 EXTERN PaError (*Pa_StartStream)( PaStream *stream );
 EXTERN PaError (*Pa_StopStream)( PaStream *stream );
+/* 1 if the stream is running, 0 if it has stopped, negative on errors */
+EXTERN PaError (*Pa_IsStreamActive)( PaStream *stream );
 EXTERN PaError (*Pa_ReadStream)( PaStream* stream,
                       void *buffer,
                       unsigned long frames );
 EXTERN PaError (*Pa_WriteStream)( PaStream* stream,
                        const void *buffer,
                        unsigned long frames );
+EXTERN void (*Pa_Sleep)( long msec );
@@ -0,0 +1,59 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include "threads.h"
+
+struct thread_start {
+  void (*function)(void *arg);
+  void *arg;
+};
+
+static void *thread_start(void *start){
+  ((struct thread_start *)start)->function(((struct thread_start *)start)->arg);
+  return NULL;
+}
+
+#if __GNUC__ >= 4
+ __attribute__ ((visibility ("hidden")))
+#endif
+unsigned int get_num_cores(void){
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+
+  return cores > 0 ? (unsigned int)cores : 1;
+}
+
+#if __GNUC__ >= 4
+ __attribute__ ((visibility ("hidden")))
+#endif
+void run_on_threads(unsigned int num_threads, void (*function)(void *arg), void *arg){
+  struct thread_start start;
+  pthread_t *threads = NULL;
+  unsigned int i, started = 0;
+
+  start.function = function;
+  start.arg = arg;
+  if (num_threads > 1)
+    threads = (pthread_t *)malloc((num_threads - 1) * sizeof(pthread_t));
+  if (threads != NULL){
+    for (i = 0; i < num_threads - 1; i++){
+      if (pthread_create(&threads[i], NULL, thread_start, &start) != 0)
+        break;
+      started++;
+    }
+  }
+  function(arg);
+  for (i = 0; i < started; i++)
+    pthread_join(threads[i], NULL);
+  free(threads);
+}
+
+#if __GNUC__ >= 4
+ __attribute__ ((visibility ("hidden")))
+#endif
+uint64_t get_time_ns(void){
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
@@ -1,41 +1,66 @@
+#include <pthread.h>
 #include "wait_event.h"
 
-struct wait_event;
+struct wait_event {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  int paused;
+};
 
 #if __GNUC__ >= 4
  __attribute__ ((visibility ("hidden")))
 #endif
 int size_of_wait_event(void){
-  return 0;
+  return sizeof(struct wait_event);
 }
 
 #if __GNUC__ >= 4
  __attribute__ ((visibility ("hidden")))
 #endif
 void create_wait_event(struct wait_event *wait_event) {
+  pthread_mutex_init(&wait_event->mutex, NULL);
+  pthread_cond_init(&wait_event->cond, NULL);
+  wait_event->paused = 0;
 }
 
 #if __GNUC__ >= 4
  __attribute__ ((visibility ("hidden")))
 #endif
-void pause_if_necessary(struct wait_event *wait_event){
+int pause_if_necessary(struct wait_event *wait_event){
+  int waited = 0;
+
+  pthread_mutex_lock(&wait_event->mutex);
+  while (wait_event->paused){
+    waited = 1;
+    pthread_cond_wait(&wait_event->cond, &wait_event->mutex);
+  }
+  pthread_mutex_unlock(&wait_event->mutex);
+  return waited;
 }
 
 #if __GNUC__ >= 4
  __attribute__ ((visibility ("hidden")))
 #endif
 void set_pause(struct wait_event *wait_event) {
+  pthread_mutex_lock(&wait_event->mutex);
+  wait_event->paused = 1;
+  pthread_mutex_unlock(&wait_event->mutex);
 }
 
 #if __GNUC__ >= 4
  __attribute__ ((visibility ("hidden")))
 #endif
 void resume_from_pause(struct wait_event *wait_event) {
+  pthread_mutex_lock(&wait_event->mutex);
+  wait_event->paused = 0;
+  pthread_cond_broadcast(&wait_event->cond);
+  pthread_mutex_unlock(&wait_event->mutex);
 }
 
 #if __GNUC__ >= 4
  __attribute__ ((visibility ("hidden")))
 #endif
 void destroy_wait_event(struct wait_event *wait_event) {
+  pthread_cond_destroy(&wait_event->cond);
+  pthread_mutex_destroy(&wait_event->mutex);
 }
-
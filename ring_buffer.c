@@ -0,0 +1,168 @@
+/* Audiotap shared library: a higher-level interface to TAP shared library
+ *
+ * Lock-free ring buffer of samples, between exactly one producer thread and
+ * one consumer thread
+ *
+ * The program is distributed under the GNU Lesser General Public License.
+ * See file LESSER-LICENSE.TXT for details.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "ring_buffer.h"
+#include "atomic_ops.h"
+
+/* Must be a power of 2 */
+#define MAX_LOSSES 16
+
+struct ring_loss {
+  uint32_t at;   /* position of the first sample lost */
+  uint32_t lost;
+};
+
+struct ring_buffer {
+  int32_t *samples;
+  uint32_t mask;
+  /* Free-running counters, only written by the producer and the consumer
+     respectively. Their difference is the number of samples in the ring */
+  volatile uint32_t written;
+  volatile uint32_t read;
+  /* Where samples were lost, in a smaller ring with counters like the
+     above. Samples lost while it is full are recorded later, and nothing
+     is written after them until then */
+  struct ring_loss losses[MAX_LOSSES];
+  volatile uint32_t losses_written;
+  volatile uint32_t losses_read;
+  uint32_t unrecorded;
+};
+
+#if __GNUC__ >= 4
+ __attribute__ ((visibility ("hidden")))
+#endif
+struct ring_buffer *create_ring_buffer(uint32_t size){
+  struct ring_buffer *ring;
+  uint32_t capacity = 1;
+
+  if (size > 0x80000000)
+    return NULL;
+  while (capacity < size)
+    capacity <<= 1;
+  ring = (struct ring_buffer *)calloc(1, sizeof(struct ring_buffer));
+  if (ring == NULL)
+    return NULL;
+  ring->samples = (int32_t *)malloc(capacity * sizeof(int32_t));
+  if (ring->samples == NULL){
+    free(ring);
+    return NULL;
+  }
+  ring->mask = capacity - 1;
+  return ring;
+}
+
+#if __GNUC__ >= 4
+ __attribute__ ((visibility ("hidden")))
+#endif
+void destroy_ring_buffer(struct ring_buffer *ring){
+  if (ring != NULL)
+    free(ring->samples);
+  free(ring);
+}
+
+/* Copies n samples between the ring, starting at position pos, and buf */
+static void copy_ring_buffer(struct ring_buffer *ring, uint32_t pos, int32_t *buf, uint32_t n, int to_ring){
+  uint32_t start = pos & ring->mask;
+  uint32_t first = ring->mask + 1 - start;
+
+  if (first > n)
+    first = n;
+  if (to_ring){
+    memcpy(ring->samples + start, buf, first * sizeof(int32_t));
+    memcpy(ring->samples, buf + first, (n - first) * sizeof(int32_t));
+  }
+  else{
+    memcpy(buf, ring->samples + start, first * sizeof(int32_t));
+    memcpy(buf + first, ring->samples, (n - first) * sizeof(int32_t));
+  }
+}
+
+/* Called by the producer. Returns 0 if there is no room for the record */
+static int record_loss(struct ring_buffer *ring, uint32_t at, uint32_t lost){
+  uint32_t losses_written = ring->losses_written;
+  struct ring_loss *loss = &ring->losses[losses_written & (MAX_LOSSES - 1)];
+
+  if (losses_written - ATOMIC_LOAD(ring->losses_read) == MAX_LOSSES)
+    return 0;
+  loss->at = at;
+  loss->lost = lost;
+  ATOMIC_STORE(ring->losses_written, losses_written + 1);
+  return 1;
+}
+
+#if __GNUC__ >= 4
+ __attribute__ ((visibility ("hidden")))
+#endif
+uint32_t write_to_ring_buffer(struct ring_buffer *ring, const int32_t *samples, uint32_t n){
+  uint32_t written = ring->written;
+  uint32_t room = ring->mask + 1 - (written - ATOMIC_LOAD(ring->read));
+
+  if (ring->unrecorded > 0){
+    if (!record_loss(ring, written, ring->unrecorded)){
+      ring->unrecorded += n;
+      return 0;
+    }
+    ring->unrecorded = 0;
+  }
+  if (n <= room){
+    copy_ring_buffer(ring, written, (int32_t *)samples, n, 1);
+    ATOMIC_STORE(ring->written, written + n);
+    return n;
+  }
+  copy_ring_buffer(ring, written, (int32_t *)samples, room, 1);
+  ATOMIC_STORE(ring->written, written + room);
+  if (!record_loss(ring, written + room, n - room))
+    ring->unrecorded = n - room;
+  return room;
+}
+
+#if __GNUC__ >= 4
+ __attribute__ ((visibility ("hidden")))
+#endif
+uint32_t read_from_ring_buffer(struct ring_buffer *ring, int32_t *samples, uint32_t n, uint32_t *lost){
+  uint32_t read = ring->read;
+  uint32_t losses_read = ring->losses_read;
+  uint32_t available;
+
+  *lost = 0;
+  while (losses_read != ATOMIC_LOAD(ring->losses_written)){
+    const struct ring_loss *loss = &ring->losses[losses_read & (MAX_LOSSES - 1)];
+
+    if (loss->at != read){
+      if (n > loss->at - read)
+        n = loss->at - read;
+      break;
+    }
+    *lost += loss->lost;
+    ATOMIC_STORE(ring->losses_read, ++losses_read);
+  }
+  /* after the losses, so it includes the samples before any of them */
+  available = ATOMIC_LOAD(ring->written) - read;
+  if (n > available)
+    n = available;
+  copy_ring_buffer(ring, read, samples, n, 0);
+  ATOMIC_STORE(ring->read, read + n);
+  return n;
+}
+
+#if __GNUC__ >= 4
+ __attribute__ ((visibility ("hidden")))
+#endif
+uint32_t room_in_ring_buffer(struct ring_buffer *ring){
+  return ring->mask + 1 - samples_in_ring_buffer(ring);
+}
+
+#if __GNUC__ >= 4
+ __attribute__ ((visibility ("hidden")))
+#endif
+uint32_t samples_in_ring_buffer(struct ring_buffer *ring){
+  return ring->written - ATOMIC_LOAD(ring->read);
+}
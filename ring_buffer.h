@@ -0,0 +1,50 @@
+/* Audiotap shared library: a higher-level interface to TAP shared library
+ *
+ * Lock-free ring buffer of samples, between exactly one producer thread and
+ * one consumer thread
+ *
+ * The program is distributed under the GNU Lesser General Public License.
+ * See file LESSER-LICENSE.TXT for details.
+ */
+
+#include <stdint.h>
+
+struct ring_buffer;
+
+/* The size is rounded up to a power of 2 */
+#if __GNUC__ >= 4
+ __attribute__ ((visibility ("hidden")))
+#endif
+struct ring_buffer *create_ring_buffer(uint32_t size);
+
+#if __GNUC__ >= 4
+ __attribute__ ((visibility ("hidden")))
+#endif
+void destroy_ring_buffer(struct ring_buffer *ring);
+
+/* Called by the producer. Returns how many samples fitted: the others are
+   lost, and the consumer is told when it gets there */
+#if __GNUC__ >= 4
+ __attribute__ ((visibility ("hidden")))
+#endif
+uint32_t write_to_ring_buffer(struct ring_buffer *ring, const int32_t *samples, uint32_t n);
+
+/* Called by the consumer. Returns how many samples were available, up to n.
+   Reading stops where samples were lost: *lost is how many were lost just
+   before the ones returned */
+#if __GNUC__ >= 4
+ __attribute__ ((visibility ("hidden")))
+#endif
+uint32_t read_from_ring_buffer(struct ring_buffer *ring, int32_t *samples, uint32_t n, uint32_t *lost);
+
+/* Called by the producer: how many samples can be written without losing any */
+#if __GNUC__ >= 4
+ __attribute__ ((visibility ("hidden")))
+#endif
+uint32_t room_in_ring_buffer(struct ring_buffer *ring);
+
+/* Called by the producer: how many samples the consumer has not read yet */
+#if __GNUC__ >= 4
+ __attribute__ ((visibility ("hidden")))
+#endif
+uint32_t samples_in_ring_buffer(struct ring_buffer *ring);
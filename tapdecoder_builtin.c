@@ -0,0 +1,147 @@
+/* Audiotap shared library: a higher-level interface to TAP shared library
+ *
+ * Built-in TAP decoder, used when the TAP decoder library is not available
+ * or not wanted.
+ *
+ * Each pulse is one period of the chosen waveform (or half of it, in
+ * halfwave mode, the two halves alternating), starting with a falling edge
+ * like those a C64 triggers on, unless inverted. One period is computed
+ * once into a table, and each pulse is drawn by stepping through the table
+ * with a fixed-point phase, interpolating between entries. Square waves are
+ * just two runs of constant samples.
+ *
+ * The program is distributed under the GNU Lesser General Public License.
+ * See file LESSER-LICENSE.TXT for details.
+ */
+
+#include <stdlib.h>
+#include <math.h>
+#include "tapdecoder.h"
+#include "tapdecoder_builtin.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+#define TABLE_BITS 12
+#define TABLE_SIZE (1 << TABLE_BITS)
+/* fractional bits of the phase */
+#define PHASE_BITS 32
+#define HALF_PERIOD ((uint64_t)TABLE_SIZE << (PHASE_BITS - 1))
+
+struct tap_dec_t {
+  int32_t table[TABLE_SIZE + 1]; /* one period, and its first entry again */
+  int32_t low, high;             /* levels of the square wave */
+  enum tapdec_waveform waveform;
+  uint64_t phase;                /* position in the table */
+  uint64_t step;                 /* phase increment per sample */
+  uint32_t remaining;            /* samples left in the current pulse */
+  uint8_t halfwaves;
+  uint8_t second_half;           /* next halfwave is the second of a pair */
+};
+
+#if __GNUC__ >= 4
+ __attribute__ ((visibility ("hidden")))
+#endif
+struct tap_dec_t *builtin_tapdec_init2(uint32_t volume, uint8_t inverted, enum tapdec_waveform waveform){
+  struct tap_dec_t *tap = (struct tap_dec_t *)calloc(1, sizeof(struct tap_dec_t));
+  double amplitude;
+  int i;
+
+  if (tap == NULL)
+    return NULL;
+  amplitude = (double)((volume > 255 ? 255 : volume) << 23);
+  if (inverted)
+    amplitude = -amplitude;
+  for (i = 0; i < TABLE_SIZE; i++){
+    double x = (double)i / TABLE_SIZE, value;
+
+    switch (waveform){
+    case TAPDEC_TRIANGLE:
+      value = x < 0.25 ? -4 * x : x < 0.75 ? 4 * x - 2 : 4 - 4 * x;
+      break;
+    case TAPDEC_SQUARE:
+      value = x < 0.5 ? -1 : 1;
+      break;
+    default:
+      value = -sin(2 * M_PI * x);
+      break;
+    }
+    tap->table[i] = (int32_t)(value * amplitude);
+  }
+  tap->table[TABLE_SIZE] = tap->table[0];
+  tap->low = tap->table[0];
+  tap->high = tap->table[TABLE_SIZE / 2];
+  tap->waveform = waveform;
+  return tap;
+}
+
+#if __GNUC__ >= 4
+ __attribute__ ((visibility ("hidden")))
+#endif
+void builtin_tapdec_set_pulse(struct tap_dec_t *tap, uint32_t pulse){
+  uint64_t span = tap->halfwaves ? HALF_PERIOD : 2 * HALF_PERIOD;
+
+  tap->remaining = pulse;
+  if (pulse == 0)
+    return;
+  tap->phase = tap->halfwaves && tap->second_half ? HALF_PERIOD : 0;
+  tap->step = span / pulse;
+  if (tap->halfwaves)
+    tap->second_half = !tap->second_half;
+}
+
+/* Fills buffer with n samples of the current pulse */
+static void draw(struct tap_dec_t *tap, int32_t *buffer, uint32_t n){
+  const int32_t *table = tap->table;
+  uint64_t phase = tap->phase, step = tap->step;
+  uint32_t i = 0;
+
+  if (tap->waveform == TAPDEC_SQUARE){
+    /* samples before the middle of the period are low */
+    uint64_t low = phase < HALF_PERIOD ? (HALF_PERIOD - phase + step - 1) / step : 0;
+
+    if (low > n)
+      low = n;
+    for (; i < low; i++)
+      buffer[i] = tap->low;
+    for (; i < n; i++)
+      buffer[i] = tap->high;
+    phase += step * n;
+  }
+  else{
+    for (; i < n; i++, phase += step){
+      uint32_t index = (uint32_t)(phase >> PHASE_BITS);
+      int64_t frac = (int64_t)((phase >> (PHASE_BITS - 16)) & 0xFFFF);
+
+      buffer[i] = table[index] + (int32_t)(((table[index + 1] - (int64_t)table[index]) * frac) >> 16);
+    }
+  }
+  tap->phase = phase;
+}
+
+#if __GNUC__ >= 4
+ __attribute__ ((visibility ("hidden")))
+#endif
+uint32_t builtin_tapdec_get_buffer(struct tap_dec_t *tap, int32_t *buffer, unsigned int buflen){
+  uint32_t n = tap->remaining < buflen ? tap->remaining : buflen;
+
+  draw(tap, buffer, n);
+  tap->remaining -= n;
+  return n;
+}
+
+#if __GNUC__ >= 4
+ __attribute__ ((visibility ("hidden")))
+#endif
+void builtin_tapdec_enable_halfwaves(struct tap_dec_t *tap, uint8_t halfwaves){
+  tap->halfwaves = halfwaves;
+  tap->second_half = 0;
+}
+
+#if __GNUC__ >= 4
+ __attribute__ ((visibility ("hidden")))
+#endif
+void builtin_tapdec_exit(struct tap_dec_t *tap){
+  free(tap);
+}
@@ -0,0 +1,36 @@
+/* Audiotap shared library: a higher-level interface to TAP shared library
+ *
+ * Built-in TAP decoder, used when the TAP decoder library is not available
+ * or not wanted. Same interface as the library (see tapdecoder.h, which
+ * must be included first)
+ *
+ * The program is distributed under the GNU Lesser General Public License.
+ * See file LESSER-LICENSE.TXT for details.
+ */
+
+#include <stdint.h>
+
+#if __GNUC__ >= 4
+ __attribute__ ((visibility ("hidden")))
+#endif
+struct tap_dec_t *builtin_tapdec_init2(uint32_t volume, uint8_t inverted, enum tapdec_waveform waveform);
+
+#if __GNUC__ >= 4
+ __attribute__ ((visibility ("hidden")))
+#endif
+void builtin_tapdec_set_pulse(struct tap_dec_t *tap, uint32_t pulse);
+
+#if __GNUC__ >= 4
+ __attribute__ ((visibility ("hidden")))
+#endif
+uint32_t builtin_tapdec_get_buffer(struct tap_dec_t *tap, int32_t *buffer, unsigned int buflen);
+
+#if __GNUC__ >= 4
+ __attribute__ ((visibility ("hidden")))
+#endif
+void builtin_tapdec_enable_halfwaves(struct tap_dec_t *tap, uint8_t halfwaves);
+
+#if __GNUC__ >= 4
+ __attribute__ ((visibility ("hidden")))
+#endif
+void builtin_tapdec_exit(struct tap_dec_t *tap);
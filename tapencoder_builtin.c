@@ -0,0 +1,404 @@
+/* Audiotap shared library: a higher-level interface to TAP shared library
+ *
+ * Built-in TAP encoder, used when the TAP encoder library is not available
+ * or not wanted.
+ *
+ * The signal is followed from a local maximum to the next local minimum and
+ * back. A maximum (or minimum) is recognised once the signal has come back
+ * from it by sensitivity% of the last swing, or by half the minimum swing
+ * (initial_threshold, in 8-bit sample units), whichever is more. Pulses end
+ * where the signal, after a maximum, falls through the level halfway between
+ * that maximum and the minimum before it (or rises through it after a
+ * minimum, if inverted; or both, if triggering on both edges). That point is
+ * interpolated between samples, and the fraction is carried over to the next
+ * pulse. Pulses shorter than min_duration samples are joined with the
+ * following one.
+ *
+ * Most samples are either on a slope or between a maximum and the point
+ * where it is recognised: runs of such samples are skipped with SSE2 or AVX2
+ * kernels where available.
+ *
+ * The program is distributed under the GNU Lesser General Public License.
+ * See file LESSER-LICENSE.TXT for details.
+ */
+
+#include <stdlib.h>
+#include "tapencoder_builtin.h"
+
+#if defined __GNUC__ && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)) \
+ && (defined __x86_64__ || defined __i386__)
+#define X86_KERNELS
+#include <immintrin.h>
+#endif
+
+/* Number of samples from the start of x which continue a strictly
+   increasing (or decreasing) sequence. x[-1] must be valid */
+typedef uint32_t (*monotonic_run_t)(const int32_t *x, uint32_t n, int rising);
+/* Number of samples from the start of x between low and high */
+typedef uint32_t (*quiet_run_t)(const int32_t *x, uint32_t n, int32_t low, int32_t high);
+
+/* Trigger points are in 1/256 of a sample */
+#define FRACTION_BITS 8
+
+struct tap_enc_t {
+  uint64_t pos;            /* samples seen so far */
+  uint64_t last_trigger;   /* where the last pulse ended, in 1/256 samples */
+  uint64_t extreme_pos;    /* where the current extreme was first seen */
+  int32_t extreme;         /* highest sample so far if rising, lowest if not */
+  int32_t opposite;        /* extreme of the previous halfwave */
+  int32_t level;           /* last maximum */
+  int32_t crossing;        /* level the signal must cross to trigger */
+  int32_t prev;            /* last sample of the previous buffer */
+  int64_t min_swing;
+  uint32_t min_duration;
+  uint8_t sensitivity;
+  uint8_t rising;
+  uint8_t crossing_pending;
+  uint8_t turns;           /* extremes seen so far, up to 2 */
+  uint8_t started;
+  uint8_t trigger_on_max;
+  uint8_t both_edges;
+  monotonic_run_t monotonic_run;
+  quiet_run_t quiet_run;
+};
+
+static uint32_t monotonic_run_scalar(const int32_t *x, uint32_t n, int rising){
+  uint32_t i;
+
+  if (rising){
+    for (i = 0; i < n && x[i] > (x + i)[-1]; i++);
+  }
+  else{
+    for (i = 0; i < n && x[i] < (x + i)[-1]; i++);
+  }
+  return i;
+}
+
+static uint32_t quiet_run_scalar(const int32_t *x, uint32_t n, int32_t low, int32_t high){
+  uint32_t i;
+
+  for (i = 0; i < n && x[i] >= low && x[i] <= high; i++);
+  return i;
+}
+
+#ifdef X86_KERNELS
+
+__attribute__ ((target ("sse2")))
+static uint32_t monotonic_run_sse2(const int32_t *x, uint32_t n, int rising){
+  uint32_t i;
+
+  for (i = 0; i + 4 <= n; i += 4){
+    __m128i cur = _mm_loadu_si128((const __m128i *)(x + i));
+    __m128i prev = _mm_loadu_si128((const __m128i *)(x + i - 1));
+    int mask = _mm_movemask_ps(_mm_castsi128_ps(rising ? _mm_cmpgt_epi32(cur, prev)
+                                                       : _mm_cmpgt_epi32(prev, cur)));
+    if (mask != 0xF)
+      return i + __builtin_ctz(~mask);
+  }
+  return i + monotonic_run_scalar(x + i, n - i, rising);
+}
+
+__attribute__ ((target ("sse2")))
+static uint32_t quiet_run_sse2(const int32_t *x, uint32_t n, int32_t low, int32_t high){
+  __m128i vlow = _mm_set1_epi32(low), vhigh = _mm_set1_epi32(high);
+  uint32_t i;
+
+  for (i = 0; i + 4 <= n; i += 4){
+    __m128i cur = _mm_loadu_si128((const __m128i *)(x + i));
+    __m128i out = _mm_or_si128(_mm_cmpgt_epi32(vlow, cur), _mm_cmpgt_epi32(cur, vhigh));
+    int mask = _mm_movemask_ps(_mm_castsi128_ps(out));
+    if (mask != 0)
+      return i + __builtin_ctz(mask);
+  }
+  return i + quiet_run_scalar(x + i, n - i, low, high);
+}
+
+__attribute__ ((target ("avx2")))
+static uint32_t monotonic_run_avx2(const int32_t *x, uint32_t n, int rising){
+  uint32_t i;
+
+  for (i = 0; i + 8 <= n; i += 8){
+    __m256i cur = _mm256_loadu_si256((const __m256i *)(x + i));
+    __m256i prev = _mm256_loadu_si256((const __m256i *)(x + i - 1));
+    int mask = _mm256_movemask_ps(_mm256_castsi256_ps(rising ? _mm256_cmpgt_epi32(cur, prev)
+                                                             : _mm256_cmpgt_epi32(prev, cur)));
+    if (mask != 0xFF)
+      return i + __builtin_ctz(~mask);
+  }
+  return i + monotonic_run_sse2(x + i, n - i, rising);
+}
+
+__attribute__ ((target ("avx2")))
+static uint32_t quiet_run_avx2(const int32_t *x, uint32_t n, int32_t low, int32_t high){
+  __m256i vlow = _mm256_set1_epi32(low), vhigh = _mm256_set1_epi32(high);
+  uint32_t i;
+
+  for (i = 0; i + 8 <= n; i += 8){
+    __m256i cur = _mm256_loadu_si256((const __m256i *)(x + i));
+    __m256i out = _mm256_or_si256(_mm256_cmpgt_epi32(vlow, cur), _mm256_cmpgt_epi32(cur, vhigh));
+    int mask = _mm256_movemask_ps(_mm256_castsi256_ps(out));
+    if (mask != 0)
+      return i + __builtin_ctz(mask);
+  }
+  return i + quiet_run_sse2(x + i, n - i, low, high);
+}
+
+#endif /* X86_KERNELS */
+
+/* Kernels are chosen per encoder, so that there is no shared state */
+static void choose_kernels(struct tap_enc_t *tap){
+  tap->monotonic_run = monotonic_run_scalar;
+  tap->quiet_run = quiet_run_scalar;
+#ifdef X86_KERNELS
+  if (__builtin_cpu_supports("avx2")){
+    tap->monotonic_run = monotonic_run_avx2;
+    tap->quiet_run = quiet_run_avx2;
+  }
+  else if (__builtin_cpu_supports("sse2")){
+    tap->monotonic_run = monotonic_run_sse2;
+    tap->quiet_run = quiet_run_sse2;
+  }
+#endif
+}
+
+#if __GNUC__ >= 4
+ __attribute__ ((visibility ("hidden")))
+#endif
+struct tap_enc_t *builtin_tapenc_init2(uint32_t min_duration, uint8_t sensitivity, uint8_t initial_threshold, uint8_t inverted){
+  struct tap_enc_t *tap = (struct tap_enc_t *)calloc(1, sizeof(struct tap_enc_t));
+
+  if (tap == NULL)
+    return NULL;
+  choose_kernels(tap);
+  tap->min_duration = min_duration;
+  tap->sensitivity = sensitivity > 100 ? 100 : sensitivity;
+  tap->min_swing = (int64_t)initial_threshold << 24;
+  tap->trigger_on_max = !inverted;
+  return tap;
+}
+
+/* How far the signal must come back from the current extreme */
+static int64_t hysteresis(const struct tap_enc_t *tap){
+  int64_t swing = (int64_t)tap->extreme - tap->opposite;
+  int64_t h;
+
+  if (swing < 0)
+    swing = -swing;
+  h = swing * tap->sensitivity / 100;
+  return h > tap->min_swing / 2 ? h : tap->min_swing / 2;
+}
+
+static int32_t clamp(int64_t value){
+  return value > INT32_MAX ? INT32_MAX : value < INT32_MIN ? INT32_MIN : (int32_t)value;
+}
+
+/* Called when the current extreme turns out to be a maximum (if rising) or
+   a minimum */
+static void turn(struct tap_enc_t *tap, int32_t sample){
+  int is_max = tap->rising;
+
+  if (is_max)
+    tap->level = tap->extreme;
+  /* the first sample is not a real extreme, so the crossing level is only
+     known from the third extreme on */
+  tap->crossing_pending = tap->turns == 2 && (tap->both_edges || is_max == tap->trigger_on_max);
+  if (tap->turns < 2)
+    tap->turns++;
+  tap->crossing = (int32_t)(((int64_t)tap->extreme + tap->opposite) / 2);
+  tap->rising = !tap->rising;
+  tap->opposite = tap->extreme;
+  tap->extreme = sample;
+  tap->extreme_pos = tap->pos;
+}
+
+/* Called when sample (at tap->pos) is past the crossing level and prev (the
+   sample before) was not. Returns the length of the pulse ending there, or 0 */
+static uint32_t trigger(struct tap_enc_t *tap, int32_t prev, int32_t sample){
+  int64_t num = (int64_t)prev - tap->crossing;
+  int64_t den = (int64_t)prev - sample;
+  uint64_t point, length;
+
+  tap->crossing_pending = 0;
+  if (den < 0){
+    num = -num;
+    den = -den;
+  }
+  if (num < 0 || den == 0)
+    num = 0;
+  else if (num > den)
+    num = den;
+  point = ((tap->pos - 1) << FRACTION_BITS) + (uint64_t)((num << FRACTION_BITS) / (den ? den : 1));
+  if (point <= tap->last_trigger)
+    return 0;
+  length = (point - tap->last_trigger + (1 << (FRACTION_BITS - 1))) >> FRACTION_BITS;
+  if (length < tap->min_duration || length == 0)
+    return 0;
+  /* only whole samples are consumed: the rest goes to the next pulse */
+  tap->last_trigger += length << FRACTION_BITS;
+  return length > UINT32_MAX ? UINT32_MAX : (uint32_t)length;
+}
+
+static int crossed(const struct tap_enc_t *tap, int32_t sample){
+  return tap->rising ? sample >= tap->crossing : sample <= tap->crossing;
+}
+
+#if __GNUC__ >= 4
+ __attribute__ ((visibility ("hidden")))
+#endif
+uint32_t builtin_tapenc_get_pulse(struct tap_enc_t *tap, int32_t *buffer, uint32_t buflen, uint32_t *pulse){
+  uint32_t i = 0;
+
+  *pulse = 0;
+  if (buflen > 0 && !tap->started){
+    tap->started = 1;
+    tap->rising = 1;
+    tap->crossing_pending = 0;
+    tap->turns = 0;
+    tap->extreme = tap->opposite = tap->prev = buffer[0];
+    tap->extreme_pos = tap->pos++;
+    i++;
+  }
+  while (i < buflen){
+    int32_t sample = buffer[i];
+    int32_t prev = i > 0 ? buffer[i - 1] : tap->prev;
+    int64_t h;
+
+    /* the previous sample was a new extreme: skip the rest of the slope */
+    if (i > 0 && tap->extreme_pos == tap->pos - 1){
+      uint32_t run = tap->monotonic_run(buffer + i, buflen - i, tap->rising);
+
+      /* stop before the crossing, if there is one in the run */
+      if (run > 0 && tap->crossing_pending && crossed(tap, buffer[i + run - 1])){
+        uint32_t j;
+
+        for (j = 0; j < run && !crossed(tap, buffer[i + j]); j++);
+        run = j;
+      }
+      if (run > 0){
+        i += run;
+        tap->pos += run;
+        tap->extreme = buffer[i - 1];
+        tap->extreme_pos = tap->pos - 1;
+        continue;
+      }
+    }
+    h = hysteresis(tap);
+    /* skip samples which neither make a new extreme nor a turn. They are
+       not beyond the current extreme, so they cannot cross the level either */
+    {
+      uint32_t run = tap->rising
+        ? tap->quiet_run(buffer + i, buflen - i, clamp(tap->extreme - h), tap->extreme)
+        : tap->quiet_run(buffer + i, buflen - i, tap->extreme, clamp(tap->extreme + h));
+
+      if (run > 0){
+        i += run;
+        tap->pos += run;
+        continue;
+      }
+    }
+    if (tap->rising ? sample > tap->extreme : sample < tap->extreme){
+      tap->extreme = sample;
+      tap->extreme_pos = tap->pos;
+    }
+    else if (sample != tap->extreme)
+      /* the quiet run stopped here, so the signal came back far enough */
+      turn(tap, sample);
+    if (tap->crossing_pending && crossed(tap, sample))
+      *pulse = trigger(tap, prev, sample);
+    tap->pos++;
+    i++;
+    if (*pulse > 0)
+      break;
+  }
+  if (i > 0)
+    tap->prev = buffer[i - 1];
+  return i;
+}
+
+#if __GNUC__ >= 4
+ __attribute__ ((visibility ("hidden")))
+#endif
+uint32_t builtin_tapenc_flush(struct tap_enc_t *tap){
+  uint64_t end = tap->pos << FRACTION_BITS;
+  uint64_t length = end > tap->last_trigger
+    ? (end - tap->last_trigger + (1 << (FRACTION_BITS - 1))) >> FRACTION_BITS : 0;
+
+  tap->last_trigger = end;
+  tap->started = 0;
+  return length > UINT32_MAX ? UINT32_MAX : (uint32_t)length;
+}
+
+#if __GNUC__ >= 4
+ __attribute__ ((visibility ("hidden")))
+#endif
+int32_t builtin_tapenc_get_max(struct tap_enc_t *tap){
+  return tap->level;
+}
+
+#if __GNUC__ >= 4
+ __attribute__ ((visibility ("hidden")))
+#endif
+void builtin_tapenc_invert(struct tap_enc_t *tap){
+  tap->trigger_on_max = !tap->trigger_on_max;
+}
+
+#if __GNUC__ >= 4
+ __attribute__ ((visibility ("hidden")))
+#endif
+void builtin_tapenc_toggle_trigger_on_both_edges(struct tap_enc_t *tap, uint8_t both_edges){
+  tap->both_edges = both_edges;
+}
+
+/* Swings smaller than the silence threshold are ignored, like those smaller
+   than the initial threshold. The minimum duration of non-silence is not
+   used */
+#if __GNUC__ >= 4
+ __attribute__ ((visibility ("hidden")))
+#endif
+void builtin_tapenc_set_silence_threshold(struct tap_enc_t *tap,
+                                          uint8_t silence_threshold,
+                                          uint32_t min_non_silence_duration){
+  if (((int64_t)silence_threshold << 24) > tap->min_swing)
+    tap->min_swing = (int64_t)silence_threshold << 24;
+}
+
+#if __GNUC__ >= 4
+ __attribute__ ((visibility ("hidden")))
+#endif
+void builtin_tapenc_exit(struct tap_enc_t *tap){
+  free(tap);
+}
+
+#if __GNUC__ >= 4
+ __attribute__ ((visibility ("hidden")))
+#endif
+struct tap_enc_t *builtin_tapenc_clone(const struct tap_enc_t *tap){
+  struct tap_enc_t *copy = (struct tap_enc_t *)malloc(sizeof(struct tap_enc_t));
+
+  if (copy != NULL)
+    *copy = *tap;
+  return copy;
+}
+
+/* Positions only matter relative to the samples seen so far */
+#if __GNUC__ >= 4
+ __attribute__ ((visibility ("hidden")))
+#endif
+int builtin_tapenc_same_state(const struct tap_enc_t *a, const struct tap_enc_t *b){
+  return (a->pos << FRACTION_BITS) - a->last_trigger == (b->pos << FRACTION_BITS) - b->last_trigger
+      && a->pos - a->extreme_pos == b->pos - b->extreme_pos
+      && a->extreme == b->extreme
+      && a->opposite == b->opposite
+      && a->level == b->level
+      && a->crossing == b->crossing
+      && a->prev == b->prev
+      && a->min_swing == b->min_swing
+      && a->min_duration == b->min_duration
+      && a->sensitivity == b->sensitivity
+      && a->rising == b->rising
+      && a->crossing_pending == b->crossing_pending
+      && a->turns == b->turns
+      && a->started == b->started
+      && a->trigger_on_max == b->trigger_on_max
+      && a->both_edges == b->both_edges;
+}
@@ -0,0 +1,70 @@
+/* Audiotap shared library: a higher-level interface to TAP shared library
+ *
+ * Built-in TAP encoder, used when the TAP encoder library is not available
+ * or not wanted. Same interface as the library (see tapencoder.h)
+ *
+ * The program is distributed under the GNU Lesser General Public License.
+ * See file LESSER-LICENSE.TXT for details.
+ */
+
+#include <stdint.h>
+
+struct tap_enc_t;
+
+#if __GNUC__ >= 4
+ __attribute__ ((visibility ("hidden")))
+#endif
+struct tap_enc_t *builtin_tapenc_init2(uint32_t min_duration, uint8_t sensitivity, uint8_t initial_threshold, uint8_t inverted);
+
+#if __GNUC__ >= 4
+ __attribute__ ((visibility ("hidden")))
+#endif
+uint32_t builtin_tapenc_get_pulse(struct tap_enc_t *tap, int32_t *buffer, uint32_t buflen, uint32_t *pulse);
+
+#if __GNUC__ >= 4
+ __attribute__ ((visibility ("hidden")))
+#endif
+uint32_t builtin_tapenc_flush(struct tap_enc_t *tap);
+
+#if __GNUC__ >= 4
+ __attribute__ ((visibility ("hidden")))
+#endif
+int32_t builtin_tapenc_get_max(struct tap_enc_t *tap);
+
+#if __GNUC__ >= 4
+ __attribute__ ((visibility ("hidden")))
+#endif
+void builtin_tapenc_invert(struct tap_enc_t *tap);
+
+#if __GNUC__ >= 4
+ __attribute__ ((visibility ("hidden")))
+#endif
+void builtin_tapenc_toggle_trigger_on_both_edges(struct tap_enc_t *tap, uint8_t both_edges);
+
+#if __GNUC__ >= 4
+ __attribute__ ((visibility ("hidden")))
+#endif
+void builtin_tapenc_set_silence_threshold(struct tap_enc_t *tap,
+                                          uint8_t silence_threshold,
+                                          uint32_t min_non_silence_duration);
+
+#if __GNUC__ >= 4
+ __attribute__ ((visibility ("hidden")))
+#endif
+void builtin_tapenc_exit(struct tap_enc_t *tap);
+
+/* Not in the library: used to detect the pulses of one input on several
+   threads */
+
+/* A copy of tap, or NULL if out of memory */
+#if __GNUC__ >= 4
+ __attribute__ ((visibility ("hidden")))
+#endif
+struct tap_enc_t *builtin_tapenc_clone(const struct tap_enc_t *tap);
+
+/* Whether a and b, given the same samples from now on, will detect the same
+   pulses, even if they have not seen the same number of samples so far */
+#if __GNUC__ >= 4
+ __attribute__ ((visibility ("hidden")))
+#endif
+int builtin_tapenc_same_state(const struct tap_enc_t *a, const struct tap_enc_t *b);
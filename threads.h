@@ -0,0 +1,28 @@
+/* Audiotap shared library: a higher-level interface to TAP shared library
+ *
+ * Running a function on several threads at once, and a clock
+ *
+ * The program is distributed under the GNU Lesser General Public License.
+ * See file LESSER-LICENSE.TXT for details.
+ */
+
+#include <stdint.h>
+
+#if __GNUC__ >= 4
+ __attribute__ ((visibility ("hidden")))
+#endif
+unsigned int get_num_cores(void);
+
+/* Runs function(arg) on num_threads threads, the calling one being one of
+   them, and returns when all have finished. If threads cannot be created,
+   fewer of them are used */
+#if __GNUC__ >= 4
+ __attribute__ ((visibility ("hidden")))
+#endif
+void run_on_threads(unsigned int num_threads, void (*function)(void *arg), void *arg);
+
+/* Time in nanoseconds from some fixed point, never going back */
+#if __GNUC__ >= 4
+ __attribute__ ((visibility ("hidden")))
+#endif
+uint64_t get_time_ns(void);
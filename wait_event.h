@@ -10,10 +10,11 @@ int size_of_wait_event(void);
 #endif
 void create_wait_event(struct wait_event *wait_event);
 
+/* Returns whether it had to wait */
 #if __GNUC__ >= 4
  __attribute__ ((visibility ("hidden")))
 #endif
-void pause_if_necessary(struct wait_event *wait_event);
+int pause_if_necessary(struct wait_event *wait_event);
 
 #if __GNUC__ >= 4
  __attribute__ ((visibility ("hidden")))
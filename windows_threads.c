@@ -0,0 +1,62 @@
+#include <windows.h>
+#include <stdlib.h>
+#include "threads.h"
+
+struct thread_start {
+  void (*function)(void *arg);
+  void *arg;
+};
+
+static DWORD WINAPI thread_start(LPVOID start){
+  ((struct thread_start *)start)->function(((struct thread_start *)start)->arg);
+  return 0;
+}
+
+#if __GNUC__ >= 4
+ __attribute__ ((visibility ("hidden")))
+#endif
+unsigned int get_num_cores(void){
+  SYSTEM_INFO info;
+
+  GetSystemInfo(&info);
+  return info.dwNumberOfProcessors > 0 ? info.dwNumberOfProcessors : 1;
+}
+
+#if __GNUC__ >= 4
+ __attribute__ ((visibility ("hidden")))
+#endif
+void run_on_threads(unsigned int num_threads, void (*function)(void *arg), void *arg){
+  struct thread_start start;
+  HANDLE *threads = NULL;
+  unsigned int i, started = 0;
+
+  start.function = function;
+  start.arg = arg;
+  if (num_threads > 1)
+    threads = (HANDLE *)malloc((num_threads - 1) * sizeof(HANDLE));
+  if (threads != NULL){
+    for (i = 0; i < num_threads - 1; i++){
+      if ((threads[i] = CreateThread(NULL, 0, thread_start, &start, 0, NULL)) == NULL)
+        break;
+      started++;
+    }
+  }
+  function(arg);
+  for (i = 0; i < started; i++){
+    WaitForSingleObject(threads[i], INFINITE);
+    CloseHandle(threads[i]);
+  }
+  free(threads);
+}
+
+#if __GNUC__ >= 4
+ __attribute__ ((visibility ("hidden")))
+#endif
+uint64_t get_time_ns(void){
+  LARGE_INTEGER count, freq;
+
+  QueryPerformanceCounter(&count);
+  QueryPerformanceFrequency(&freq);
+  return (uint64_t)(count.QuadPart / freq.QuadPart) * 1000000000
+       + (uint64_t)(count.QuadPart % freq.QuadPart) * 1000000000 / freq.QuadPart;
+}
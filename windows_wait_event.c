@@ -22,8 +22,11 @@ void create_wait_event(struct wait_event *wait_event) {
 #if __GNUC__ >= 4
  __attribute__ ((visibility ("hidden")))
 #endif
-void pause_if_necessary(struct wait_event *wait_event){
+int pause_if_necessary(struct wait_event *wait_event){
+  if (WaitForSingleObject(wait_event->wait_event, 0) == WAIT_OBJECT_0)
+    return 0;
   WaitForSingleObject(wait_event->wait_event, INFINITE);
+  return 1;
 }
 
 #if __GNUC__ >= 4
@@ -0,0 +1,74 @@
+/* Audiotap shared library: a higher-level interface to TAP shared library
+ *
+ * Header file for zlib library, modified by replacing prototypes with
+ * pointers to functions, so functions can be loaded with dlsym/GetProcAddress.
+ * Only the parts needed to inflate a stream are here.
+ *
+ * Original file (C) 1995-2012 Jean-loup Gailly and Mark Adler
+ *
+ * The program is distributed under the GNU Lesser General Public License.
+ * See file LESSER-LICENSE.TXT for details.
+ */
+
+#if !defined ZLIB_DECLARE_HERE
+#define EXTERN extern
+#elif __GNUC__ >= 4
+#define EXTERN __attribute__ ((visibility ("hidden")))
+#else
+#define EXTERN
+#endif
+
+#include "audiotap.h"
+
+#define ZLIB_VERSION "1.2.3"
+
+#define Z_NO_FLUSH      0
+#define Z_OK            0
+#define Z_STREAM_END    1
+#define Z_NEED_DICT     2
+#define Z_ERRNO        (-1)
+#define Z_STREAM_ERROR (-2)
+#define Z_DATA_ERROR   (-3)
+#define Z_MEM_ERROR    (-4)
+#define Z_BUF_ERROR    (-5)
+
+typedef void *(*alloc_func)(void *opaque, unsigned int items, unsigned int size);
+typedef void  (*free_func)(void *opaque, void *address);
+
+struct internal_state;
+
+typedef struct z_stream_s {
+  const unsigned char *next_in; /* next input byte */
+  unsigned int avail_in;  /* number of bytes available at next_in */
+  unsigned long total_in; /* total number of input bytes read so far */
+
+  unsigned char *next_out; /* next output byte should be put there */
+  unsigned int avail_out; /* remaining free space at next_out */
+  unsigned long total_out; /* total number of bytes output so far */
+
+  const char *msg;      /* last error message, NULL if no error */
+  struct internal_state *state; /* not visible by applications */
+
+  alloc_func zalloc;  /* used to allocate the internal state */
+  free_func  zfree;   /* used to free the internal state */
+  void      *opaque;  /* private data object passed to zalloc and zfree */
+
+  int     data_type;  /* best guess about the data type */
+  unsigned long adler;      /* adler32 value of the uncompressed data */
+  unsigned long reserved;   /* reserved for future use */
+} z_stream;
+
+EXTERN int (*inflateInit_)(z_stream *strm, const char *version, int stream_size);
+EXTERN int (*inflate)(z_stream *strm, int flush);
+EXTERN int (*inflateReset)(z_stream *strm);
+EXTERN int (*inflateEnd)(z_stream *strm);
+
+#define inflateInit(strm) inflateInit_((strm), ZLIB_VERSION, (int)sizeof(z_stream))
+
+/* zlib is not reported in struct audiotap_init_status, which is part of the
+ * ABI: this tells whether Z-RLE compressed CSW files can be read
+ */
+#if __GNUC__ >= 4
+ __attribute__ ((visibility ("hidden")))
+#endif
+extern enum library_status zlib_init_status;